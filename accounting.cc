@@ -0,0 +1,150 @@
+#include "accounting.h"
+
+#include <sys/resource.h>
+#include <cstdlib>
+
+static thread_local MemoryAccount *current = nullptr;
+
+//Room kept in front of each hooked allocation for its size. 16 bytes keeps
+//the block as aligned as malloc's.
+static const size_t HEADER = 16;
+
+MemoryAccount::MemoryAccount(MemoryBudget *budget)
+    : budget(budget)
+{
+}
+
+MemoryAccount::~MemoryAccount()
+{
+    if (admitted)
+        budget->leave(held);
+}
+
+void MemoryAccount::add(size_t bytes)
+{
+    used += bytes;
+
+    if (used <= high)
+        return;
+
+    high = used;
+
+    // Allocations can't wait for room, so a file using more than it was
+    // expected to just takes more of the budget
+    if (admitted && high > held) {
+        budget->grow(high - held);
+        held = high;
+    }
+}
+
+void MemoryAccount::remove(size_t bytes)
+{
+    used -= bytes < used ? bytes : used;
+}
+
+void MemoryAccount::reserve(uint64_t estimate)
+{
+    if (!budget || admitted)
+        return;
+
+    held = estimate > high ? estimate : high;
+    budget->admit(held);
+    admitted = true;
+}
+
+AccountScope::AccountScope(MemoryAccount &account)
+    : previous(current)
+{
+    current = &account;
+}
+
+AccountScope::~AccountScope()
+{
+    current = previous;
+}
+
+MemoryAccount *current_account()
+{
+    return current;
+}
+
+MemoryCharge::MemoryCharge(size_t bytes)
+    : account(current), bytes(bytes)
+{
+    if (account)
+        account->add(bytes);
+}
+
+MemoryCharge::~MemoryCharge()
+{
+    if (account)
+        account->remove(bytes);
+}
+
+void *account_malloc(MemoryAccount *account, size_t size)
+{
+    uint8_t *block = (uint8_t *) malloc(size + HEADER);
+
+    if (!block)
+        return nullptr;
+
+    *(size_t *) block = size;
+
+    if (account)
+        account->add(size);
+
+    return block + HEADER;
+}
+
+void account_free(MemoryAccount *account, void *ptr)
+{
+    if (!ptr)
+        return;
+
+    uint8_t *block = (uint8_t *) ptr - HEADER;
+
+    if (account)
+        account->remove(*(size_t *) block);
+
+    free(block);
+}
+
+void MemoryBudget::admit(uint64_t bytes)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+
+    changed.wait(lock, [&] { return running == 0 || held + bytes <= limit; });
+
+    held += bytes;
+    running++;
+}
+
+void MemoryBudget::grow(uint64_t bytes)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    held += bytes;
+}
+
+void MemoryBudget::leave(uint64_t bytes)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        held -= bytes;
+        running--;
+    }
+
+    changed.notify_all();
+}
+
+uint64_t peak_rss()
+{
+    rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+
+    //Linux reports kilobytes
+    return (uint64_t) usage.ru_maxrss * 1024;
+}
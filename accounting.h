@@ -0,0 +1,110 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+class MemoryBudget;
+
+// The memory one conversion is using: the AlignedBuffers allocated while
+// it is the thread's account, libpng's and zlib's allocations made through
+// the hooks below, and charges for memory that can only be estimated, such
+// as libtiff's strip buffers. Only the thread converting the file touches
+// it.
+class MemoryAccount
+{
+public:
+    // With a budget, the account's peak counts against it until the
+    // account is destroyed
+    explicit MemoryAccount(MemoryBudget *budget = nullptr);
+    ~MemoryAccount();
+
+    MemoryAccount(const MemoryAccount &) = delete;
+    MemoryAccount &operator=(const MemoryAccount &) = delete;
+
+    void add(size_t bytes);
+    void remove(size_t bytes);
+
+    uint64_t current() const { return used; }
+    uint64_t peak() const { return high; }
+
+    // Waits until the budget has room for an estimate of what the file
+    // will need, and holds that much of it
+    void reserve(uint64_t estimate);
+
+private:
+    MemoryBudget *budget;
+    uint64_t used = 0;
+    uint64_t high = 0;
+    //Bytes held in the budget: the larger of the estimate and the peak
+    uint64_t held = 0;
+    bool admitted = false;
+};
+
+// Makes account the one allocations on this thread are charged to, until
+// the scope ends
+class AccountScope
+{
+public:
+    explicit AccountScope(MemoryAccount &account);
+    ~AccountScope();
+
+    AccountScope(const AccountScope &) = delete;
+    AccountScope &operator=(const AccountScope &) = delete;
+
+private:
+    MemoryAccount *previous;
+};
+
+// The account of the conversion running on this thread, or nullptr
+MemoryAccount *current_account();
+
+// Charges a fixed amount to the current account for as long as it lives
+class MemoryCharge
+{
+public:
+    explicit MemoryCharge(size_t bytes);
+    ~MemoryCharge();
+
+    MemoryCharge(const MemoryCharge &) = delete;
+    MemoryCharge &operator=(const MemoryCharge &) = delete;
+
+private:
+    MemoryAccount *account;
+    size_t bytes;
+};
+
+// malloc and free that charge an account, for libpng's and zlib's
+// allocator hooks. account may be nullptr.
+void *account_malloc(MemoryAccount *account, size_t size);
+void account_free(MemoryAccount *account, void *ptr);
+
+// Memory shared by the files converted at once. Each file holds the larger
+// of its estimate and the peak it has actually used. A file waits to start
+// while the others hold so much that its estimate doesn't fit, unless no
+// other file is running.
+class MemoryBudget
+{
+public:
+    explicit MemoryBudget(uint64_t limit) : limit(limit) {}
+
+    uint64_t size() const { return limit; }
+
+private:
+    friend class MemoryAccount;
+
+    void admit(uint64_t bytes);
+    void grow(uint64_t bytes);
+    void leave(uint64_t bytes);
+
+    const uint64_t limit;
+    uint64_t held = 0;
+    unsigned running = 0;
+
+    std::mutex mutex;
+    std::condition_variable changed;
+};
+
+// Peak resident set size of the whole process, in bytes
+uint64_t peak_rss();
@@ -0,0 +1,109 @@
+#include "background.h"
+
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+
+//From linux/ioprio.h, which not every system has
+static const int IOPRIO_CLASS_IDLE = 3;
+static const int IOPRIO_CLASS_SHIFT = 13;
+static const int IOPRIO_WHO_PROCESS = 1;
+
+//Time between samples of the host's load
+static const std::chrono::seconds INTERVAL(2);
+//Load average from other processes, per CPU, at which the host counts as busy
+static const double BUSY_LOAD = 0.75;
+//Percentage of the last 10 seconds in which some task was stalled on the
+//CPU or on I/O at which the host counts as busy
+static const double BUSY_PRESSURE = 20;
+//Below this share of every busy threshold the host counts as calm
+static const double CALM = 0.5;
+
+bool enter_background()
+{
+    sched_param param{};
+
+    bool cpu = sched_setscheduler(0, SCHED_IDLE, &param) == 0 ||
+               setpriority(PRIO_PROCESS, 0, 19) == 0;
+
+    //The idle class needs no privileges, but not every I/O scheduler honours it
+    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+
+    return cpu;
+}
+
+// The "some avg10" figure of a pressure stall information file, or -1
+// without PSI
+static double read_pressure(const char *file)
+{
+    std::ifstream in(file);
+    std::string line;
+    double avg10 = -1;
+
+    if (std::getline(in, line))
+        sscanf(line.c_str(), "some avg10=%lf", &avg10);
+
+    return avg10;
+}
+
+// The 1 minute load average, or -1 if it can't be read
+static double read_load()
+{
+    std::ifstream in("/proc/loadavg");
+    double load = -1;
+
+    if (!(in >> load))
+        return -1;
+
+    return load;
+}
+
+LoadMonitor::LoadMonitor(WorkerPool &pool)
+    : pool(pool), thread(&LoadMonitor::watch, this)
+{
+}
+
+LoadMonitor::~LoadMonitor()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+
+    stop_requested.notify_all();
+    thread.join();
+}
+
+void LoadMonitor::watch()
+{
+    double cpus = (double) std::max(sysconf(_SC_NPROCESSORS_ONLN), 1L);
+    std::unique_lock<std::mutex> lock(mutex);
+
+    while (!stop_requested.wait_for(lock, INTERVAL, [this] { return stopping; })) {
+        unsigned workers = pool.worker_limit();
+
+        // How close the host is to busy by each measure, 1 being busy. Our
+        // own workers are part of the load average while they run a job, but
+        // not while they are idle or held back by the limit.
+        double busy = 0;
+        double load = read_load();
+
+        if (load >= 0)
+            busy = std::max(busy, (load - pool.running_workers()) / cpus / BUSY_LOAD);
+
+        busy = std::max(busy, read_pressure("/proc/pressure/cpu") / BUSY_PRESSURE);
+        busy = std::max(busy, read_pressure("/proc/pressure/io") / BUSY_PRESSURE);
+
+        if (busy >= 1)
+            pool.limit_workers(workers - 1);
+        else if (busy < CALM)
+            pool.limit_workers(workers + 1);
+    }
+}
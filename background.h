@@ -0,0 +1,36 @@
+#pragma once
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "workers.h"
+
+// Drops the process to idle priority: the SCHED_IDLE policy for the CPU,
+// or the lowest nice value if that is refused, and the idle I/O class for
+// the disk. Threads started afterwards inherit both. Returns false if
+// neither CPU setting could be applied.
+bool enter_background();
+
+// Keeps a worker pool out of the way of the rest of the host. Every few
+// seconds it reads the load average and the CPU and I/O pressure stall
+// information, and takes a worker away while the host is busy or gives one
+// back once it has calmed down.
+class LoadMonitor
+{
+public:
+    explicit LoadMonitor(WorkerPool &pool);
+    ~LoadMonitor();
+
+    LoadMonitor(const LoadMonitor &) = delete;
+    LoadMonitor &operator=(const LoadMonitor &) = delete;
+
+private:
+    void watch();
+
+    WorkerPool &pool;
+    std::mutex mutex;
+    std::condition_variable stop_requested;
+    bool stopping = false;
+    std::thread thread;
+};
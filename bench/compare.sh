@@ -0,0 +1,67 @@
+#!/bin/sh
+#
+# Compares microbench results against a baseline.
+#
+# Usage: bench/compare.sh BASELINE_JSON CURRENT_JSON [THRESHOLD_PERCENT]
+#
+# Both files are written by microbench --json. A benchmark that takes more
+# than THRESHOLD_PERCENT (default 10) longer per byte than in the baseline
+# is flagged as a regression, and the script then exits with status 1.
+# Benchmarks found in only one of the files are listed but not flagged.
+
+set -e
+
+if [ $# -lt 2 ]; then
+    sed -n '3,11p' "$0" | sed 's/^# \{0,1\}//'
+    exit 1
+fi
+
+BASELINE=$1
+CURRENT=$2
+THRESHOLD=${3:-10}
+
+# Prints "name ns_per_byte" for each benchmark of a results file
+results() {
+    sed -n 's/.*"name": "\([^"]*\)".*"ns_per_byte": \([0-9.eE+-]*\).*/\1 \2/p' "$1"
+}
+
+results "$BASELINE" > "${TMPDIR:-/tmp}/baseline.$$"
+trap 'rm -f "${TMPDIR:-/tmp}/baseline.$$"' EXIT
+
+results "$CURRENT" | awk -v threshold="$THRESHOLD" -v baseline="${TMPDIR:-/tmp}/baseline.$$" '
+    BEGIN {
+        while ((getline line < baseline) > 0) {
+            split(line, field, " ")
+            base[field[1]] = field[2]
+        }
+
+        printf "%-36s %12s %12s %9s\n", "benchmark", "baseline", "current", "change"
+    }
+
+    {
+        seen[$1] = 1
+
+        if (!($1 in base)) {
+            printf "%-36s %12s %12.4f %9s\n", $1, "-", $2, "new"
+            next
+        }
+
+        change = ($2 - base[$1]) / base[$1] * 100
+        flag = change > threshold ? "  REGRESSION" : ""
+
+        if (flag != "")
+            regressions++
+
+        printf "%-36s %12.4f %12.4f %+8.1f%%%s\n", $1, base[$1], $2, change, flag
+    }
+
+    END {
+        for (name in base)
+            if (!(name in seen))
+                printf "%-36s %12.4f %12s %9s\n", name, base[name], "-", "missing"
+
+        if (regressions) {
+            printf "\n%d benchmark(s) slower than the baseline by more than %s%%\n", regressions, threshold
+            exit 1
+        }
+    }'
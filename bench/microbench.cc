@@ -0,0 +1,395 @@
+// Times each hot kernel on its own, on fixed buffers, for every SIMD
+// variant the CPU supports.
+//
+// The buffers hold a smooth gradient with a little noise, like the images
+// of mkcorpus, so that the checksums and compressors see realistic data.
+// Each benchmark is repeated until a sample takes long enough to time,
+// and the best of several samples is reported. With --json the results
+// are also written in the form bench/compare.sh reads.
+
+#include <zlib.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#ifdef HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+
+#include "../buffer.h"
+#include "../icc.h"
+#include "../kernels.h"
+
+//Bytes of input each benchmark works through per call
+static const size_t BUFFER_SIZE = 1 << 20;
+//Width in pixels of the rows the row kernels are given
+static const uint32_t ROW_WIDTH = 4096;
+
+struct Result
+{
+    std::string name;
+    //Input bytes per call
+    size_t bytes;
+    double ns_per_byte;
+};
+
+struct Settings
+{
+    //Shortest time a sample must take to be trusted
+    std::chrono::nanoseconds min_time = std::chrono::milliseconds(20);
+    int samples = 5;
+    //Only benchmarks whose name contains this
+    std::string filter;
+};
+
+// Keeps the compiler from dropping work whose result isn't used
+static void clobber(const void *p)
+{
+    asm volatile("" : : "r"(p) : "memory");
+}
+
+// Runs work until one sample takes at least min_time, then keeps the best
+// of the samples
+static double time_call(const Settings &settings, const std::function<void()> &work)
+{
+    typedef std::chrono::steady_clock Clock;
+    size_t calls = 1;
+
+    for (;;) {
+        Clock::time_point start = Clock::now();
+
+        for (size_t i = 0; i < calls; i++)
+            work();
+
+        if (Clock::now() - start >= settings.min_time)
+            break;
+
+        calls *= 2;
+    }
+
+    double best = 0;
+
+    for (int s = 0; s < settings.samples; s++) {
+        Clock::time_point start = Clock::now();
+
+        for (size_t i = 0; i < calls; i++)
+            work();
+
+        double ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count() / calls;
+
+        if (s == 0 || ns < best)
+            best = ns;
+    }
+
+    return best;
+}
+
+class Bench
+{
+public:
+    explicit Bench(const Settings &settings) : settings(settings) {}
+
+    void run(const std::string &name, size_t bytes, const std::function<void()> &work)
+    {
+        if (!settings.filter.empty() && name.find(settings.filter) == std::string::npos)
+            return;
+
+        double ns = time_call(settings, work);
+        Result result{name, bytes, ns / bytes};
+
+        printf("%-36s %10.3f ns/byte %10.1f MB/s\n", name.c_str(), result.ns_per_byte,
+               1e3 / result.ns_per_byte);
+        fflush(stdout);
+
+        results.push_back(result);
+    }
+
+    std::vector<Result> results;
+
+private:
+    Settings settings;
+};
+
+// A gradient in 16-bit units with some noise, as RGB samples
+static void fill(uint16_t *samples, size_t count)
+{
+    std::mt19937 random(12345);
+
+    for (size_t i = 0; i < count; i++) {
+        uint32_t x = (uint32_t) (i / 3 % ROW_WIDTH);
+        uint32_t c = (uint32_t) (i % 3);
+        uint32_t v = (x * 65535u / ROW_WIDTH * (c + 1)) / 4 + (random() & 0x3ff);
+
+        samples[i] = (uint16_t) v;
+    }
+}
+
+static void put_u32(std::vector<uint8_t> &out, size_t at, uint32_t v)
+{
+    out[at] = (uint8_t) (v >> 24);
+    out[at + 1] = (uint8_t) (v >> 16);
+    out[at + 2] = (uint8_t) (v >> 8);
+    out[at + 3] = (uint8_t) v;
+}
+
+// A matrix/TRC profile with Adobe RGB-like primaries and gamma 2.2 curves,
+// enough for build_srgb_lut()
+static std::vector<uint8_t> make_profile()
+{
+    static const char *const TAGS[6] = {"rXYZ", "gXYZ", "bXYZ", "rTRC", "gTRC", "bTRC"};
+    static const double PRIMARIES[3][3] = {
+        {0.6097, 0.3111, 0.0195}, {0.2053, 0.6257, 0.0609}, {0.1492, 0.0632, 0.7446}
+    };
+
+    std::vector<uint8_t> profile(132 + 6 * 12 + 3 * 20 + 3 * 14, 0);
+    size_t offset = 132 + 6 * 12;
+
+    memcpy(&profile[16], "RGB ", 4);
+    memcpy(&profile[20], "XYZ ", 4);
+    put_u32(profile, 128, 6);
+
+    for (int t = 0; t < 6; t++) {
+        size_t size = t < 3 ? 20 : 14;
+        size_t entry = 132 + t * 12;
+
+        memcpy(&profile[entry], TAGS[t], 4);
+        put_u32(profile, entry + 4, (uint32_t) offset);
+        put_u32(profile, entry + 8, (uint32_t) size);
+
+        if (t < 3) {
+            memcpy(&profile[offset], "XYZ ", 4);
+
+            for (int i = 0; i < 3; i++)
+                put_u32(profile, offset + 8 + i * 4, (uint32_t) (int32_t) (PRIMARIES[t][i] * 65536));
+        } else {
+            //A curv with one entry is a gamma, in 8.8 fixed point
+            memcpy(&profile[offset], "curv", 4);
+            put_u32(profile, offset + 8, 1);
+            profile[offset + 12] = 2;
+            profile[offset + 13] = 51;
+        }
+
+        offset += size;
+    }
+
+    return profile;
+}
+
+static void bench_kernels(Bench &bench, const KernelTable &k, const AlignedBuffer &input,
+                          AlignedBuffer &output)
+{
+    std::string v = std::string("/") + k.name;
+    const uint16_t *in16 = (const uint16_t *) input.data();
+    uint16_t *out16 = (uint16_t *) output.data();
+    const uint8_t *in8 = input.data();
+    uint8_t *out8 = output.data();
+    size_t samples = BUFFER_SIZE / 2;
+    uint32_t rows = (uint32_t) (samples / (ROW_WIDTH * 3));
+
+    bench.run("swap16" + v, BUFFER_SIZE, [&] { k.swap16(in16, out16, samples); clobber(out16); });
+
+    bench.run("depth_truncate" + v, BUFFER_SIZE, [&] {
+        k.depth16to8_truncate(in16, out8, samples);
+        clobber(out8);
+    });
+
+    bench.run("depth_round" + v, BUFFER_SIZE, [&] {
+        k.depth16to8_round(in16, out8, samples);
+        clobber(out8);
+    });
+
+    bench.run("depth_ordered_rgb" + v, BUFFER_SIZE, [&] {
+        for (uint32_t r = 0; r < rows; r++)
+            k.depth16to8_ordered[3](in16 + (size_t) r * ROW_WIDTH * 3, out8 + (size_t) r * ROW_WIDTH * 3,
+                                    ROW_WIDTH, 3, r);
+        clobber(out8);
+    });
+
+    // The predictor works in place, so each call starts from a fresh copy.
+    // The copy is timed too, which makes these relative numbers.
+    size_t row8 = (size_t) ROW_WIDTH * 3;
+    size_t rows8 = BUFFER_SIZE / row8;
+
+    bench.run("undo_predictor8_rgb" + v, rows8 * row8, [&] {
+        memcpy(out8, in8, rows8 * row8);
+
+        for (size_t r = 0; r < rows8; r++)
+            k.undo_predictor8[3](out8 + r * row8, ROW_WIDTH, 3);
+        clobber(out8);
+    });
+
+    bench.run("undo_predictor16_rgb_swap" + v, (size_t) rows * ROW_WIDTH * 6, [&] {
+        memcpy(out8, in8, (size_t) rows * ROW_WIDTH * 6);
+
+        for (uint32_t r = 0; r < rows; r++)
+            k.undo_predictor16[3](out16 + (size_t) r * ROW_WIDTH * 3, ROW_WIDTH, 3, true);
+        clobber(out16);
+    });
+
+    bench.run("crc32" + v, BUFFER_SIZE, [&] {
+        uint32_t crc = k.crc32(0, in8, BUFFER_SIZE);
+        clobber(&crc);
+    });
+
+    bench.run("adler32" + v, BUFFER_SIZE, [&] {
+        uint32_t adler = k.adler32(1, in8, BUFFER_SIZE);
+        clobber(&adler);
+    });
+
+    static const char *const FILTERS[5] = {"none", "sub", "up", "average", "paeth"};
+
+    for (int type = 0; type < 5; type++) {
+        bench.run(std::string("png_filter_") + FILTERS[type] + v, rows8 * row8, [&] {
+            for (size_t r = 1; r < rows8; r++)
+                k.png_filter(type, in8 + r * row8, in8 + (r - 1) * row8, out8 + r * row8, row8, 3);
+            clobber(out8);
+        });
+    }
+
+    bench.run("filter_cost" + v, BUFFER_SIZE, [&] {
+        uint32_t cost = k.filter_cost(in8, BUFFER_SIZE);
+        clobber(&cost);
+    });
+}
+
+// The color lookup and the deflate backends don't depend on the kernel
+// variant
+static void bench_common(Bench &bench, const AlignedBuffer &input, AlignedBuffer &output)
+{
+    std::vector<uint8_t> profile = make_profile();
+    std::shared_ptr<const ColorLut> lut = build_srgb_lut(profile.data(), profile.size());
+
+    if (lut) {
+        size_t pixels = BUFFER_SIZE / 3;
+
+        bench.run("color_lut_rgb8", pixels * 3, [&] {
+            lut->apply<3>(input.data(), output.data(), (uint32_t) pixels, 3);
+            clobber(output.data());
+        });
+
+        bench.run("color_lut_rgb16", pixels / 2 * 6, [&] {
+            lut->apply<3>((const uint16_t *) input.data(), (uint16_t *) output.data(),
+                          (uint32_t) (pixels / 2), 3);
+            clobber(output.data());
+        });
+    } else {
+        std::cerr << "Could not build a color table from the test profile" << std::endl;
+    }
+
+    std::vector<uint8_t> compressed(compressBound(BUFFER_SIZE));
+    uLongf compressed_size = (uLongf) compressed.size();
+
+    bench.run("zlib_deflate", BUFFER_SIZE, [&] {
+        compressed_size = (uLongf) compressed.size();
+        compress2(compressed.data(), &compressed_size, input.data(), BUFFER_SIZE, Z_DEFAULT_COMPRESSION);
+        clobber(compressed.data());
+    });
+
+    //Timed per byte of decompressed output, like the strip decoders
+    bench.run("zlib_inflate", BUFFER_SIZE, [&] {
+        uLongf size = BUFFER_SIZE;
+        uncompress(output.data(), &size, compressed.data(), compressed_size);
+        clobber(output.data());
+    });
+
+#ifdef HAVE_LIBDEFLATE
+    libdeflate_decompressor *decompressor = libdeflate_alloc_decompressor();
+
+    bench.run("libdeflate_inflate", BUFFER_SIZE, [&] {
+        libdeflate_zlib_decompress(decompressor, compressed.data(), compressed_size,
+                                   output.data(), BUFFER_SIZE, nullptr);
+        clobber(output.data());
+    });
+
+    libdeflate_free_decompressor(decompressor);
+#endif
+}
+
+static bool write_json(const std::string &path, const std::vector<Result> &results)
+{
+    FILE *file = fopen(path.c_str(), "w");
+
+    if (!file)
+        return false;
+
+    //One benchmark per line, which compare.sh relies on
+    fprintf(file, "{\n  \"benchmarks\": [\n");
+
+    for (size_t i = 0; i < results.size(); i++)
+        fprintf(file, "    {\"name\": \"%s\", \"bytes\": %zu, \"ns_per_byte\": %.4f}%s\n",
+                results[i].name.c_str(), results[i].bytes, results[i].ns_per_byte,
+                i + 1 < results.size() ? "," : "");
+
+    fprintf(file, "  ]\n}\n");
+
+    return fclose(file) == 0;
+}
+
+int main(int argc, char *argv[])
+{
+    Settings settings;
+    std::string json;
+    std::vector<const KernelTable *> tables = supported_kernels();
+
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+
+        if (i + 1 < argc && arg == "--json")
+            json = argv[++i];
+        else if (i + 1 < argc && arg == "--filter")
+            settings.filter = argv[++i];
+        else if (i + 1 < argc && arg == "--min-time")
+            settings.min_time = std::chrono::milliseconds(atoi(argv[++i]));
+        else if (i + 1 < argc && arg == "--cpu")
+        {
+            if (!select_kernels(argv[++i]))
+            {
+                std::cerr << "Unsupported CPU variant: " << argv[i] << std::endl;
+
+                return 1;
+            }
+
+            tables = {&kernels()};
+        }
+        else
+        {
+            std::cout << "Usage: " << argv[0] << " [--cpu NAME] [--filter TEXT] [--min-time MS] [--json FILE]" << std::endl
+                      << std::endl
+                      << "Times each kernel for every SIMD variant the CPU supports, or only" << std::endl
+                      << "the --cpu one. --filter runs the benchmarks whose name contains TEXT." << std::endl
+                      << "--json writes the results for bench/compare.sh." << std::endl;
+
+            return 1;
+        }
+    }
+
+    AlignedBuffer input(BUFFER_SIZE);
+    AlignedBuffer output(BUFFER_SIZE * 2);
+
+    fill((uint16_t *) input.data(), BUFFER_SIZE / 2);
+    memset(output.data(), 0, output.size());
+
+    Bench bench(settings);
+
+    for (const KernelTable *table : tables)
+        bench_kernels(bench, *table, input, output);
+
+    bench_common(bench, input, output);
+
+    if (!json.empty() && !write_json(json, bench.results))
+    {
+        std::cerr << "Failed to write: " << json << std::endl;
+
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,70 @@
+// Writes a set of synthetic TIFF files for benchmarking tiff-png.
+//
+// The images are the gradients of synthetic.h, which compress roughly like
+// photographs, in the layouts the converter has fast paths for.
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <tiffio.h>
+#include <cstdlib>
+#include <cstring>
+
+#include "../synthetic.h"
+
+struct CorpusImage
+{
+    const char *name;
+    SyntheticImage image;
+};
+
+static const CorpusImage IMAGES[] = {
+    {"rgb8-none",      {4096, 3072,  8, 3, COMPRESSION_NONE,          PREDICTOR_NONE,       16}},
+    {"rgb8-lzw",       {4096, 3072,  8, 3, COMPRESSION_LZW,           PREDICTOR_HORIZONTAL, 16}},
+    {"rgb8-deflate",   {4096, 3072,  8, 3, COMPRESSION_ADOBE_DEFLATE, PREDICTOR_HORIZONTAL, 16}},
+    {"rgba8-packbits", {2048, 2048,  8, 4, COMPRESSION_PACKBITS,      PREDICTOR_NONE,       32}},
+    {"rgb16-none",     {2048, 2048, 16, 3, COMPRESSION_NONE,          PREDICTOR_NONE,        8}},
+    {"rgb16-deflate",  {2048, 2048, 16, 3, COMPRESSION_ADOBE_DEFLATE, PREDICTOR_HORIZONTAL,  8}},
+    {"gray8-lzw",      {4096, 4096,  8, 1, COMPRESSION_LZW,           PREDICTOR_NONE,       64}},
+    {"gray16-none",    {2048, 2048, 16, 1, COMPRESSION_NONE,          PREDICTOR_NONE,       16}},
+    {"narrow8-none",   {  64, 65536, 8, 3, COMPRESSION_NONE,          PREDICTOR_NONE,      256}},
+};
+
+static bool write_image(const CorpusImage &corpus_image, const std::string &path, uint32_t scale)
+{
+    SyntheticImage image = corpus_image.image;
+    image.width = std::max<uint32_t>(image.width / scale, 1);
+    image.height = std::max<uint32_t>(image.height / scale, 1);
+
+    return write_synthetic_tiff(image, gradient_pixels(image, image.width * 31 + image.height), path);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        std::cout << "Usage: " << argv[0] << " OUTPUT_DIR [--small]" << std::endl
+                  << std::endl
+                  << "--small divides the image sizes by 8, for quick runs." << std::endl;
+
+        return 1;
+    }
+
+    uint32_t scale = (argc > 2 && strcmp(argv[2], "--small") == 0) ? 8 : 1;
+    int exit_code = 0;
+
+    for (const CorpusImage &image : IMAGES)
+    {
+        std::string path = std::string(argv[1]) + "/" + image.name + ".tiff";
+
+        if (!write_image(image, path, scale))
+        {
+            std::cerr << "Failed to write: " << path << std::endl;
+
+            exit_code = 1;
+        }
+    }
+
+    return exit_code;
+}
@@ -0,0 +1,61 @@
+#!/bin/sh
+#
+# Times tiff-png over a corpus with different settings.
+#
+# Usage: bench/run.sh TIFF_PNG CORPUS_DIR [RUNS]
+#
+# Each configuration converts every TIFF in CORPUS_DIR. The best of RUNS
+# (default 3) wall times is reported, with the input throughput. A
+# profile saved by --calibrate is not loaded, so only the options of each
+# configuration apply.
+# Make a corpus with bench/mkcorpus.
+#
+# Set CONFIGS to a newline separated list of option sets to time other
+# settings.
+
+set -e
+
+if [ $# -lt 2 ]; then
+    sed -n '3,15p' "$0" | sed 's/^# \{0,1\}//'
+    exit 1
+fi
+
+TIFF_PNG=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+CORPUS=$2
+RUNS=${3:-3}
+
+: "${CONFIGS:=--encoder libpng
+--encoder libpng --zbuf-size 64K
+--encoder libpng --zbuf-size 1M
+--encoder custom
+--encoder custom --zbuf-size 64K
+--encoder custom --idat-size 1M --zbuf-size 256K
+--encoder custom --idat-size 4M --zbuf-size 1M
+--encoder custom --jobs 0}"
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+cp "$CORPUS"/*.tif* "$WORK"/
+INPUT_BYTES=$(cat "$WORK"/*.tif* | wc -c)
+
+printf '%-56s %10s %10s %12s\n' "options" "seconds" "MB/s" "png bytes"
+
+echo "$CONFIGS" | while IFS= read -r config; do
+    best=""
+
+    for run in $(seq "$RUNS"); do
+        rm -f "$WORK"/*.png
+        start=$(date +%s.%N)
+        # shellcheck disable=SC2086
+        "$TIFF_PNG" --profile none $config "$WORK"/*.tif* > /dev/null
+        end=$(date +%s.%N)
+        best=$(awk -v s="$start" -v e="$end" -v b="$best" \
+            'BEGIN { t = e - s; if (b == "" || t < b) b = t; print b }')
+    done
+
+    output_bytes=$(cat "$WORK"/*.png | wc -c)
+    rate=$(awk -v n="$INPUT_BYTES" -v t="$best" 'BEGIN { printf "%.1f", n / 1048576 / t }')
+
+    printf '%-56s %10.3f %10s %12s\n' "$config" "$best" "$rate" "$output_bytes"
+done
@@ -0,0 +1,144 @@
+#include "buffer.h"
+
+#include <cstdlib>
+#include <new>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "accounting.h"
+
+static HugePages huge_pages = HugePages::Off;
+
+void set_huge_pages(HugePages mode)
+{
+    huge_pages = mode;
+}
+
+// Maps size bytes, a multiple of the huge page size, backed by huge pages
+// as far as the mode allows. Returns nullptr on failure.
+static uint8_t *map_huge(size_t size, HugePages mode)
+{
+    const size_t HUGE = AlignedBuffer::HUGE_PAGE_SIZE;
+
+    if (mode == HugePages::Explicit) {
+        void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+        if (ptr != MAP_FAILED)
+            return (uint8_t *) ptr;
+    }
+
+    // Transparent huge pages only back aligned 2M ranges, so map one huge
+    // page more than needed and trim the ends to an aligned range
+    void *ptr = mmap(nullptr, size + HUGE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (ptr == MAP_FAILED)
+        return nullptr;
+
+    uintptr_t start = (uintptr_t) ptr;
+    uintptr_t aligned = (start + HUGE - 1) / HUGE * HUGE;
+
+    if (aligned > start)
+        munmap(ptr, aligned - start);
+
+    munmap((void *) (aligned + size), start + HUGE - aligned);
+
+    //Only a hint: without THP support the range keeps regular pages
+    madvise((void *) aligned, size, MADV_HUGEPAGE);
+
+    return (uint8_t *) aligned;
+}
+
+AlignedBuffer::AlignedBuffer(size_t size)
+{
+    resize(size);
+}
+
+AlignedBuffer::~AlignedBuffer()
+{
+    release();
+}
+
+void AlignedBuffer::release()
+{
+    if (account)
+        account->remove(charged);
+
+    if (mapped)
+        munmap(ptr, mapped);
+    else
+        free(ptr);
+
+    ptr = nullptr;
+    length = 0;
+    mapped = 0;
+    account = nullptr;
+    charged = 0;
+}
+
+void AlignedBuffer::resize(size_t size)
+{
+    if (size == length)
+        return;
+
+    release();
+
+    if (size == 0)
+        return;
+
+    if (huge_pages != HugePages::Off && size >= HUGE_PAGE_SIZE) {
+        size_t rounded = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+        ptr = map_huge(rounded, huge_pages);
+
+        if (ptr) {
+            length = size;
+            mapped = rounded;
+            charge(rounded);
+
+            return;
+        }
+    }
+
+    //aligned_alloc wants a multiple of the alignment
+    size_t rounded = (size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+    ptr = (uint8_t *) aligned_alloc(ALIGNMENT, rounded);
+
+    if (!ptr)
+        throw std::bad_alloc();
+
+    length = size;
+    charge(rounded);
+}
+
+void AlignedBuffer::charge(size_t bytes)
+{
+    account = current_account();
+    charged = bytes;
+
+    if (account)
+        account->add(bytes);
+}
+
+std::unique_ptr<MappedFile> MappedFile::map(int fd)
+{
+    struct stat st;
+
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+        return nullptr;
+
+    void *ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (ptr == MAP_FAILED)
+        return nullptr;
+
+    //Strips are read front to back
+    madvise(ptr, st.st_size, MADV_SEQUENTIAL);
+
+    return std::unique_ptr<MappedFile>(new MappedFile((const uint8_t *) ptr, st.st_size));
+}
+
+MappedFile::~MappedFile()
+{
+    munmap((void *) ptr, length);
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+class MemoryAccount;
+
+// How large buffers are backed
+enum class HugePages
+{
+    Off,         //Regular pages from the heap
+    Transparent, //Anonymous mappings marked with MADV_HUGEPAGE
+    Explicit     //Pages from the hugetlbfs pool, or transparent ones if it is empty
+};
+
+// Sets how AlignedBuffers of HUGE_PAGE_SIZE or more are allocated from now
+// on. A multi-megabyte buffer in 4K pages takes hundreds of TLB entries,
+// where huge pages need a handful. If huge pages can't be had, regular
+// ones are used.
+void set_huge_pages(HugePages mode);
+
+// A heap buffer aligned for SIMD loads and stores. Contents are not
+// initialized and are not kept when the buffer is resized. The memory is
+// charged to the thread's current MemoryAccount, if any, when allocated.
+class AlignedBuffer
+{
+public:
+    static const size_t ALIGNMENT = 64;
+    static const size_t HUGE_PAGE_SIZE = 2 << 20;
+
+    AlignedBuffer() = default;
+    explicit AlignedBuffer(size_t size);
+    ~AlignedBuffer();
+
+    AlignedBuffer(const AlignedBuffer &) = delete;
+    AlignedBuffer &operator=(const AlignedBuffer &) = delete;
+
+    void resize(size_t size);
+
+    uint8_t *data() const { return ptr; }
+    size_t size() const { return length; }
+
+private:
+    void release();
+    void charge(size_t bytes);
+
+    uint8_t *ptr = nullptr;
+    size_t length = 0;
+    //Size of the mapping, when the buffer is mapped rather than on the heap
+    size_t mapped = 0;
+    //Where the allocation was charged, and how much
+    MemoryAccount *account = nullptr;
+    size_t charged = 0;
+};
+
+// A read-only memory mapping of a whole file
+class MappedFile
+{
+public:
+    // Maps the file open on fd, or returns nullptr if it can't be mapped
+    static std::unique_ptr<MappedFile> map(int fd);
+
+    ~MappedFile();
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    const uint8_t *data() const { return ptr; }
+    size_t size() const { return length; }
+
+private:
+    MappedFile(const uint8_t *ptr, size_t length) : ptr(ptr), length(length) {}
+
+    const uint8_t *ptr;
+    size_t length;
+};
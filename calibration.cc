@@ -0,0 +1,113 @@
+#include "calibration.h"
+
+#include <tiffio.h>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+
+#include "synthetic.h"
+
+// Small enough that a run takes well under a second a CPU, with strips up
+// to 900K so that the band size matters
+static const SyntheticImage IMAGES[] = {
+    {640, 480, 8, 3, COMPRESSION_ADOBE_DEFLATE, PREDICTOR_HORIZONTAL, 16},
+    {512, 384, 16, 3, COMPRESSION_NONE, PREDICTOR_NONE, 8},
+    {640, 640, 8, 1, COMPRESSION_LZW, PREDICTOR_NONE, 64},
+    {512, 384, 8, 4, COMPRESSION_PACKBITS, PREDICTOR_NONE, 32},
+    {640, 480, 8, 3, COMPRESSION_NONE, PREDICTOR_NONE, 0},
+    {512, 384, 16, 1, COMPRESSION_ADOBE_DEFLATE, PREDICTOR_HORIZONTAL, 0},
+};
+
+std::string default_profile_path()
+{
+    const char *config = getenv("XDG_CONFIG_HOME");
+
+    if (config && *config)
+        return std::string(config) + "/tiff-png/profile";
+
+    const char *home = getenv("HOME");
+
+    if (home && *home)
+        return std::string(home) + "/.config/tiff-png/profile";
+
+    return "";
+}
+
+bool read_profile(const std::string &path, std::vector<std::string> &args)
+{
+    std::ifstream file(path);
+
+    if (!file)
+        return false;
+
+    std::string line;
+
+    while (std::getline(file, line)) {
+        std::istringstream words(line);
+        std::string word;
+
+        while (words >> word) {
+            if (word[0] == '#')
+                break;
+
+            args.push_back(word);
+        }
+    }
+
+    return true;
+}
+
+bool write_profile(const std::string &path, const std::string &comment,
+                   const std::vector<std::string> &options)
+{
+    std::error_code error;
+    std::filesystem::path directory = std::filesystem::path(path).parent_path();
+
+    if (!directory.empty())
+        std::filesystem::create_directories(directory, error);
+
+    std::string temporary = path + ".tmp";
+    FILE *file = fopen(temporary.c_str(), "w");
+
+    if (!file)
+        return false;
+
+    std::istringstream lines(comment);
+    std::string line;
+
+    while (std::getline(lines, line))
+        fprintf(file, "# %s\n", line.c_str());
+
+    for (const std::string &option : options)
+        fprintf(file, "%s\n", option.c_str());
+
+    bool ok = fclose(file) == 0;
+
+    if (ok)
+        ok = rename(temporary.c_str(), path.c_str()) == 0;
+
+    if (!ok)
+        remove(temporary.c_str());
+
+    return ok;
+}
+
+std::vector<std::string> write_calibration_corpus(const std::string &dir, size_t count)
+{
+    std::vector<std::string> files;
+
+    for (size_t i = 0; i < count; i++) {
+        std::string path = dir + "/calibration-" + std::to_string(i) + ".tif";
+
+        const SyntheticImage &image = IMAGES[i % (sizeof(IMAGES) / sizeof(IMAGES[0]))];
+
+        if (!write_synthetic_tiff(image, gradient_pixels(image, (uint32_t) i), path))
+            return {};
+
+        files.push_back(path);
+    }
+
+    return files;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// Where --calibrate writes the profile and later runs look for it:
+// $XDG_CONFIG_HOME/tiff-png/profile, or ~/.config/tiff-png/profile. Empty
+// if neither variable is set.
+std::string default_profile_path();
+
+// Reads the options in a profile, written as on the command line, any
+// number to a line. Lines starting with # are comments. False if the file
+// can't be read.
+bool read_profile(const std::string &path, std::vector<std::string> &args);
+
+// Replaces the profile at path, creating its directory. Each line of
+// comment is written first, after a #, then one line per entry of options.
+bool write_profile(const std::string &path, const std::string &comment,
+                   const std::vector<std::string> &options);
+
+// Writes count synthetic TIFFs into dir for --calibrate to time: smooth
+// gradients with a little noise, in the common layouts and compressions,
+// and one strip per image in some so that the band size matters. Returns
+// their paths, or nothing if one couldn't be written.
+std::vector<std::string> write_calibration_corpus(const std::string &dir, size_t count);
@@ -0,0 +1,120 @@
+#include "cgroup.h"
+
+#include <sched.h>
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+// Finds the directory of the process's cgroup in the cgroup v2 hierarchy,
+// and the directory the hierarchy is mounted on. Returns false if there is
+// no v2 hierarchy.
+static bool find_cgroup(std::string &dir, std::string &mount)
+{
+    // "0::/path" is the entry for the v2 hierarchy
+    std::ifstream cgroups("/proc/self/cgroup");
+    std::string line, path;
+
+    while (std::getline(cgroups, line)) {
+        if (line.compare(0, 3, "0::") == 0) {
+            path = line.substr(3);
+            break;
+        }
+    }
+
+    if (path.empty())
+        return false;
+
+    // mountinfo: id parent major:minor root mount_point options ... - type
+    std::ifstream mounts("/proc/self/mountinfo");
+
+    while (std::getline(mounts, line)) {
+        size_t separator = line.find(" - ");
+
+        if (separator == std::string::npos || line.compare(separator + 3, 8, "cgroup2 ") != 0)
+            continue;
+
+        std::istringstream fields(line.substr(0, separator));
+        std::string id, parent, device, root;
+        fields >> id >> parent >> device >> root >> mount;
+
+        // Inside a cgroup namespace the mount's root is our own cgroup. It
+        // must end at a separator, so that /a doesn't match /ab.
+        if (root != "/" && path.compare(0, root.size(), root) == 0 &&
+            (path.size() == root.size() || path[root.size()] == '/'))
+            path = path.substr(root.size());
+
+        dir = mount + (path == "/" ? "" : path);
+
+        return true;
+    }
+
+    return false;
+}
+
+static bool read_line(const std::string &file, std::string &line)
+{
+    std::ifstream in(file);
+
+    return (bool) std::getline(in, line);
+}
+
+CgroupLimits cgroup_limits()
+{
+    CgroupLimits limits;
+    std::string dir, mount;
+
+    if (!find_cgroup(dir, mount))
+        return limits;
+
+    // Walk up to the root of the hierarchy, keeping the tightest limits
+    for (;;) {
+        std::string line;
+
+        // "max 100000" or "quota period", in microseconds
+        if (read_line(dir + "/cpu.max", line)) {
+            std::istringstream fields(line);
+            std::string quota;
+            uint64_t period = 0;
+
+            if (fields >> quota >> period && quota != "max" && period > 0) {
+                uint64_t cpus = (strtoull(quota.c_str(), nullptr, 10) + period - 1) / period;
+                cpus = std::max<uint64_t>(cpus, 1);
+
+                if (limits.cpus == 0 || cpus < limits.cpus)
+                    limits.cpus = (uint32_t) cpus;
+            }
+        }
+
+        if (read_line(dir + "/memory.max", line) && line != "max") {
+            uint64_t memory = strtoull(line.c_str(), nullptr, 10);
+
+            if (memory > 0 && (limits.memory == 0 || memory < limits.memory))
+                limits.memory = memory;
+        }
+
+        if (dir.size() <= mount.size())
+            break;
+
+        dir.erase(dir.find_last_of('/'));
+    }
+
+    return limits;
+}
+
+uint32_t available_cpus()
+{
+    cpu_set_t allowed;
+    uint32_t cpus = 0;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+        cpus = (uint32_t) CPU_COUNT(&allowed);
+
+    uint32_t quota = cgroup_limits().cpus;
+
+    if (quota && (cpus == 0 || quota < cpus))
+        cpus = quota;
+
+    return std::max<uint32_t>(cpus, 1);
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <cstdint>
+
+// Limits of the cgroup v2 the process runs in. A limit set on any cgroup
+// above it applies as well, so the tightest one is taken. Each is 0 when
+// there is no limit or no cgroup v2 hierarchy.
+struct CgroupLimits
+{
+    //CPUs worth of time allowed by cpu.max, rounded up
+    uint32_t cpus = 0;
+    //Bytes allowed by memory.max
+    uint64_t memory = 0;
+};
+
+CgroupLimits cgroup_limits();
+
+// CPUs the process can keep busy: those in its affinity mask, or fewer if
+// a cgroup CPU quota allows less time than that. At least 1.
+uint32_t available_cpus();
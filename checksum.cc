@@ -0,0 +1,230 @@
+#include "checksum.h"
+
+#include "kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+namespace checksum
+{
+
+//Reflected CRC-32 polynomial
+static const uint32_t POLY = 0xedb88320;
+//Largest prime below 65536
+static const uint32_t BASE = 65521;
+
+uint32_t crc32(uint32_t crc, const uint8_t *data, size_t size)
+{
+    return kernels().crc32(crc, data, size);
+}
+
+uint32_t adler32(uint32_t adler, const uint8_t *data, size_t size)
+{
+    return kernels().adler32(adler, data, size);
+}
+
+// Slicing-by-8 tables: entry [k][b] is the CRC of byte b followed by k zero bytes
+static const uint32_t (&crc_tables())[8][256]
+{
+    static const struct Tables
+    {
+        uint32_t t[8][256];
+
+        Tables()
+        {
+            for (uint32_t b = 0; b < 256; b++) {
+                uint32_t c = b;
+
+                for (int k = 0; k < 8; k++)
+                    c = (c & 1) ? (c >> 1) ^ POLY : c >> 1;
+
+                t[0][b] = c;
+            }
+
+            for (uint32_t b = 0; b < 256; b++)
+                for (int k = 1; k < 8; k++)
+                    t[k][b] = (t[k - 1][b] >> 8) ^ t[0][t[k - 1][b] & 0xff];
+        }
+    } tables;
+
+    return tables.t;
+}
+
+uint32_t crc32_scalar(uint32_t crc, const uint8_t *data, size_t size)
+{
+    const uint32_t (&t)[8][256] = crc_tables();
+    uint32_t c = ~crc;
+
+    for (; size >= 8; size -= 8, data += 8) {
+        uint32_t lo = c ^ ((uint32_t) data[0] | (uint32_t) data[1] << 8 |
+                           (uint32_t) data[2] << 16 | (uint32_t) data[3] << 24);
+
+        c = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^ t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^
+            t[3][data[4]] ^ t[2][data[5]] ^ t[1][data[6]] ^ t[0][data[7]];
+    }
+
+    for (; size > 0; size--, data++)
+        c = (c >> 8) ^ t[0][(c ^ *data) & 0xff];
+
+    return ~c;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// CRC-32 by folding 64-byte blocks with carry-less multiplication, as
+// described in Intel's "Fast CRC Computation for Generic Polynomials
+// Using PCLMULQDQ Instruction". Sizes below 64 bytes and the final
+// partial block go through the table-driven code.
+__attribute__((target("pclmul,sse4.1")))
+uint32_t crc32_pclmul(uint32_t crc, const uint8_t *data, size_t size)
+{
+    if (size < 64)
+        return crc32_scalar(crc, data, size);
+
+    //x^(4*128+32), x^(4*128-32), x^(128+32), x^(128-32), x^64 mod P, and P and mu
+    alignas(16) static const uint64_t K1K2[2] = {0x0154442bd4, 0x01c6e41596};
+    alignas(16) static const uint64_t K3K4[2] = {0x01751997d0, 0x00ccaa009e};
+    alignas(16) static const uint64_t K5K0[2] = {0x0163cd6124, 0x0000000000};
+    alignas(16) static const uint64_t POLY_MU[2] = {0x01db710641, 0x01f7011641};
+
+    size_t folded = size & ~(size_t) 15;
+    const uint8_t *end = data + folded;
+
+    __m128i x1 = _mm_loadu_si128((const __m128i *) (data + 0x00));
+    __m128i x2 = _mm_loadu_si128((const __m128i *) (data + 0x10));
+    __m128i x3 = _mm_loadu_si128((const __m128i *) (data + 0x20));
+    __m128i x4 = _mm_loadu_si128((const __m128i *) (data + 0x30));
+    __m128i x0 = _mm_load_si128((const __m128i *) K1K2);
+    __m128i x5, x6, x7, x8;
+
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int) ~crc));
+    data += 64;
+
+    // Fold four 128-bit lanes forward by 512 bits at a time
+    for (; end - data >= 64; data += 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *) (data + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i *) (data + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i *) (data + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i *) (data + 0x30)));
+    }
+
+    // Fold the four lanes into one
+    x0 = _mm_load_si128((const __m128i *) K3K4);
+
+    for (__m128i next : {x2, x3, x4}) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, next), x5);
+    }
+
+    // Fold in the remaining 16-byte blocks
+    for (; data < end; data += 16) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i *) data)), x5);
+    }
+
+    // Reduce 128 bits to 64
+    const __m128i mask = _mm_setr_epi32(~0, 0, ~0, 0);
+
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    x0 = _mm_loadl_epi64((const __m128i *) K5K0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask), x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction to 32 bits
+    x0 = _mm_load_si128((const __m128i *) POLY_MU);
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask), x0, 0x10);
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, mask), x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    uint32_t c = ~(uint32_t) _mm_extract_epi32(x1, 1);
+
+    return crc32_scalar(c, data, size - folded);
+}
+#endif
+
+// Product of two polynomials modulo the CRC polynomial
+static uint32_t multmodp(uint32_t a, uint32_t b)
+{
+    uint32_t m = 1u << 31;
+    uint32_t p = 0;
+
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+
+            if ((a & (m - 1)) == 0)
+                break;
+        }
+
+        m >>= 1;
+        b = (b & 1) ? (b >> 1) ^ POLY : b >> 1;
+    }
+
+    return p;
+}
+
+// x^(n * 2^k) modulo the CRC polynomial
+static uint32_t x2nmodp(uint64_t n, unsigned k)
+{
+    //x^(2^k) for k = 0 to 31
+    static const struct Powers
+    {
+        uint32_t p[32];
+
+        Powers()
+        {
+            p[0] = 1u << 30;
+
+            for (int k = 1; k < 32; k++)
+                p[k] = multmodp(p[k - 1], p[k - 1]);
+        }
+    } powers;
+
+    uint32_t p = 1u << 31;
+
+    for (; n; n >>= 1, k++)
+        if (n & 1)
+            p = multmodp(powers.p[k & 31], p);
+
+    return p;
+}
+
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, uint64_t size2)
+{
+    return multmodp(x2nmodp(size2, 3), crc1) ^ crc2;
+}
+
+uint32_t adler32_combine(uint32_t adler1, uint32_t adler2, uint64_t size2)
+{
+    uint32_t rem = (uint32_t) (size2 % BASE);
+    uint32_t sum1 = adler1 & 0xffff;
+    uint32_t sum2 = (rem * sum1) % BASE;
+
+    sum1 += (adler2 & 0xffff) + BASE - 1;
+    sum2 += (adler1 >> 16) + (adler2 >> 16) + BASE - rem;
+
+    if (sum1 >= BASE)
+        sum1 -= BASE;
+    if (sum1 >= BASE)
+        sum1 -= BASE;
+    if (sum2 >= BASE << 1)
+        sum2 -= BASE << 1;
+    if (sum2 >= BASE)
+        sum2 -= BASE;
+
+    return (sum2 << 16) | sum1;
+}
+
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// CRC-32 (as used by PNG chunks and gzip) and Adler-32 (as used by zlib
+// streams). Both take the running value and return the updated one, like
+// their zlib counterparts; start a new checksum with 0 and 1 respectively.
+// The SIMD implementations are chosen through the kernel table.
+namespace checksum
+{
+
+uint32_t crc32(uint32_t crc, const uint8_t *data, size_t size);
+
+uint32_t adler32(uint32_t adler, const uint8_t *data, size_t size);
+
+// Checksum of two blocks joined together, from the checksums of each block
+// and the size of the second. This lets blocks compressed in parallel be
+// stitched together without another pass over the data.
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, uint64_t size2);
+
+uint32_t adler32_combine(uint32_t adler1, uint32_t adler2, uint64_t size2);
+
+// Portable implementation, used by the baseline kernels
+uint32_t crc32_scalar(uint32_t crc, const uint8_t *data, size_t size);
+
+#if defined(__x86_64__) || defined(__i386__)
+// Carry-less multiplication (PCLMULQDQ) folding, for CPUs that have it
+uint32_t crc32_pclmul(uint32_t crc, const uint8_t *data, size_t size);
+#endif
+
+}
@@ -0,0 +1,43 @@
+# Builds tiff-png with profile-guided optimization, run by the pgo target.
+#
+# Both passes build in BINARY_DIR, since GCC matches the profiles to the
+# objects by path:
+#
+# 1. An instrumented tiff-png is built (TIFF_PNG_PGO=generate).
+# 2. It converts the training corpus in CORPUS with each configuration of
+#    bench/run.sh, which writes the profiles next to the objects.
+# 3. tiff-png is rebuilt with the profiles (TIFF_PNG_PGO=use).
+#
+# The remaining variables are passed on to the configure steps.
+
+function(run)
+    execute_process(COMMAND ${ARGN} RESULT_VARIABLE result)
+
+    if (NOT result EQUAL 0)
+        string(REPLACE ";" " " command "${ARGN}")
+        message(FATAL_ERROR "Failed: ${command}")
+    endif()
+endfunction()
+
+function(build pass)
+    run(${CMAKE_COMMAND} -S ${SOURCE_DIR} -B ${BINARY_DIR} -G ${GENERATOR}
+        -DCMAKE_BUILD_TYPE=Release -DTIFF_PNG_PGO=${pass}
+        -DCMAKE_CXX_COMPILER=${CMAKE_CXX_COMPILER} "-DCMAKE_PREFIX_PATH=${CMAKE_PREFIX_PATH}"
+        "-DCMAKE_INCLUDE_PATH=${CMAKE_INCLUDE_PATH}" "-DCMAKE_LIBRARY_PATH=${CMAKE_LIBRARY_PATH}"
+        -DTIFF_PNG_LTO=${TIFF_PNG_LTO} -DTIFF_PNG_LIBDEFLATE=${TIFF_PNG_LIBDEFLATE})
+    run(${CMAKE_COMMAND} --build ${BINARY_DIR} --target tiff-png)
+endfunction()
+
+build(generate)
+
+#Counts from an earlier training would add up with the new ones
+file(GLOB_RECURSE old_profiles ${BINARY_DIR}/*.gcda)
+
+if (old_profiles)
+    file(REMOVE ${old_profiles})
+endif()
+
+message(STATUS "Training on ${CORPUS}")
+run(sh ${SOURCE_DIR}/bench/run.sh ${BINARY_DIR}/tiff-png ${CORPUS} 1)
+
+build(use)
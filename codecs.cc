@@ -0,0 +1,327 @@
+#include "codecs.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#ifdef HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+
+// TIFF LZW: codes of 9 to 12 bits packed MSB first, with the code width
+// growing one code earlier than in GIF. Every string in the table has
+// already been written out in full, so an entry is just where it was
+// written and how long it is, and decoding a code is a copy from earlier
+// in the output instead of a walk down a prefix chain.
+static bool lzw_decode(const uint8_t *in, size_t in_size, uint8_t *out, size_t out_size)
+{
+    const uint32_t CLEAR = 256, END = 257, FIRST = 258, MAX_CODES = 4096;
+
+    //Old-style LZW (LSB first, from libtiff before 5.0) is left to libtiff
+    if (in_size >= 2 && in[0] == 0 && (in[1] & 1))
+        return false;
+
+    uint32_t offset[MAX_CODES];
+    uint16_t length[MAX_CODES];
+
+    uint64_t bits = 0;
+    uint32_t avail = 0;
+    size_t ip = 0, op = 0;
+
+    uint32_t width = 9, next = FIRST;
+    size_t prev_off = 0, prev_len = 0;
+    //Right after a clear code there is no previous string to extend
+    bool have_prev = false;
+
+    while (op < out_size) {
+        //Keep at least one whole code in the bit buffer, topping it up a
+        //word at a time away from the end of the input
+        if (avail < 32) {
+            if (in_size - ip >= 4) {
+                uint32_t word;
+                memcpy(&word, in + ip, 4);
+                bits |= (uint64_t) __builtin_bswap32(word) << (32 - avail);
+                avail += 32;
+                ip += 4;
+            } else {
+                while (avail <= 56 && ip < in_size) {
+                    bits |= (uint64_t) in[ip++] << (56 - avail);
+                    avail += 8;
+                }
+            }
+        }
+
+        if (avail < width)
+            break;
+
+        uint32_t code = (uint32_t) (bits >> (64 - width));
+        bits <<= width;
+        avail -= width;
+
+        if (code == CLEAR) {
+            width = 9;
+            next = FIRST;
+            have_prev = false;
+
+            continue;
+        }
+
+        if (code == END)
+            break;
+
+        size_t start = op, len;
+
+        if (code < 256) {
+            out[op] = (uint8_t) code;
+            len = 1;
+        } else if (code < next) {
+            const uint8_t *src = out + offset[code];
+            len = length[code];
+
+            //With room for the longest string, copy whole 16-byte chunks.
+            //The string ends before op, so its bytes are read before any
+            //chunk is written over them; what lands past len is
+            //overwritten later.
+            if (out_size - op >= MAX_CODES + 16) {
+                for (size_t i = 0; i < len; i += 16) {
+                    uint8_t chunk[16];
+                    memcpy(chunk, src + i, 16);
+                    memcpy(out + op + i, chunk, 16);
+                }
+            } else {
+                len = std::min(len, out_size - op);
+                memcpy(out + op, src, len);
+            }
+        } else if (code == next && have_prev) {
+            //The code being defined: the previous string and its first byte,
+            //which overlaps the bytes it is copied from
+            len = std::min(prev_len + 1, out_size - op);
+
+            for (size_t i = 0; i < len; i++)
+                out[op + i] = out[prev_off + i];
+        } else {
+            return false;
+        }
+
+        op += len;
+
+        if (have_prev && next < MAX_CODES) {
+            offset[next] = (uint32_t) prev_off;
+            length[next] = (uint16_t) (prev_len + 1);
+            next++;
+
+            if (next + 1 >= (1u << width) && width < 12)
+                width++;
+        }
+
+        have_prev = true;
+        prev_off = start;
+        prev_len = len;
+    }
+
+    return op == out_size;
+}
+
+// PackBits: a count byte n followed by n + 1 literal bytes for n >= 0, or
+// by one byte to repeat 1 - n times for n < 0. -128 is a no-op.
+static bool packbits_decode(const uint8_t *in, size_t in_size, uint8_t *out, size_t out_size)
+{
+    size_t ip = 0, op = 0;
+
+    while (op < out_size && ip < in_size) {
+        int n = (int8_t) in[ip++];
+
+        if (n >= 0) {
+            size_t count = (size_t) n + 1;
+
+            if (count > in_size - ip || count > out_size - op)
+                return false;
+
+            //A fixed size copy compiles to a few vector moves, where one of
+            //up to 128 bytes becomes a slow rep movs
+            if (in_size - ip >= 128 && out_size - op >= 128)
+                memcpy(out + op, in + ip, 128);
+            else
+                memcpy(out + op, in + ip, count);
+
+            ip += count;
+            op += count;
+        } else if (n != -128) {
+            size_t count = (size_t) (1 - n);
+
+            if (ip >= in_size || count > out_size - op)
+                return false;
+
+            if (out_size - op >= 128)
+                memset(out + op, in[ip], 128);
+            else
+                memset(out + op, in[ip], count);
+
+            ip++;
+            op += count;
+        }
+    }
+
+    return op == out_size;
+}
+
+std::unique_ptr<StripDecoder> StripDecoder::create(TIFF *tif, const MappedFile *mapping)
+{
+    uint16_t compression = COMPRESSION_NONE, predictor = PREDICTOR_NONE;
+    uint16_t fill_order = FILLORDER_MSB2LSB, planar = PLANARCONFIG_CONTIG;
+    uint16_t bps = 0, spp = 0;
+    uint32_t width = 0;
+
+    TIFFGetFieldDefaulted(tif, TIFFTAG_COMPRESSION, &compression);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_FILLORDER, &fill_order);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_PLANARCONFIG, &planar);
+    TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &width);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_BITSPERSAMPLE, &bps);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLESPERPIXEL, &spp);
+
+    if (compression != COMPRESSION_LZW && compression != COMPRESSION_PACKBITS &&
+        compression != COMPRESSION_ADOBE_DEFLATE && compression != COMPRESSION_DEFLATE)
+        return nullptr;
+
+    //PackBits has no predictor tag
+    if (compression != COMPRESSION_PACKBITS)
+        TIFFGetFieldDefaulted(tif, TIFFTAG_PREDICTOR, &predictor);
+
+    if (TIFFIsTiled(tif) || fill_order != FILLORDER_MSB2LSB || planar != PLANARCONFIG_CONTIG)
+        return nullptr;
+
+    if (!(bps <= 8 || bps == 16))
+        return nullptr;
+
+    //The horizontal predictor works on whole samples
+    if (predictor != PREDICTOR_NONE &&
+        !(predictor == PREDICTOR_HORIZONTAL && (bps == 8 || bps == 16)))
+        return nullptr;
+
+    return std::unique_ptr<StripDecoder>(
+        new StripDecoder(tif, mapping, compression, predictor, width, bps, spp));
+}
+
+StripDecoder::StripDecoder(TIFF *tif, const MappedFile *mapping, uint16_t compression,
+                           uint16_t predictor, uint32_t width, uint32_t bps, uint32_t spp)
+    : tif(tif),
+      mapping(mapping),
+      kernel(kernels()),
+      compression(compression),
+      predictor(predictor),
+      width(width),
+      bps(bps),
+      spp(spp),
+      line_size(TIFFScanlineSize(tif)),
+      swapped(bps == 16 && TIFFIsByteSwapped(tif))
+{
+}
+
+StripDecoder::~StripDecoder()
+{
+#ifdef HAVE_LIBDEFLATE
+    if (decompressor)
+        libdeflate_free_decompressor(decompressor);
+#else
+    if (stream_ready)
+        inflateEnd(&stream);
+#endif
+}
+
+bool StripDecoder::inflate_strip(const uint8_t *in, size_t in_size, uint8_t *out, size_t out_size)
+{
+#ifdef HAVE_LIBDEFLATE
+    if (!decompressor) {
+        decompressor = libdeflate_alloc_decompressor();
+
+        if (!decompressor)
+            throw std::runtime_error("libdeflate_alloc_decompressor failed");
+    }
+
+    //Strips that don't decompress to exactly their size are left to libtiff
+    return libdeflate_zlib_decompress(decompressor, in, in_size, out, out_size, nullptr) ==
+           LIBDEFLATE_SUCCESS;
+#else
+    if (!stream_ready) {
+        if (inflateInit(&stream) != Z_OK)
+            throw std::runtime_error("inflateInit failed");
+
+        stream_ready = true;
+    } else {
+        inflateReset(&stream);
+    }
+
+    stream.next_in = (Bytef *) in;
+    stream.avail_in = (uInt) in_size;
+    stream.next_out = out;
+    stream.avail_out = (uInt) out_size;
+
+    //Like libtiff, data past the end of the strip is ignored
+    int ret = inflate(&stream, Z_FINISH);
+
+    return (ret == Z_STREAM_END || ret == Z_OK || ret == Z_BUF_ERROR) && stream.avail_out == 0;
+#endif
+}
+
+// Horizontal predictor: each sample is stored as the difference from the
+// same sample of the pixel before. 16-bit samples in the other byte order
+// are swapped in the same pass.
+void StripDecoder::undo_predictor(uint8_t *row)
+{
+    uint32_t entry = spp <= 4 ? spp : 0;
+
+    if (bps == 8)
+        kernel.undo_predictor8[entry](row, width, spp);
+    else
+        kernel.undo_predictor16[entry]((uint16_t *) row, width, spp, swapped);
+}
+
+bool StripDecoder::decode(uint32_t strip, uint8_t *out, uint32_t rows, bool keep_predictor)
+{
+    uint64_t raw_size = TIFFGetStrileByteCount(tif, strip);
+    size_t out_size = rows * line_size;
+
+    if (raw_size == 0 || raw_size > (uint64_t) INT32_MAX)
+        return false;
+
+    uint64_t offset = TIFFGetStrileOffset(tif, strip);
+    const uint8_t *data = nullptr;
+
+    if (mapping && offset <= mapping->size() && raw_size <= mapping->size() - offset) {
+        data = mapping->data() + offset;
+    } else {
+        if (raw.size() < raw_size)
+            raw.resize(raw_size);
+
+        if (TIFFReadRawStrip(tif, strip, raw.data(), (tmsize_t) raw_size) != (tmsize_t) raw_size)
+            return false;
+
+        data = raw.data();
+    }
+
+    bool decoded = false;
+
+    switch (compression) {
+    case COMPRESSION_LZW:
+        decoded = lzw_decode(data, raw_size, out, out_size);
+        break;
+    case COMPRESSION_PACKBITS:
+        decoded = packbits_decode(data, raw_size, out, out_size);
+        break;
+    default:
+        decoded = inflate_strip(data, raw_size, out, out_size);
+        break;
+    }
+
+    if (!decoded)
+        return false;
+
+    if (predictor == PREDICTOR_HORIZONTAL && !keep_predictor) {
+        for (uint32_t row = 0; row < rows; row++)
+            undo_predictor(out + row * line_size);
+    } else if (swapped) {
+        kernel.swap16((const uint16_t *) out, (uint16_t *) out, out_size / 2);
+    }
+
+    return true;
+}
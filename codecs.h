@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <tiffio.h>
+#include <zlib.h>
+
+#include "buffer.h"
+#include "kernels.h"
+
+//Who decodes compressed strips
+enum class Codecs
+{
+    Libtiff, //TIFFReadEncodedStrip
+    Fast,    //StripDecoder where it can, libtiff otherwise
+    Verify   //Both, failing the file if they differ
+};
+
+// Decodes LZW, PackBits and Deflate strips from their raw bytes, in place
+// of libtiff's byte-at-a-time decoders. Deflate goes through libdeflate
+// when built with HAVE_LIBDEFLATE, and zlib otherwise. The output is the
+// same as TIFFReadEncodedStrip: samples in machine byte order, horizontal
+// predictor undone.
+class StripDecoder
+{
+public:
+    // Returns nullptr if the image's compression, predictor or layout is
+    // not handled, in which case libtiff has to decode it. Strips are read
+    // from mapping when given, instead of being copied out with libtiff.
+    static std::unique_ptr<StripDecoder> create(TIFF *tif, const MappedFile *mapping = nullptr);
+
+    ~StripDecoder();
+
+    StripDecoder(const StripDecoder &) = delete;
+    StripDecoder &operator=(const StripDecoder &) = delete;
+
+    // Decodes rows rows of the strip into out. Returns false if the strip
+    // could not be decoded, such as for damaged data, leaving it to libtiff.
+    // With keep_predictor, rows stored with the horizontal predictor are
+    // left as differences.
+    bool decode(uint32_t strip, uint8_t *out, uint32_t rows, bool keep_predictor = false);
+
+    // Whether the rows are stored with the horizontal predictor
+    bool predicted() const { return predictor == PREDICTOR_HORIZONTAL; }
+
+private:
+    StripDecoder(TIFF *tif, const MappedFile *mapping, uint16_t compression,
+                 uint16_t predictor, uint32_t width, uint32_t bps, uint32_t spp);
+
+    bool inflate_strip(const uint8_t *in, size_t in_size, uint8_t *out, size_t out_size);
+    void undo_predictor(uint8_t *row);
+
+    TIFF *tif;
+    const MappedFile *mapping;
+    const KernelTable &kernel;
+    uint16_t compression;
+    uint16_t predictor;
+    uint32_t width;
+    uint32_t bps;
+    uint32_t spp;
+    size_t line_size;
+    bool swapped;
+
+    //Compressed bytes of the current strip, when not read from the mapping
+    AlignedBuffer raw;
+
+#ifdef HAVE_LIBDEFLATE
+    struct libdeflate_decompressor *decompressor = nullptr;
+#else
+    z_stream stream{};
+    bool stream_ready = false;
+#endif
+};
@@ -0,0 +1,129 @@
+#include "diagnostics.h"
+
+#include <cstdarg>
+#include <cstdio>
+
+#include "accounting.h"
+
+//Per-handle handlers arrived in libtiff 4.5.0
+#if defined(TIFFLIB_VERSION) && TIFFLIB_VERSION >= 20221213
+#define HAVE_TIFF_OPEN_OPTIONS 1
+#endif
+
+static void add(Diagnostics &diagnostics, std::vector<std::string> &messages,
+                const std::string &message)
+{
+    if (diagnostics.warnings.size() + diagnostics.errors.size() < Diagnostics::MAX_MESSAGES)
+        messages.push_back(message);
+    else
+        diagnostics.dropped++;
+}
+
+void Diagnostics::warning(const std::string &message)
+{
+    add(*this, warnings, message);
+}
+
+void Diagnostics::error(const std::string &message)
+{
+    add(*this, errors, message);
+}
+
+std::string Diagnostics::text() const
+{
+    std::string text;
+
+    for (const std::string &message : warnings)
+        text += "warning: " + message + "\n";
+
+    for (const std::string &message : errors)
+        text += "error: " + message + "\n";
+
+    if (dropped)
+        text += std::to_string(dropped) + " more messages dropped\n";
+
+    return text;
+}
+
+#ifdef HAVE_TIFF_OPEN_OPTIONS
+// "module: message", as libtiff's default handlers print it
+static std::string format_tiff(const char *module, const char *format, va_list args)
+{
+    char message[512];
+    vsnprintf(message, sizeof(message), format, args);
+
+    return module ? std::string(module) + ": " + message : std::string(message);
+}
+
+static int tiff_warning(TIFF *, void *user_data, const char *module, const char *format, va_list args)
+{
+    ((Diagnostics *) user_data)->warning(format_tiff(module, format, args));
+
+    //Handled, so the global handler isn't called as well
+    return 1;
+}
+
+static int tiff_error(TIFF *, void *user_data, const char *module, const char *format, va_list args)
+{
+    ((Diagnostics *) user_data)->error(format_tiff(module, format, args));
+
+    return 1;
+}
+#endif
+
+TIFF *open_tiff(const char *file, Diagnostics &diagnostics)
+{
+#ifdef HAVE_TIFF_OPEN_OPTIONS
+    TIFFOpenOptions *options = TIFFOpenOptionsAlloc();
+
+    if (!options)
+        return TIFFOpen(file, "r");
+
+    TIFFOpenOptionsSetWarningHandlerExtR(options, tiff_warning, &diagnostics);
+    TIFFOpenOptionsSetErrorHandlerExtR(options, tiff_error, &diagnostics);
+
+    //The handlers are copied into the handle
+    TIFF *tif = TIFFOpenExt(file, "r", options);
+    TIFFOpenOptionsFree(options);
+
+    return tif;
+#else
+    (void) diagnostics;
+
+    return TIFFOpen(file, "r");
+#endif
+}
+
+static void png_warning_handler(png_structp png_ptr, png_const_charp message)
+{
+    ((Diagnostics *) png_get_error_ptr(png_ptr))->warning(std::string("libpng: ") + message);
+}
+
+static void png_error_handler(png_structp png_ptr, png_const_charp message)
+{
+    ((Diagnostics *) png_get_error_ptr(png_ptr))->error(std::string("libpng: ") + message);
+
+    //libpng error handlers must not return
+    png_longjmp(png_ptr, 1);
+}
+
+static png_voidp png_malloc_handler(png_structp png_ptr, png_alloc_size_t size)
+{
+    return account_malloc((MemoryAccount *) png_get_mem_ptr(png_ptr), size);
+}
+
+static void png_free_handler(png_structp png_ptr, png_voidp ptr)
+{
+    account_free((MemoryAccount *) png_get_mem_ptr(png_ptr), ptr);
+}
+
+png_structp create_png_writer(Diagnostics &diagnostics, MemoryAccount *account)
+{
+    if (!account)
+        return png_create_write_struct(PNG_LIBPNG_VER_STRING, &diagnostics,
+                                       png_error_handler, png_warning_handler);
+
+    return png_create_write_struct_2(PNG_LIBPNG_VER_STRING, &diagnostics,
+                                     png_error_handler, png_warning_handler,
+                                     account, png_malloc_handler, png_free_handler);
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include <tiffio.h>
+#include <png.h>
+
+// Warnings and errors libtiff, libpng and libjpeg report while one file
+// is being converted. They are collected with the file's result rather
+// than going straight to stderr, so workers don't contend for it, and a
+// file's messages come out together.
+struct Diagnostics
+{
+    //Messages kept per file. Noisy files can report a warning per strip.
+    static const size_t MAX_MESSAGES = 100;
+
+    std::vector<std::string> warnings;
+    std::vector<std::string> errors;
+    //Messages beyond MAX_MESSAGES, counted but not kept
+    size_t dropped = 0;
+
+    void warning(const std::string &message);
+    void error(const std::string &message);
+
+    bool empty() const { return warnings.empty() && errors.empty() && dropped == 0; }
+
+    // Everything collected, one "warning: " or "error: " line each
+    std::string text() const;
+};
+
+// Opens a TIFF file for reading with handlers that report to diagnostics,
+// which must outlive the handle. Needs libtiff 4.5 for handlers per handle;
+// with older versions libtiff's global handlers print as before.
+TIFF *open_tiff(const char *file, Diagnostics &diagnostics);
+
+class MemoryAccount;
+
+// Creates a libpng writer that reports to diagnostics. On an error it
+// jumps to the writer's png_jmpbuf, as libpng's own handler does. libpng's
+// allocations, zlib's included, are charged to account if it isn't null.
+png_structp create_png_writer(Diagnostics &diagnostics, MemoryAccount *account);
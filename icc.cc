@@ -0,0 +1,424 @@
+#include "icc.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <list>
+#include <mutex>
+
+typedef uint16_t u16x4 __attribute__((vector_size(8)));
+typedef uint32_t u32x4 __attribute__((vector_size(16)));
+
+//Fixed point precision of the interpolation weights
+static const uint32_t WEIGHT_BITS = 15;
+static const uint32_t WEIGHT_ONE = 1u << WEIGHT_BITS;
+
+// Splits each 16-bit sample into a grid cell and a position inside it.
+// Entry v holds (cell << 16) | weight, with the weight in [0, WEIGHT_ONE].
+static std::vector<uint32_t> grid_positions()
+{
+    std::vector<uint32_t> table(65536);
+
+    for (uint32_t v = 0; v < 65536; v++) {
+        uint32_t p = v * (ColorLut::GRID - 1);
+        uint32_t cell = p / 65535;
+        uint32_t weight = (uint32_t) (((uint64_t) (p % 65535) * WEIGHT_ONE + 32767) / 65535);
+
+        //Keep the last cell in range for the maximum value
+        if (cell == ColorLut::GRID - 1) {
+            cell--;
+            weight = WEIGHT_ONE;
+        }
+
+        table[v] = (cell << 16) | weight;
+    }
+
+    return table;
+}
+
+void ColorLut::interpolate(uint32_t rgb[3][BLOCK]) const
+{
+    typedef uint32_t V __attribute__((vector_size(BLOCK * 4)));
+
+    const uint32_t stride[3] = {GRID * GRID * 4, GRID * 4, 4};
+    uint32_t lanes[BLOCK];
+    V w[3], base = {};
+
+    for (int c = 0; c < 3; c++) {
+        for (uint32_t i = 0; i < BLOCK; i++)
+            lanes[i] = positions[rgb[c][i]];
+
+        V p;
+        memcpy(&p, lanes, sizeof(p));
+        w[c] = p & 0xffff;
+        base += (p >> 16) * stride[c];
+    }
+
+    // The tetrahedron is picked by ordering the axes on their weights, the
+    // corners being reached by stepping along the largest axis first. Where
+    // weights tie, the corners they choose between get a weight of 0.
+    V hi = w[0] > w[1] ? w[0] : w[1];
+    hi = hi > w[2] ? hi : w[2];
+    V lo = w[0] < w[1] ? w[0] : w[1];
+    lo = lo < w[2] ? lo : w[2];
+    V mid = w[0] + w[1] + w[2] - hi - lo;
+
+    V first = (w[0] == hi) ? stride[0] : (w[1] == hi) ? stride[1] : stride[2];
+    V last = (w[2] == lo) ? stride[2] : (w[1] == lo) ? stride[1] : stride[0];
+    V far = base + (stride[0] + stride[1] + stride[2]);
+
+    const V corners[4] = {base, base + first, far - last, far};
+    const V weights[4] = {WEIGHT_ONE - hi, hi - mid, mid - lo, lo};
+    uint32_t corner[4][BLOCK], weight[4][BLOCK];
+    memcpy(corner, corners, sizeof(corner));
+    memcpy(weight, weights, sizeof(weight));
+
+    // Each node's channels are loaded together, widened to 32 bits and
+    // blended for all three channels at once
+    for (uint32_t i = 0; i < BLOCK; i++) {
+        u32x4 sum = {};
+
+        for (int k = 0; k < 4; k++) {
+            u16x4 node;
+            memcpy(&node, &nodes[corner[k][i]], sizeof(node));
+            sum += __builtin_convertvector(node, u32x4) * weight[k][i];
+        }
+
+        sum = (sum + WEIGHT_ONE / 2) >> WEIGHT_BITS;
+
+        for (int c = 0; c < 3; c++)
+            rgb[c][i] = sum[c];
+    }
+}
+
+template <uint32_t SPP, typename T>
+void ColorLut::apply(const T *in, T *out, uint32_t width, uint32_t spp) const
+{
+    const uint32_t n = SPP ? SPP : spp;
+    uint32_t rgb[3][BLOCK];
+
+    for (uint32_t x = 0; x < width; x += BLOCK) {
+        uint32_t count = std::min(BLOCK, width - x);
+
+        // 8-bit samples are scaled to 16 bits. The rest of the last block
+        // is padded with black.
+        for (uint32_t i = 0; i < BLOCK; i++)
+            for (int c = 0; c < 3; c++)
+                rgb[c][i] = i < count ? in[i * n + c] * (sizeof(T) == 1 ? 257u : 1u) : 0;
+
+        interpolate(rgb);
+
+        for (uint32_t i = 0; i < count; i++, in += n, out += n) {
+            for (int c = 0; c < 3; c++) {
+                // Round the 16-bit results to 8 bits
+                if constexpr (sizeof(T) == 1)
+                    out[c] = (T) ((rgb[c][i] * 255 + 32895) >> 16);
+                else
+                    out[c] = (T) rgb[c][i];
+            }
+
+            for (uint32_t c = 3; c < n; c++)
+                out[c] = in[c];
+        }
+    }
+}
+
+template void ColorLut::apply<0>(const uint8_t *, uint8_t *, uint32_t, uint32_t) const;
+template void ColorLut::apply<3>(const uint8_t *, uint8_t *, uint32_t, uint32_t) const;
+template void ColorLut::apply<4>(const uint8_t *, uint8_t *, uint32_t, uint32_t) const;
+template void ColorLut::apply<0>(const uint16_t *, uint16_t *, uint32_t, uint32_t) const;
+template void ColorLut::apply<3>(const uint16_t *, uint16_t *, uint32_t, uint32_t) const;
+template void ColorLut::apply<4>(const uint16_t *, uint16_t *, uint32_t, uint32_t) const;
+
+// Readers for the big-endian fields of an ICC profile
+static uint32_t read_u32(const uint8_t *p)
+{
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+static uint16_t read_u16(const uint8_t *p)
+{
+    return (uint16_t) ((p[0] << 8) | p[1]);
+}
+
+static double read_s15f16(const uint8_t *p)
+{
+    return (int32_t) read_u32(p) / 65536.0;
+}
+
+static uint32_t signature(const char *s)
+{
+    return read_u32((const uint8_t *) s);
+}
+
+// A tone reproduction curve from a 'curv' or 'para' tag
+struct ToneCurve
+{
+    enum { Identity, Gamma, Table, Parametric } kind = Identity;
+    std::vector<uint16_t> table;
+    //Parametric curve: g, a, b, c, d, e, f
+    double params[7] = {1, 1, 0, 0, 0, 0, 0};
+    uint16_t function = 0;
+
+    double eval(double x) const
+    {
+        const double *p = params;
+
+        switch (kind) {
+        case Identity:
+            return x;
+        case Gamma:
+            return std::pow(x, p[0]);
+        case Table: {
+            double pos = x * (table.size() - 1);
+            size_t i = std::min((size_t) pos, table.size() - 2);
+            double t = pos - i;
+            return (table[i] * (1 - t) + table[i + 1] * t) / 65535.0;
+        }
+        case Parametric:
+            switch (function) {
+            case 0:
+                return std::pow(x, p[0]);
+            case 1:
+                return x >= -p[2] / p[1] ? std::pow(p[1] * x + p[2], p[0]) : 0;
+            case 2:
+                return x >= -p[2] / p[1] ? std::pow(p[1] * x + p[2], p[0]) + p[3] : p[3];
+            case 3:
+                return x >= p[4] ? std::pow(p[1] * x + p[2], p[0]) : p[3] * x;
+            default:
+                return x >= p[4] ? std::pow(p[1] * x + p[2], p[0]) + p[5] : p[3] * x + p[6];
+            }
+        }
+
+        return x;
+    }
+};
+
+// Finds a tag and returns its data, or nullptr if it is missing or truncated
+static const uint8_t *find_tag(const uint8_t *profile, size_t size, const char *name, uint32_t &tag_size)
+{
+    if (size < 132)
+        return nullptr;
+
+    uint32_t count = read_u32(profile + 128);
+
+    for (uint32_t i = 0; i < count && 132 + (i + 1) * 12 <= size; i++) {
+        const uint8_t *entry = profile + 132 + i * 12;
+        uint32_t offset = read_u32(entry + 4);
+        tag_size = read_u32(entry + 8);
+
+        if (read_u32(entry) == signature(name))
+            return (offset <= size && tag_size <= size - offset) ? profile + offset : nullptr;
+    }
+
+    return nullptr;
+}
+
+static bool read_xyz(const uint8_t *profile, size_t size, const char *name, double xyz[3])
+{
+    uint32_t tag_size = 0;
+    const uint8_t *tag = find_tag(profile, size, name, tag_size);
+
+    if (!tag || tag_size < 20 || read_u32(tag) != signature("XYZ "))
+        return false;
+
+    for (int i = 0; i < 3; i++)
+        xyz[i] = read_s15f16(tag + 8 + i * 4);
+
+    return true;
+}
+
+static bool read_curve(const uint8_t *profile, size_t size, const char *name, ToneCurve &curve)
+{
+    uint32_t tag_size = 0;
+    const uint8_t *tag = find_tag(profile, size, name, tag_size);
+
+    if (!tag || tag_size < 12)
+        return false;
+
+    if (read_u32(tag) == signature("curv")) {
+        uint32_t count = read_u32(tag + 8);
+
+        if (tag_size < 12 + (uint64_t) count * 2)
+            return false;
+
+        if (count == 0) {
+            curve.kind = ToneCurve::Identity;
+        } else if (count == 1) {
+            curve.kind = ToneCurve::Gamma;
+            curve.params[0] = read_u16(tag + 12) / 256.0;
+        } else {
+            curve.kind = ToneCurve::Table;
+            curve.table.resize(count);
+
+            for (uint32_t i = 0; i < count; i++)
+                curve.table[i] = read_u16(tag + 12 + i * 2);
+        }
+
+        return true;
+    }
+
+    if (read_u32(tag) == signature("para")) {
+        static const int PARAM_COUNT[5] = {1, 3, 4, 5, 7};
+        curve.function = read_u16(tag + 8);
+
+        if (curve.function > 4 || tag_size < 12 + PARAM_COUNT[curve.function] * 4u)
+            return false;
+
+        curve.kind = ToneCurve::Parametric;
+
+        for (int i = 0; i < PARAM_COUNT[curve.function]; i++)
+            curve.params[i] = read_s15f16(tag + 12 + i * 4);
+
+        return true;
+    }
+
+    return false;
+}
+
+static double srgb_encode(double v)
+{
+    v = std::clamp(v, 0.0, 1.0);
+
+    return v <= 0.0031308 ? v * 12.92 : 1.055 * std::pow(v, 1 / 2.4) - 0.055;
+}
+
+std::shared_ptr<const ColorLut> build_srgb_lut(const uint8_t *profile, size_t size)
+{
+    if (!profile || size < 132 ||
+        read_u32(profile + 16) != signature("RGB ") ||
+        read_u32(profile + 20) != signature("XYZ "))
+        return nullptr;
+
+    double columns[3][3];
+    ToneCurve curves[3];
+
+    if (!read_xyz(profile, size, "rXYZ", columns[0]) ||
+        !read_xyz(profile, size, "gXYZ", columns[1]) ||
+        !read_xyz(profile, size, "bXYZ", columns[2]) ||
+        !read_curve(profile, size, "rTRC", curves[0]) ||
+        !read_curve(profile, size, "gTRC", curves[1]) ||
+        !read_curve(profile, size, "bTRC", curves[2]))
+        return nullptr;
+
+    // XYZ (D50 PCS) to linear sRGB, Bradford adapted
+    static const double XYZ_TO_SRGB[3][3] = {
+        { 3.1338561, -1.6168667, -0.4906146},
+        {-0.9787684,  1.9161415,  0.0334540},
+        { 0.0719453, -0.2289914,  1.4052427}
+    };
+
+    // Combine the profile's matrix with the sRGB one
+    double m[3][3];
+
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            m[i][j] = 0;
+
+            for (int k = 0; k < 3; k++)
+                m[i][j] += XYZ_TO_SRGB[i][k] * columns[j][k];
+        }
+    }
+
+    // Linearized device values for each grid coordinate
+    const uint32_t G = ColorLut::GRID;
+    double linear[3][ColorLut::GRID];
+
+    for (int c = 0; c < 3; c++)
+        for (uint32_t i = 0; i < G; i++)
+            linear[c][i] = curves[c].eval((double) i / (G - 1));
+
+    auto lut = std::make_shared<ColorLut>();
+    lut->positions = grid_positions();
+    lut->nodes.resize((size_t) G * G * G * 4);
+    uint16_t *node = lut->nodes.data();
+
+    for (uint32_t r = 0; r < G; r++) {
+        for (uint32_t g = 0; g < G; g++) {
+            for (uint32_t b = 0; b < G; b++, node += 4) {
+                const double rgb[3] = {linear[0][r], linear[1][g], linear[2][b]};
+
+                for (int c = 0; c < 3; c++) {
+                    double v = m[c][0] * rgb[0] + m[c][1] * rgb[1] + m[c][2] * rgb[2];
+                    node[c] = (uint16_t) std::lround(srgb_encode(v) * 65535);
+                }
+
+                node[3] = 0;
+            }
+        }
+    }
+
+    return lut;
+}
+
+// 64-bit FNV-1a
+static uint64_t hash_profile(const uint8_t *profile, size_t size)
+{
+    uint64_t hash = 14695981039346656037ull;
+
+    for (size_t i = 0; i < size; i++)
+        hash = (hash ^ profile[i]) * 1099511628211ull;
+
+    return hash;
+}
+
+//Tables kept by get_srgb_lut(). Each holds a 33^3 table of about 280K,
+//and 256K of grid positions.
+static const size_t LUT_CACHE_SIZE = 16;
+
+std::shared_ptr<const ColorLut> get_srgb_lut(const uint8_t *profile, size_t size)
+{
+    struct Entry
+    {
+        uint64_t hash;
+        size_t size;
+        std::shared_ptr<const ColorLut> lut;
+    };
+
+    //Most recently used first
+    static std::mutex mutex;
+    static std::list<Entry> cache;
+
+    uint64_t hash = hash_profile(profile, size);
+
+    // The profile's bytes aren't kept. With the length checked as well, two
+    // different profiles would need a 64-bit hash collision to share a table.
+    auto find = [&]() -> std::list<Entry>::iterator {
+        for (auto it = cache.begin(); it != cache.end(); ++it) {
+            if (it->hash == hash && it->size == size) {
+                cache.splice(cache.begin(), cache, it);
+
+                return cache.begin();
+            }
+        }
+
+        return cache.end();
+    };
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = find();
+
+        if (it != cache.end())
+            return it->lut;
+    }
+
+    // Built without the lock, so that other threads can use the cache
+    // meanwhile. Unsupported profiles are cached as well, as nullptr.
+    std::shared_ptr<const ColorLut> lut = build_srgb_lut(profile, size);
+    std::lock_guard<std::mutex> lock(mutex);
+
+    //Another thread may have built it too, and the files share the first
+    auto it = find();
+
+    if (it != cache.end())
+        return it->lut;
+
+    cache.push_front(Entry{hash, size, lut});
+
+    //Files still using an evicted table keep it alive through their pointer
+    if (cache.size() > LUT_CACHE_SIZE)
+        cache.pop_back();
+
+    return lut;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// A 3D lookup table that maps device RGB to sRGB.
+// Samples between the grid nodes use tetrahedral interpolation.
+class ColorLut
+{
+public:
+    // Nodes per axis
+    static const uint32_t GRID = 33;
+
+    // Convert a row of RGB or RGBA pixels of 8 or 16-bit samples.
+    // Alpha is copied unchanged. SPP fixes the samples per pixel at
+    // compile time (3 or 4); 0 takes it from spp instead.
+    template <uint32_t SPP = 0, typename T>
+    void apply(const T *in, T *out, uint32_t width, uint32_t spp) const;
+
+private:
+    friend std::shared_ptr<const ColorLut> build_srgb_lut(const uint8_t *, size_t);
+
+    //Pixels interpolated together
+    static constexpr uint32_t BLOCK = 8;
+
+    // Interpolate a block of 16-bit RGB pixels in place, stored as one
+    // array per channel
+    void interpolate(uint32_t rgb[3][BLOCK]) const;
+
+    //16-bit sRGB values, GRID^3 nodes of 4 entries (the 4th is padding)
+    std::vector<uint16_t> nodes;
+    //Grid cell and weight of each 16-bit sample, as (cell << 16) | weight
+    std::vector<uint32_t> positions;
+};
+
+// Build a device RGB to sRGB table for an ICC profile.
+// Returns nullptr when the profile is not an RGB matrix/TRC profile.
+std::shared_ptr<const ColorLut> build_srgb_lut(const uint8_t *profile, size_t size);
+
+// Same as build_srgb_lut(), but tables are cached across calls by a hash
+// of the profile, so a batch of files sharing a profile builds it once.
+// Only the most recently used tables are kept.
+std::shared_ptr<const ColorLut> get_srgb_lut(const uint8_t *profile, size_t size);
@@ -0,0 +1,275 @@
+#include "jpeg_reader.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include "diagnostics.h"
+
+//Rows decoded at once from an old-style JPEG stream
+static const uint32_t INTERCHANGE_BAND_ROWS = 64;
+
+std::unique_ptr<JpegReader> JpegReader::create(TIFF *tif, Diagnostics &diagnostics, uint32_t scale)
+{
+    uint16_t compression = COMPRESSION_NONE, planar = PLANARCONFIG_CONTIG;
+    uint16_t bps = 0, spp = 0, photometric = 0;
+
+    TIFFGetFieldDefaulted(tif, TIFFTAG_COMPRESSION, &compression);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_PLANARCONFIG, &planar);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_BITSPERSAMPLE, &bps);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLESPERPIXEL, &spp);
+    TIFFGetField(tif, TIFFTAG_PHOTOMETRIC, &photometric);
+
+    if (compression != COMPRESSION_JPEG && compression != COMPRESSION_OJPEG)
+        return nullptr;
+
+    if (bps != 8 || planar != PLANARCONFIG_CONTIG)
+        return nullptr;
+
+    bool gray = spp == 1 && photometric == PHOTOMETRIC_MINISBLACK;
+    bool color = spp == 3 && (photometric == PHOTOMETRIC_RGB || photometric == PHOTOMETRIC_YCBCR);
+
+    if (!(gray || color) || !(scale == 1 || scale == 2 || scale == 4 || scale == 8))
+        return nullptr;
+
+    std::unique_ptr<MappedFile> mapping = MappedFile::map(TIFFFileno(tif));
+
+    if (!mapping)
+        return nullptr;
+
+    std::unique_ptr<JpegReader> reader(new JpegReader(tif, std::move(mapping), diagnostics, scale));
+
+    reader->spp = spp;
+    reader->photometric = photometric;
+
+    //Old-style JPEG is only handled in its self-contained form
+    if (compression == COMPRESSION_OJPEG) {
+        uint64_t offset = 0, size = 0;
+
+        if (!TIFFGetField(tif, TIFFTAG_JPEGIFOFFSET, &offset) || offset == 0 ||
+            offset >= reader->mapping->size())
+            return nullptr;
+
+        if (!TIFFGetField(tif, TIFFTAG_JPEGIFBYTECOUNT, &size) || size == 0 ||
+            size > reader->mapping->size() - offset)
+            size = reader->mapping->size() - offset;
+
+        reader->interchange = true;
+        reader->interchange_offset = offset;
+        reader->interchange_size = size;
+    }
+
+    uint32_t width = 0, height = 0;
+    TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &width);
+    TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &height);
+
+    reader->out_width = (width + scale - 1) / scale;
+    reader->out_height = (height + scale - 1) / scale;
+
+    if (reader->interchange) {
+        reader->rows_per_band = INTERCHANGE_BAND_ROWS;
+    } else if (TIFFIsTiled(tif)) {
+        uint32_t tile_length = 0;
+        TIFFGetField(tif, TIFFTAG_TILEWIDTH, &reader->tile_width);
+        TIFFGetField(tif, TIFFTAG_TILELENGTH, &tile_length);
+
+        //Tiles are a multiple of 16 pixels, so scale to whole pixels
+        if (reader->tile_width == 0 || tile_length == 0 ||
+            reader->tile_width % scale != 0 || tile_length % scale != 0)
+            return nullptr;
+
+        reader->tiled = true;
+        reader->rows_per_strile = tile_length;
+        reader->rows_per_band = tile_length / scale;
+        reader->tile.resize((size_t) reader->tile_width / scale * reader->rows_per_band * spp);
+    } else {
+        uint32_t rows_per_strip = 0;
+        TIFFGetFieldDefaulted(tif, TIFFTAG_ROWSPERSTRIP, &rows_per_strip);
+        rows_per_strip = std::min(rows_per_strip, height);
+
+        //Every strip but the last has to scale to whole rows
+        if (rows_per_strip == 0 || (rows_per_strip < height && rows_per_strip % scale != 0))
+            return nullptr;
+
+        reader->rows_per_strile = rows_per_strip;
+        reader->rows_per_band = (rows_per_strip + scale - 1) / scale;
+    }
+
+    //Tables shared by all strips or tiles
+    uint32_t tables_size = 0;
+    void *tables = nullptr;
+
+    if (!reader->interchange &&
+        TIFFGetField(tif, TIFFTAG_JPEGTABLES, &tables_size, &tables) && tables_size > 0) {
+        if (setjmp(reader->error.jump))
+            return nullptr;
+
+        jpeg_mem_src(&reader->cinfo, (const unsigned char *) tables, tables_size);
+        jpeg_read_header(&reader->cinfo, FALSE);
+    }
+
+    return reader;
+}
+
+JpegReader::JpegReader(TIFF *tif, std::unique_ptr<MappedFile> mapping, Diagnostics &diagnostics,
+                       uint32_t scale)
+    : tif(tif),
+      mapping(std::move(mapping)),
+      scale(scale)
+{
+    cinfo.err = jpeg_std_error(&error.pub);
+    error.pub.error_exit = on_error;
+    error.pub.output_message = on_message;
+    error.diagnostics = &diagnostics;
+
+    jpeg_create_decompress(&cinfo);
+}
+
+JpegReader::~JpegReader()
+{
+    jpeg_destroy_decompress(&cinfo);
+}
+
+// libjpeg can't return errors, so they jump back to the reader method that
+// called it
+void JpegReader::on_error(j_common_ptr cinfo)
+{
+    ErrorManager *error = (ErrorManager *) cinfo->err;
+
+    longjmp(error->jump, 1);
+}
+
+// Warnings, which libjpeg would print to stderr, go with the file's other
+// diagnostics
+void JpegReader::on_message(j_common_ptr cinfo)
+{
+    ErrorManager *error = (ErrorManager *) cinfo->err;
+    char message[JMSG_LENGTH_MAX];
+    (*cinfo->err->format_message)(cinfo, message);
+
+    error->diagnostics->warning(std::string("libjpeg: ") + message);
+}
+
+void JpegReader::fail(const char *message)
+{
+    jpeg_abort_decompress(&cinfo);
+    decompressing = false;
+
+    throw std::runtime_error(message);
+}
+
+// Starts decoding the JPEG stream at offset in the file
+void JpegReader::start(uint64_t offset, uint64_t size, uint32_t expected_width)
+{
+    if (offset > mapping->size() || size > mapping->size() - offset)
+        fail("JPEG data lies outside the file");
+
+    jpeg_mem_src(&cinfo, mapping->data() + offset, (unsigned long) size);
+    jpeg_read_header(&cinfo, TRUE);
+    decompressing = true;
+
+    if (cinfo.num_components != (int) spp)
+        fail("JPEG data does not match the samples per pixel of the TIFF");
+
+    //Streams in TIFFs usually have no JFIF or Adobe marker, so the color
+    //space comes from the photometric interpretation instead
+    if (spp == 3) {
+        cinfo.jpeg_color_space = (photometric == PHOTOMETRIC_RGB) ? JCS_RGB : JCS_YCbCr;
+        cinfo.out_color_space = JCS_RGB;
+    } else {
+        cinfo.jpeg_color_space = JCS_GRAYSCALE;
+        cinfo.out_color_space = JCS_GRAYSCALE;
+    }
+
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = scale;
+
+    jpeg_start_decompress(&cinfo);
+
+    if (cinfo.output_width < expected_width)
+        fail("JPEG data is narrower than the TIFF");
+}
+
+// Reads rows decoded rows into out, and finishes the stream once it has
+// been read to the end
+void JpegReader::read_rows(uint8_t *out, size_t stride, uint32_t rows)
+{
+    if (cinfo.output_height - cinfo.output_scanline < rows)
+        fail("JPEG data is shorter than the TIFF");
+
+    JSAMPROW pointers[4];
+    uint32_t done = 0;
+
+    while (done < rows) {
+        uint32_t count = std::min<uint32_t>(rows - done, 4);
+
+        for (uint32_t i = 0; i < count; i++)
+            pointers[i] = out + (done + i) * stride;
+
+        done += jpeg_read_scanlines(&cinfo, pointers, count);
+    }
+
+    if (cinfo.output_scanline == cinfo.output_height) {
+        jpeg_finish_decompress(&cinfo);
+        decompressing = false;
+    }
+}
+
+void JpegReader::decode_strile(uint32_t strile, uint8_t *out, size_t stride, uint32_t rows)
+{
+    uint32_t width = tiled ? tile_width / scale : out_width;
+
+    start(TIFFGetStrileOffset(tif, strile), TIFFGetStrileByteCount(tif, strile), width);
+    read_rows(out, stride, rows);
+
+    //Padding rows at the bottom of a tile or strip aren't needed
+    if (decompressing) {
+        jpeg_abort_decompress(&cinfo);
+        decompressing = false;
+    }
+}
+
+uint32_t JpegReader::read_band(uint8_t *out)
+{
+    if (setjmp(error.jump)) {
+        char message[JMSG_LENGTH_MAX];
+        (*error.pub.format_message)((j_common_ptr) &cinfo, message);
+
+        jpeg_abort_decompress(&cinfo);
+        decompressing = false;
+
+        throw std::runtime_error(std::string("JPEG error: ") + message);
+    }
+
+    uint32_t rows = std::min(rows_per_band, out_height - row);
+    size_t stride = (size_t) out_width * spp;
+
+    if (interchange) {
+        if (!decompressing)
+            start(interchange_offset, interchange_size, out_width);
+
+        read_rows(out, stride, rows);
+    } else if (tiled) {
+        uint32_t y = band * rows_per_strile;
+        uint32_t tile_out_width = tile_width / scale;
+        size_t tile_stride = (size_t) tile_out_width * spp;
+
+        for (uint32_t x = 0; x < out_width; x += tile_out_width) {
+            uint32_t columns = std::min(tile_out_width, out_width - x);
+
+            decode_strile(TIFFComputeTile(tif, x * scale, y, 0, 0), tile.data(), tile_stride, rows);
+
+            for (uint32_t i = 0; i < rows; i++)
+                memcpy(out + i * stride + (size_t) x * spp, tile.data() + i * tile_stride,
+                       (size_t) columns * spp);
+        }
+    } else {
+        decode_strile(band, out, stride, rows);
+    }
+
+    row += rows;
+    band++;
+
+    return rows;
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <csetjmp>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <tiffio.h>
+#include <jpeglib.h>
+
+#include "buffer.h"
+
+struct Diagnostics;
+
+// Decodes JPEG-compressed TIFFs straight through libjpeg: new-style JPEG
+// strips and tiles, with the tables shared through JPEGTABLES, and
+// old-style JPEG files that hold a complete JPEG stream at JPEGIFOFFSET.
+// YCbCr is converted to RGB. The image can be scaled down by 2, 4 or 8 in
+// the DCT domain, which skips most of the inverse DCT work.
+class JpegReader
+{
+public:
+    // Returns nullptr if the image can't be decoded this way, leaving it
+    // to libtiff. scale is 1, 2, 4 or 8. libjpeg's warnings are reported to
+    // diagnostics, which must outlive the reader.
+    static std::unique_ptr<JpegReader> create(TIFF *tif, Diagnostics &diagnostics, uint32_t scale = 1);
+
+    ~JpegReader();
+
+    JpegReader(const JpegReader &) = delete;
+    JpegReader &operator=(const JpegReader &) = delete;
+
+    // Size of the decoded image, after scaling
+    uint32_t width() const { return out_width; }
+    uint32_t height() const { return out_height; }
+    // 1 for grayscale, 3 for RGB
+    uint32_t samples() const { return spp; }
+    // Most rows read_band returns at once
+    uint32_t band_rows() const { return rows_per_band; }
+
+    // Decodes the next band into out, rows of width() * samples() bytes.
+    // Returns the number of rows.
+    uint32_t read_band(uint8_t *out);
+
+private:
+    struct ErrorManager
+    {
+        jpeg_error_mgr pub;
+        jmp_buf jump;
+        Diagnostics *diagnostics;
+    };
+
+    JpegReader(TIFF *tif, std::unique_ptr<MappedFile> mapping, Diagnostics &diagnostics, uint32_t scale);
+
+    static void on_error(j_common_ptr cinfo);
+    static void on_message(j_common_ptr cinfo);
+
+    void start(uint64_t offset, uint64_t size, uint32_t expected_width);
+    void read_rows(uint8_t *out, size_t stride, uint32_t rows);
+    void decode_strile(uint32_t strile, uint8_t *out, size_t stride, uint32_t rows);
+    [[noreturn]] void fail(const char *message);
+
+    TIFF *tif;
+    std::unique_ptr<MappedFile> mapping;
+    uint32_t scale;
+    uint32_t spp = 0;
+    uint16_t photometric = 0;
+
+    uint32_t out_width = 0;
+    uint32_t out_height = 0;
+    uint32_t rows_per_band = 0;
+
+    //Source rows covered by each strip or row of tiles
+    uint32_t rows_per_strile = 0;
+    bool tiled = false;
+    uint32_t tile_width = 0;
+    //Decoded tile, before the columns inside the image are copied out
+    AlignedBuffer tile;
+
+    //Old-style JPEG: one stream for the whole image, read a band at a time
+    bool interchange = false;
+    uint64_t interchange_offset = 0;
+    uint64_t interchange_size = 0;
+
+    //Rows returned so far, and bands
+    uint32_t row = 0;
+    uint32_t band = 0;
+
+    jpeg_decompress_struct cinfo{};
+    ErrorManager error{};
+    bool decompressing = false;
+};
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <numeric>
+#include <stdexcept>
+
+// The SIMD kernels are written once with GCC/Clang vector extensions,
+// as templates over the number of samples handled per iteration. Each
+// instruction set gets its own instantiation, compiled with a target
+// attribute, so one binary carries SSE2, AVX2 and AVX-512 code. The
+// kernels that work on samples are here, so that the row pipelines can
+// inline them too; the rest are in kernels.cc.
+template <size_t N>
+struct Vec
+{
+    typedef uint8_t u8 __attribute__((vector_size(N)));
+    typedef uint16_t u16 __attribute__((vector_size(N * 2)));
+    typedef int16_t i16 __attribute__((vector_size(N * 2)));
+    typedef uint32_t u32 __attribute__((vector_size(N * 4)));
+};
+
+//The kernel bodies are inlined into each variant's entry points
+#define KERNEL static inline __attribute__((always_inline))
+
+// Scale a 16-bit sample plus a threshold in [0, 65535) down to 8 bits.
+// This is floor((v * 255 + threshold) / 65535) without the division;
+// the shift-add form is exact for every input below 2^24.
+KERNEL uint32_t scale16to8(uint32_t v, uint32_t threshold)
+{
+    uint32_t y = (v << 8) - v + threshold;
+
+    return (y + (y >> 16) + 1) >> 16;
+}
+
+// Vector form of scale16to8(), on N samples at a time. Wide vectors
+// are kept out of function signatures, where they would change the ABI.
+template <size_t N>
+KERNEL void scale16to8(const uint16_t *in, const uint32_t *threshold, uint8_t *out)
+{
+    typedef typename Vec<N>::u8 u8v;
+    typedef typename Vec<N>::u16 u16v;
+    typedef typename Vec<N>::u32 u32v;
+
+    u16v v;
+    u32v t;
+    memcpy(&v, in, sizeof(v));
+    memcpy(&t, threshold, sizeof(t));
+
+    u32v w = __builtin_convertvector(v, u32v);
+    u32v y = (w << 8) - w + t;
+    u8v q = __builtin_convertvector((y + (y >> 16) + 1) >> 16, u8v);
+
+    memcpy(out, &q, sizeof(q));
+}
+
+template <size_t N>
+KERNEL void depth16to8_truncate(const uint16_t *in, uint8_t *out, size_t count)
+{
+    typedef typename Vec<N>::u8 u8v;
+    typedef typename Vec<N>::u16 u16v;
+    size_t i = 0;
+
+    for (; i + N <= count; i += N) {
+        u16v v;
+        memcpy(&v, in + i, sizeof(v));
+        u8v q = __builtin_convertvector(v >> 8, u8v);
+        memcpy(out + i, &q, sizeof(q));
+    }
+
+    for (; i < count; i++)
+        out[i] = (uint8_t) (in[i] >> 8);
+}
+
+template <size_t N>
+KERNEL void depth16to8_round(const uint16_t *in, uint8_t *out, size_t count)
+{
+    const uint32_t half = 32767;
+    uint32_t threshold[N];
+    std::fill(threshold, threshold + N, half);
+    size_t i = 0;
+
+    for (; i + N <= count; i += N)
+        scale16to8<N>(in + i, threshold, out + i);
+
+    for (; i < count; i++)
+        out[i] = (uint8_t) scale16to8(in[i], half);
+}
+
+// 4x4 Bayer matrix, values 0 to 15
+static const uint8_t BAYER4[4][4] = {
+    { 0,  8,  2, 10},
+    {12,  4, 14,  6},
+    { 3, 11,  1,  9},
+    {15,  7, 13,  5}
+};
+
+template <size_t N, uint32_t SPP>
+KERNEL void depth16to8_ordered(const uint16_t *in, uint8_t *out,
+                               uint32_t width, uint32_t spp, uint32_t row)
+{
+    if (SPP)
+        spp = SPP;
+
+    // The thresholds repeat every 4 pixels. Lay them out over a span that
+    // is a multiple of both the pattern and the vector width, so that each
+    // vector can pick up its thresholds with a plain load.
+    uint32_t thresholds[16 * N];
+    const size_t span = std::lcm<size_t>(4 * spp, N);
+
+    if (span > sizeof(thresholds) / sizeof(thresholds[0]))
+        throw std::invalid_argument("Too many samples per pixel for ordered dithering");
+
+    for (size_t i = 0; i < span; i++)
+        thresholds[i] = BAYER4[row & 3][(i / spp) & 3] * 4096u + 2048u;
+
+    size_t count = (size_t) width * spp;
+    size_t i = 0;
+
+    for (; i + N <= count; i += N)
+        scale16to8<N>(in + i, thresholds + (i % span), out + i);
+
+    for (; i < count; i++)
+        out[i] = (uint8_t) scale16to8(in[i], thresholds[i % span]);
+}
+
+template <size_t N>
+KERNEL void swap16(const uint16_t *in, uint16_t *out, size_t count)
+{
+    typedef typename Vec<N>::u16 u16v;
+    size_t i = 0;
+
+    for (; i + N <= count; i += N) {
+        u16v v;
+        memcpy(&v, in + i, sizeof(v));
+        v = (v << 8) | (v >> 8);
+        memcpy(out + i, &v, sizeof(v));
+    }
+
+    for (; i < count; i++)
+        out[i] = (uint16_t) ((in[i] << 8) | (in[i] >> 8));
+}
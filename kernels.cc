@@ -0,0 +1,585 @@
+#include "kernels.h"
+
+#include "checksum.h"
+#include "kernel_bodies.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdlib>
+#include <cstring>
+#include <numeric>
+#include <random>
+#include <stdexcept>
+
+// Shuffle masks for the predictor kernels, on vectors of L lanes of type T
+template <typename T, size_t L>
+struct LaneMasks
+{
+    //Lane i takes lane i - k, or lane 0 of a second, zero vector
+    static constexpr std::array<T, L> shift_up(size_t k)
+    {
+        std::array<T, L> mask{};
+
+        for (size_t i = 0; i < L; i++)
+            mask[i] = (T) (i >= k ? i - k : L);
+
+        return mask;
+    }
+
+    //The last whole pixel of spp samples repeated across the vector
+    static constexpr std::array<T, L> last_pixel(size_t spp)
+    {
+        std::array<T, L> mask{};
+
+        for (size_t i = 0; i < L; i++)
+            mask[i] = (T) (L / spp * spp - spp + i % spp);
+
+        return mask;
+    }
+};
+
+// Running sums over lanes SPP apart, in log2 steps: after the step for K,
+// each lane holds the sum of the 2K / SPP lanes ending at it.
+template <typename V, typename T, size_t L, uint32_t SPP, size_t K = SPP>
+KERNEL void prefix_sum(V &v)
+{
+    if constexpr (K < L / SPP * SPP) {
+        static constexpr std::array<T, L> masks = LaneMasks<T, L>::shift_up(K);
+        V mask;
+        memcpy(&mask, masks.data(), sizeof(mask));
+
+        v += __builtin_shuffle(v, (V){}, mask);
+        prefix_sum<V, T, L, SPP, 2 * K>(v);
+    }
+}
+
+// Finishes the samples of one vector of the predictor and moves the carry
+// on to the last pixel. last_pixel is the mask from LaneMasks::last_pixel().
+template <typename V, typename T, size_t L, uint32_t SPP, bool SWAP>
+KERNEL void predictor_step(V &v, V &carry, const V &last_pixel)
+{
+    if (SWAP)
+        v = (v << 8) | (v >> 8);
+
+    prefix_sum<V, T, L, SPP>(v);
+    //The sums are the same whatever the carry, so the carry can take them
+    //without waiting on this vector's store
+    V last = __builtin_shuffle(v, last_pixel);
+    v += carry;
+    carry += last;
+}
+
+// Undoes the TIFF horizontal predictor, each sample being stored as the
+// difference from the same sample of the pixel before, with 16-bit samples
+// byte swapped first when SWAP is set. Each vector covers the whole pixels
+// that fit in it, and the sums carry over from one vector to the next.
+template <typename T, size_t N, uint32_t SPP, bool SWAP>
+KERNEL void undo_predictor(T *row, uint32_t width, uint32_t spp)
+{
+    if (SPP)
+        spp = SPP;
+
+    size_t count = (size_t) width * spp;
+    size_t i = 0;
+
+    // SSE2 has no byte shuffle (pshufb is SSSE3) to spread a 3-sample pixel
+    // over a vector, which is slower than the scalar loop
+    constexpr bool vector = SPP != 0 && !(N == 16 && SPP == 3);
+
+    if constexpr (vector) {
+        typedef T V __attribute__((vector_size(N)));
+        const size_t L = N / sizeof(T);
+        //Samples finished per vector
+        const size_t STEP = L / SPP * SPP;
+
+        static constexpr std::array<T, L> masks = LaneMasks<T, L>::last_pixel(SPP);
+        V last_pixel;
+        memcpy(&last_pixel, masks.data(), sizeof(last_pixel));
+
+        if (count >= L) {
+            V carry = {}, next;
+            memcpy(&next, row, sizeof(next));
+
+            // A whole vector is stored, running past the samples it finished
+            // when the pixels don't fill it, so the next one is loaded first.
+            // The last one only stores what it finished.
+            for (; i + STEP + L <= count; i += STEP) {
+                V v = next;
+                memcpy(&next, row + i + STEP, sizeof(next));
+                predictor_step<V, T, L, SPP, SWAP>(v, carry, last_pixel);
+                memcpy(row + i, &v, sizeof(v));
+            }
+
+            predictor_step<V, T, L, SPP, SWAP>(next, carry, last_pixel);
+            memcpy(row + i, &next, STEP * sizeof(T));
+            i += STEP;
+        }
+    }
+
+    for (; i < count; i++) {
+        if (SWAP)
+            row[i] = (T) ((row[i] << 8) | (row[i] >> 8));
+
+        if (i >= spp)
+            row[i] = (T) (row[i] + row[i - spp]);
+    }
+}
+
+template <size_t N>
+KERNEL uint32_t adler32(uint32_t adler, const uint8_t *data, size_t size)
+{
+    typedef typename Vec<N>::u8 u8v;
+    typedef typename Vec<N>::u32 u32v;
+
+    //Largest prime below 65536
+    const uint32_t BASE = 65521;
+    //Bytes per block, at most the 5552 zlib allows before reducing the sums
+    const size_t BLOCK = 5552 / N * N;
+
+    //Weights N down to 1 for the bytes of a vector
+    uint32_t weights_array[N];
+
+    for (size_t i = 0; i < N; i++)
+        weights_array[i] = (uint32_t) (N - i);
+
+    u32v weights;
+    memcpy(&weights, weights_array, sizeof(weights));
+
+    uint32_t s1 = adler & 0xffff;
+    uint32_t s2 = adler >> 16;
+
+    // Per lane, sum1 adds up the bytes, prefix adds up sum1 before each
+    // vector and weighted adds up the bytes times their distance from the
+    // end of their vector. Together they give the change to s2.
+    while (size >= N) {
+        size_t n = std::min(size, BLOCK) / N * N;
+        u32v sum1 = {}, prefix = {}, weighted = {};
+
+        s2 += (uint32_t) n * s1;
+
+        for (size_t i = 0; i < n; i += N) {
+            u8v v;
+            memcpy(&v, data + i, sizeof(v));
+            u32v x = __builtin_convertvector(v, u32v);
+
+            prefix += sum1;
+            sum1 += x;
+            weighted += x * weights;
+        }
+
+        for (size_t i = 0; i < N; i++) {
+            s1 += sum1[i];
+            s2 += (uint32_t) N * prefix[i] + weighted[i];
+        }
+
+        s1 %= BASE;
+        s2 %= BASE;
+        data += n;
+        size -= n;
+    }
+
+    for (; size > 0; size--) {
+        s1 += *data++;
+        s2 += s1;
+    }
+
+    return ((s2 % BASE) << 16) | (s1 % BASE);
+}
+
+// The PNG predictor for a byte, from its left (a), upper (b) and
+// upper-left (c) neighbours
+KERNEL uint8_t png_predict(int type, uint8_t a, uint8_t b, uint8_t c)
+{
+    switch (type) {
+    case 1:
+        return a;
+    case 2:
+        return b;
+    case 3:
+        return (uint8_t) ((a + b) >> 1);
+    case 4: {
+        int pa = abs(b - c);
+        int pb = abs(a - c);
+        int pc = abs(a + b - 2 * c);
+
+        return (pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c);
+    }
+    default:
+        return 0;
+    }
+}
+
+template <size_t N>
+KERNEL void png_filter(int type, const uint8_t *row, const uint8_t *prev,
+                       uint8_t *out, size_t size, size_t bpp)
+{
+    typedef typename Vec<N>::u8 u8v;
+    typedef typename Vec<N>::u16 u16v;
+    typedef typename Vec<N>::i16 i16v;
+
+    // The first pixel has no left neighbours
+    size_t i = 0;
+
+    for (; i < size && i < bpp; i++)
+        out[i] = (uint8_t) (row[i] - png_predict(type, 0, prev[i], 0));
+
+    for (; i + N <= size; i += N) {
+        u8v x, a, b, c, p;
+        memcpy(&x, row + i, sizeof(x));
+        memcpy(&a, row + i - bpp, sizeof(a));
+        memcpy(&b, prev + i, sizeof(b));
+        memcpy(&c, prev + i - bpp, sizeof(c));
+
+        switch (type) {
+        case 1:
+            p = a;
+            break;
+        case 2:
+            p = b;
+            break;
+        case 3: {
+            u16v sum = __builtin_convertvector(a, u16v) + __builtin_convertvector(b, u16v);
+            p = __builtin_convertvector(sum >> 1, u8v);
+            break;
+        }
+        case 4: {
+            i16v wa = __builtin_convertvector(a, i16v);
+            i16v wb = __builtin_convertvector(b, i16v);
+            i16v wc = __builtin_convertvector(c, i16v);
+            i16v pa = wb - wc;
+            i16v pb = wa - wc;
+            i16v pc = pa + pb;
+
+            pa = pa < 0 ? -pa : pa;
+            pb = pb < 0 ? -pb : pb;
+            pc = pc < 0 ? -pc : pc;
+
+            i16v pred = ((pa <= pb) & (pa <= pc)) ? wa : (pb <= pc ? wb : wc);
+            p = __builtin_convertvector(pred, u8v);
+            break;
+        }
+        default:
+            p = (u8v){};
+            break;
+        }
+
+        x -= p;
+        memcpy(out + i, &x, sizeof(x));
+    }
+
+    for (; i < size; i++)
+        out[i] = (uint8_t) (row[i] - png_predict(type, row[i - bpp], prev[i], prev[i - bpp]));
+}
+
+template <size_t N>
+KERNEL uint32_t filter_cost(const uint8_t *data, size_t size)
+{
+    typedef typename Vec<N>::u8 u8v;
+    typedef typename Vec<N>::u32 u32v;
+
+    u32v sum = {};
+    size_t i = 0;
+
+    for (; i + N <= size; i += N) {
+        u8v v;
+        memcpy(&v, data + i, sizeof(v));
+        u32v w = __builtin_convertvector(v, u32v);
+        sum += w < 128 ? w : 256 - w;
+    }
+
+    uint32_t cost = 0;
+
+    for (size_t k = 0; k < N; k++)
+        cost += sum[k];
+
+    for (; i < size; i++)
+        cost += data[i] < 128 ? data[i] : 256 - data[i];
+
+    return cost;
+}
+
+// Defines the entry points and the table of one variant. N is the number
+// of samples per iteration, sized to fill the variant's vector registers.
+// CRC is the CRC-32 implementation for the variant.
+#define DEFINE_VARIANT(NAME, TARGET, N, CRC)                                                \
+    namespace NAME                                                                          \
+    {                                                                                       \
+    TARGET static void truncate(const uint16_t *in, uint8_t *out, size_t count)             \
+    {                                                                                       \
+        depth16to8_truncate<N>(in, out, count);                                             \
+    }                                                                                       \
+    TARGET static void round(const uint16_t *in, uint8_t *out, size_t count)                \
+    {                                                                                       \
+        depth16to8_round<N>(in, out, count);                                                \
+    }                                                                                       \
+    template <uint32_t SPP>                                                                 \
+    TARGET static void ordered(const uint16_t *in, uint8_t *out,                            \
+                               uint32_t width, uint32_t spp, uint32_t row)                  \
+    {                                                                                       \
+        depth16to8_ordered<N, SPP>(in, out, width, spp, row);                               \
+    }                                                                                       \
+    TARGET static void swap(const uint16_t *in, uint16_t *out, size_t count)                \
+    {                                                                                       \
+        swap16<N>(in, out, count);                                                          \
+    }                                                                                       \
+    template <uint32_t SPP>                                                                 \
+    TARGET static void predictor8(uint8_t *row, uint32_t width, uint32_t spp)               \
+    {                                                                                       \
+        undo_predictor<uint8_t, N, SPP, false>(row, width, spp);                            \
+    }                                                                                       \
+    template <uint32_t SPP>                                                                 \
+    TARGET static void predictor16(uint16_t *row, uint32_t width, uint32_t spp, bool swap)  \
+    {                                                                                       \
+        if (swap)                                                                           \
+            undo_predictor<uint16_t, N, SPP, true>(row, width, spp);                        \
+        else                                                                                \
+            undo_predictor<uint16_t, N, SPP, false>(row, width, spp);                       \
+    }                                                                                       \
+    TARGET static uint32_t adler(uint32_t adler, const uint8_t *data, size_t size)          \
+    {                                                                                       \
+        return adler32<N>(adler, data, size);                                               \
+    }                                                                                       \
+    TARGET static void filter(int type, const uint8_t *row, const uint8_t *prev,            \
+                              uint8_t *out, size_t size, size_t bpp)                        \
+    {                                                                                       \
+        png_filter<N>(type, row, prev, out, size, bpp);                                     \
+    }                                                                                       \
+    TARGET static uint32_t cost(const uint8_t *data, size_t size)                           \
+    {                                                                                       \
+        return filter_cost<N>(data, size);                                                  \
+    }                                                                                       \
+    static const KernelTable table = {                                                      \
+        #NAME, truncate, round,                                                             \
+        {ordered<0>, ordered<1>, ordered<2>, ordered<3>, ordered<4>},                       \
+        swap,                                                                               \
+        {predictor8<0>, predictor8<1>, predictor8<2>, predictor8<3>, predictor8<4>},        \
+        {predictor16<0>, predictor16<1>, predictor16<2>, predictor16<3>, predictor16<4>},   \
+        CRC, adler, filter, cost                                                            \
+    };                                                                                      \
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+DEFINE_VARIANT(sse2, , 16, checksum::crc32_scalar)
+DEFINE_VARIANT(avx2, __attribute__((target("avx2"))), 32, checksum::crc32_pclmul)
+DEFINE_VARIANT(avx512, __attribute__((target("avx512f,avx512bw"))), 64, checksum::crc32_pclmul)
+
+static const KernelTable *const VARIANTS[] = {&sse2::table, &avx2::table, &avx512::table};
+
+static bool cpu_supports(const KernelTable *table)
+{
+    if (table == &avx2::table)
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("pclmul");
+    if (table == &avx512::table)
+        return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") &&
+               __builtin_cpu_supports("pclmul");
+
+    return true;
+}
+#else
+DEFINE_VARIANT(generic, , 16, checksum::crc32_scalar)
+
+static const KernelTable *const VARIANTS[] = {&generic::table};
+
+static bool cpu_supports(const KernelTable *)
+{
+    return true;
+}
+#endif
+
+std::vector<const KernelTable *> supported_kernels()
+{
+    std::vector<const KernelTable *> tables;
+
+    for (const KernelTable *table : VARIANTS)
+        if (cpu_supports(table))
+            tables.push_back(table);
+
+    return tables;
+}
+
+static const KernelTable *selected = nullptr;
+
+const KernelTable &kernels()
+{
+    if (!selected)
+        selected = supported_kernels().back();
+
+    return *selected;
+}
+
+bool select_kernels(const char *name)
+{
+    if (strcmp(name, "auto") == 0) {
+        selected = supported_kernels().back();
+
+        return true;
+    }
+
+    for (const KernelTable *table : supported_kernels()) {
+        if (strcmp(table->name, name) == 0) {
+            selected = table;
+
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool kernel_self_test(std::ostream &out)
+{
+    std::vector<const KernelTable *> tables = supported_kernels();
+    const KernelTable &reference = *tables.front();
+    std::vector<bool> passed(tables.size(), true);
+    std::mt19937 random(1);
+
+    auto check = [&](size_t t, const char *kernel, size_t count,
+                     const void *expected, const void *actual, size_t size) {
+        if (memcmp(expected, actual, size) != 0) {
+            out << tables[t]->name << ": " << kernel << " differs from " << reference.name
+                << " for " << count << " samples" << std::endl;
+            passed[t] = false;
+        }
+    };
+
+    // Odd lengths exercise the scalar tails as well as the vector loops
+    for (size_t count : {1, 3, 15, 16, 17, 63, 64, 65, 255, 1000, 4099}) {
+        std::vector<uint16_t> in(count);
+
+        for (uint16_t &v : in)
+            v = (uint16_t) random();
+
+        in[0] = 65535;
+
+        std::vector<uint8_t> expected8(count), actual8(count);
+        std::vector<uint16_t> expected16(count), actual16(count);
+
+        for (size_t t = 0; t < tables.size(); t++) {
+            const KernelTable *table = tables[t];
+
+            reference.depth16to8_truncate(in.data(), expected8.data(), count);
+            table->depth16to8_truncate(in.data(), actual8.data(), count);
+            check(t, "depth16to8_truncate", count, expected8.data(), actual8.data(), count);
+
+            reference.depth16to8_round(in.data(), expected8.data(), count);
+            table->depth16to8_round(in.data(), actual8.data(), count);
+            check(t, "depth16to8_round", count, expected8.data(), actual8.data(), count);
+
+            for (uint32_t spp = 1; spp <= 4; spp++) {
+                uint32_t width = (uint32_t) (count / spp);
+
+                for (uint32_t row = 0; row < 4; row++) {
+                    for (uint32_t entry : {0u, spp}) {
+                        reference.depth16to8_ordered[0](in.data(), expected8.data(), width, spp, row);
+                        table->depth16to8_ordered[entry](in.data(), actual8.data(), width, spp, row);
+                        check(t, "depth16to8_ordered", count, expected8.data(), actual8.data(), width * spp);
+                    }
+                }
+            }
+
+            reference.swap16(in.data(), expected16.data(), count);
+            table->swap16(in.data(), actual16.data(), count);
+            check(t, "swap16", count, expected16.data(), actual16.data(), count * 2);
+
+            for (uint32_t spp = 1; spp <= 5; spp++) {
+                uint32_t width = (uint32_t) (count / spp);
+                uint32_t entry = spp <= 4 ? spp : 0;
+
+                for (bool swap : {false, true}) {
+                    expected16 = in;
+                    actual16 = in;
+                    reference.undo_predictor16[0](expected16.data(), width, spp, swap);
+                    table->undo_predictor16[entry](actual16.data(), width, spp, swap);
+                    check(t, "undo_predictor16", count, expected16.data(), actual16.data(), count * 2);
+                }
+
+                memcpy(expected8.data(), in.data(), count);
+                memcpy(actual8.data(), in.data(), count);
+                reference.undo_predictor8[0](expected8.data(), width, spp);
+                table->undo_predictor8[entry](actual8.data(), width, spp);
+                check(t, "undo_predictor8", count, expected8.data(), actual8.data(), count);
+            }
+
+            // The byte kernels run over the same buffer seen as bytes
+            const uint8_t *bytes = (const uint8_t *) in.data();
+            const uint8_t *prev = bytes + count;
+            size_t size = count;
+
+            uint32_t expected = reference.crc32(0, bytes, size);
+            uint32_t actual = table->crc32(0, bytes, size);
+            check(t, "crc32", count, &expected, &actual, sizeof(actual));
+
+            expected = reference.adler32(1, bytes, size);
+            actual = table->adler32(1, bytes, size);
+            check(t, "adler32", count, &expected, &actual, sizeof(actual));
+
+            for (int type = 0; type <= 4; type++) {
+                for (size_t bpp = 1; bpp <= 8; bpp++) {
+                    reference.png_filter(type, bytes, prev, expected8.data(), size, bpp);
+                    table->png_filter(type, bytes, prev, actual8.data(), size, bpp);
+                    check(t, "png_filter", count, expected8.data(), actual8.data(), size);
+                }
+            }
+
+            expected = reference.filter_cost(bytes, size);
+            actual = table->filter_cost(bytes, size);
+            check(t, "filter_cost", count, &expected, &actual, sizeof(actual));
+
+            // Checksums of two halves must combine to the checksum of the whole
+            size_t half = size / 2;
+
+            expected = table->crc32(0, bytes, size);
+            actual = checksum::crc32_combine(table->crc32(0, bytes, half),
+                                             table->crc32(0, bytes + half, size - half), size - half);
+            check(t, "crc32_combine", count, &expected, &actual, sizeof(actual));
+
+            expected = table->adler32(1, bytes, size);
+            actual = checksum::adler32_combine(table->adler32(1, bytes, half),
+                                               table->adler32(1, bytes + half, size - half), size - half);
+            check(t, "adler32_combine", count, &expected, &actual, sizeof(actual));
+        }
+    }
+
+    for (size_t t = 0; t < tables.size(); t++)
+        out << tables[t]->name << ": " << (passed[t] ? "ok" : "FAILED") << std::endl;
+
+    return std::find(passed.begin(), passed.end(), false) == passed.end();
+}
+
+ErrorDiffuser::ErrorDiffuser(uint32_t width, uint32_t spp)
+    : width(width), spp(spp),
+      current(((size_t) width + 2) * spp, 0), next(((size_t) width + 2) * spp, 0)
+{
+}
+
+void ErrorDiffuser::process(const uint16_t *in, uint8_t *out)
+{
+    // Serpentine scan: even rows go left to right, odd rows right to left
+    const bool forward = (row & 1) == 0;
+    const ptrdiff_t step = forward ? (ptrdiff_t) spp : -(ptrdiff_t) spp;
+
+    for (uint32_t n = 0; n < width; n++) {
+        uint32_t x = forward ? n : width - 1 - n;
+        size_t sample = (size_t) x * spp;
+        size_t slot = sample + spp; //Skip the left guard pixel
+
+        for (uint32_t c = 0; c < spp; c++) {
+            int32_t value = (int32_t) in[sample + c] + ((current[slot + c] + 8) >> 4);
+            value = std::clamp(value, 0, 65535);
+
+            uint32_t q = scale16to8((uint32_t) value, 32767);
+            int32_t error = value - (int32_t) (q * 257);
+
+            out[sample + c] = (uint8_t) q;
+
+            current[slot + c + step] += error * 7;
+            next[slot + c - step] += error * 3;
+            next[slot + c] += error * 5;
+            next[slot + c + step] += error;
+        }
+    }
+
+    current.swap(next);
+    std::fill(next.begin(), next.end(), 0);
+    row++;
+}
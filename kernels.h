@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+// How 16-bit samples are reduced to 8-bit
+enum class Dither
+{
+    Truncate, // Keep the high byte
+    Round,    // Round to the nearest 8-bit value
+    Ordered,  // 4x4 Bayer threshold matrix
+    Diffuse   // Serpentine Floyd-Steinberg error diffusion
+};
+
+// The SIMD kernels. One table is built for each instruction set, and
+// the one used is picked at startup from what the CPU supports.
+struct KernelTable
+{
+    //Name of the instruction set, as accepted by select_kernels()
+    const char *name;
+
+    // Reduce 16-bit samples to 8-bit by dropping the low byte
+    void (*depth16to8_truncate)(const uint16_t *in, uint8_t *out, size_t count);
+
+    // Reduce 16-bit samples to 8-bit with rounding to the nearest value
+    void (*depth16to8_round)(const uint16_t *in, uint8_t *out, size_t count);
+
+    // Reduce one row of 16-bit samples to 8-bit using ordered dithering.
+    // The row index selects the line of the threshold matrix. Entries 1
+    // to 4 are compiled for that many samples per pixel; entry 0 takes it
+    // from spp instead.
+    void (*depth16to8_ordered[5])(const uint16_t *in, uint8_t *out,
+                                  uint32_t width, uint32_t spp, uint32_t row);
+
+    // Swap the bytes of 16-bit samples
+    void (*swap16)(const uint16_t *in, uint16_t *out, size_t count);
+
+    // Undo the TIFF horizontal predictor on a row of 8-bit samples, in
+    // place. Entries 1 to 4 are compiled for that many samples per pixel;
+    // entry 0 takes it from spp instead.
+    void (*undo_predictor8[5])(uint8_t *row, uint32_t width, uint32_t spp);
+
+    // The same for 16-bit samples, swapping their bytes first if swap is
+    // set, so a byte swapped row is only read and written once
+    void (*undo_predictor16[5])(uint16_t *row, uint32_t width, uint32_t spp, bool swap);
+
+    // CRC-32 and Adler-32 updates, see checksum.h
+    uint32_t (*crc32)(uint32_t crc, const uint8_t *data, size_t size);
+    uint32_t (*adler32)(uint32_t adler, const uint8_t *data, size_t size);
+
+    // Apply PNG filter type 0 (None) to 4 (Paeth) to a row of size bytes.
+    // prev is the previous unfiltered row, all zeros for the first row,
+    // and bpp the number of bytes per complete pixel, rounded up to 1.
+    void (*png_filter)(int type, const uint8_t *row, const uint8_t *prev,
+                       uint8_t *out, size_t size, size_t bpp);
+
+    // Sum of the filtered bytes taken as signed values. The filter with the
+    // lowest cost usually compresses best.
+    uint32_t (*filter_cost)(const uint8_t *data, size_t size);
+};
+
+// The kernels used for conversion. Unless select_kernels() was called,
+// this is the best variant the CPU supports.
+const KernelTable &kernels();
+
+// Variants the CPU can run, from the baseline up
+std::vector<const KernelTable *> supported_kernels();
+
+// Use the named variant, or the best one for "auto". Returns false if the
+// name is unknown or the CPU does not support it.
+bool select_kernels(const char *name);
+
+// Run every supported variant on the same inputs and check that they give
+// bit-identical results. Mismatches are reported on out.
+bool kernel_self_test(std::ostream &out);
+
+// Floyd-Steinberg error diffusion that works one row at a time.
+// Only the errors pushed into the next row are kept between calls,
+// so it fits a row-streaming conversion loop.
+class ErrorDiffuser
+{
+public:
+    ErrorDiffuser(uint32_t width, uint32_t spp);
+
+    // Rows must be supplied in order, starting with row 0
+    void process(const uint16_t *in, uint8_t *out);
+
+private:
+    uint32_t width;
+    uint32_t spp;
+    uint32_t row = 0;
+    //Errors in 1/16th units, with one guard pixel on each side
+    std::vector<int32_t> current;
+    std::vector<int32_t> next;
+};
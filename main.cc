@@ -4,6 +4,89 @@
 #include <png.h>    // For libpng
 #include <stdexcept>
 #include <cstdlib>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include "accounting.h"
+#include "background.h"
+#include "buffer.h"
+#include "calibration.h"
+#include "cgroup.h"
+#include "codecs.h"
+#include "icc.h"
+#include "jpeg_reader.h"
+#include "kernels.h"
+#include "metrics.h"
+#include "perf_counters.h"
+#include "pipeline.h"
+#include "png_encoder.h"
+#include "result_log.h"
+#include "workers.h"
+
+//What to do with an embedded ICC profile
+enum class IccMode
+{
+    Convert, //Convert the pixels to sRGB. Profiles that can't be converted are embedded.
+    Embed,   //Copy the profile into an iCCP chunk
+    Ignore   //Drop the profile
+};
+
+//Which PNG writer to use
+enum class Encoder
+{
+    Libpng, //libpng's png_write_row
+    Custom  //PngEncoder, with the SIMD filter and checksum kernels
+};
+
+//Conversion settings taken from the command line
+struct Options
+{
+    //Bit depth of the PNG. 0 keeps the depth of the TIFF.
+    uint32_t depth = 0;
+    //How 16-bit samples are reduced when depth is 8
+    Dither dither = Dither::Round;
+    IccMode icc = IccMode::Convert;
+    Encoder encoder = Encoder::Libpng;
+    //Size of the IDAT chunks and of the zlib buffer, 0 for the defaults
+    size_t idat_size = 0;
+    size_t zbuf_size = 0;
+    Codecs codecs = Codecs::Fast;
+    //Scale JPEG-compressed images down by 2, 4 or 8 while decoding
+    uint32_t scale = 1;
+    //Write rows stored with the horizontal predictor as PNG Sub filtered rows
+    bool reuse_predictor = false;
+    //Files converted at once, 0 for one per CPU the process can use
+    unsigned jobs = 0;
+    //Largest strip read as one band. Bigger strips are read row by row.
+    tmsize_t max_band_size = 16 << 20;
+    HugePages huge_pages = HugePages::Off;
+    //Run at idle priority and shed workers while the host is busy
+    bool background = false;
+    //File the metrics are written to, and how often, in seconds
+    std::string metrics;
+    unsigned metrics_interval = 15;
+    //File a JSON record of each input is appended to
+    std::string log_json;
+    //Memory the conversion may use, 0 for the cgroup's limit if there is one
+    uint64_t memory_limit = 0;
+    //Count hardware events per stage
+    bool perf_counters = false;
+    //Profile to load, or to write with --calibrate. Empty for the default
+    //path, "none" for no profile.
+    std::string profile;
+    //Time a synthetic workload and write the fastest settings to the profile
+    bool calibrate = false;
+    //Check the SIMD kernel variants against each other instead of converting
+    bool self_test = false;
+};
 
 //A type to manage resources and ensure proper cleanup
 struct Resources
@@ -24,11 +107,58 @@ struct Resources
     }
 };
 
+//A conversion error that says what kind of failure it was, for the metrics
+struct ConversionError : std::runtime_error
+{
+    Failure reason;
+
+    ConversionError(Failure reason, const std::string &message)
+        : std::runtime_error(message), reason(reason)
+    {
+    }
+};
+
+//Smallest band worth reading a strip into, when memory is tight
+static const tmsize_t MIN_BAND_SIZE = 256 << 10;
+
+//zlib's deflate state at the settings both encoders use: a 32K window and
+//memLevel 8
+static const uint64_t ZLIB_STATE_SIZE = 256 << 10;
+
+// Whether every strip of the image is stored whole inside the mapping, so
+// uncompressed rows can be used from it in place
+static bool strips_in_mapping(TIFF *tif, const MappedFile &mapping, uint32_t height,
+                              uint32_t rows_per_strip, tmsize_t line_size, uint32_t bps)
+{
+    uint32_t strips = TIFFNumberOfStrips(tif);
+
+    for (uint32_t strip = 0; strip < strips; strip++) {
+        uint64_t first = (uint64_t) strip * rows_per_strip;
+
+        if (first >= height)
+            break;
+
+        uint64_t offset = TIFFGetStrileOffset(tif, strip);
+        uint64_t size = std::min<uint64_t>(rows_per_strip, height - first) * line_size;
+
+        if (TIFFGetStrileByteCount(tif, strip) < size || offset > mapping.size() ||
+            size > mapping.size() - offset)
+            return false;
+
+        //16-bit samples are loaded directly, so keep them aligned
+        if (bps == 16 && offset % 2 != 0)
+            return false;
+    }
+
+    return true;
+}
+
 // Function to convert a TIFF image to PNG format
-static void save_tiff_as_png(TIFF *tif, const char *png_filename)
+static void save_tiff_as_png(TIFF *tif, const char *png_filename, const Options &opts,
+                             FileResult &result)
 {
     if (!tif || !png_filename)
-        throw std::invalid_argument("Invalid arguments to save_tiff_as_png");
+        throw ConversionError(Failure::Unsupported, "Invalid arguments to save_tiff_as_png");
 
     uint32_t width = 0, height = 0, bps = 0, spp = 0, photometric = 0;
 
@@ -37,7 +167,37 @@ static void save_tiff_as_png(TIFF *tif, const char *png_filename)
         !TIFFGetField(tif, TIFFTAG_BITSPERSAMPLE, &bps) ||
         !TIFFGetField(tif, TIFFTAG_SAMPLESPERPIXEL, &spp) ||
         !TIFFGetField(tif, TIFFTAG_PHOTOMETRIC, &photometric))
-        throw std::invalid_argument("Failed to get image properties from TIFF file");
+        throw ConversionError(Failure::Unsupported, "Failed to get image properties from TIFF file");
+
+    uint16_t compression = COMPRESSION_NONE;
+    TIFFGetFieldDefaulted(tif, TIFFTAG_COMPRESSION, &compression);
+
+    result.width = width;
+    result.height = height;
+    result.bps = bps;
+    result.spp = spp;
+    result.compression = compression;
+
+    // JPEG-compressed images are decoded by libjpeg directly, which also
+    // converts YCbCr to RGB and scales in the DCT domain
+    std::unique_ptr<JpegReader> jpeg;
+
+    if (opts.codecs != Codecs::Libtiff)
+        jpeg = JpegReader::create(tif, result.diagnostics, opts.scale);
+
+    if (compression == COMPRESSION_JPEG && photometric == PHOTOMETRIC_YCBCR) {
+        //Otherwise libtiff is asked to convert to RGB
+        TIFFSetField(tif, TIFFTAG_JPEGCOLORMODE, JPEGCOLORMODE_RGB);
+        photometric = PHOTOMETRIC_RGB;
+    }
+
+    if (jpeg) {
+        width = jpeg->width();
+        height = jpeg->height();
+
+        if (photometric == PHOTOMETRIC_YCBCR)
+            photometric = PHOTOMETRIC_RGB;
+    }
 
     // Determine PNG Color Type
     int png_color_type;
@@ -47,74 +207,357 @@ static void save_tiff_as_png(TIFF *tif, const char *png_filename)
     } else if (photometric == PHOTOMETRIC_RGB) {
         png_color_type = (spp == 4) ? PNG_COLOR_TYPE_RGBA : PNG_COLOR_TYPE_RGB;
     } else {
-        throw std::invalid_argument("Unsupported photometric interpretation\n");
+        throw ConversionError(Failure::Unsupported, "Unsupported photometric interpretation\n");
+    }
+
+    // Reduce 16-bit samples if a lower output depth was asked for
+    bool reduce_depth = (bps == 16 && opts.depth == 8);
+    uint32_t png_bps = reduce_depth ? 8 : bps;
+
+    // Embedded ICC profile, if any
+    uint32_t icc_size = 0;
+    void *icc_profile = nullptr;
+    std::shared_ptr<const ColorLut> lut;
+    bool embed_icc = false;
+
+    if (opts.icc != IccMode::Ignore &&
+        TIFFGetField(tif, TIFFTAG_ICCPROFILE, &icc_size, &icc_profile) && icc_size > 0) {
+        if (opts.icc == IccMode::Convert && photometric == PHOTOMETRIC_RGB &&
+            spp >= 3 && (bps == 8 || bps == 16))
+            lut = get_srgb_lut((const uint8_t *) icc_profile, icc_size);
+
+        embed_icc = !lut;
     }
 
     // Resources to manage
     Resources res{};
 
-    // Initialize libpng structures
+    // Whole strips are read into a band and handed to the encoder in one
+    // call. Tiled and planar images and very large strips go row by row,
+    // except for JPEG, which is decoded a strip or row of tiles at a time.
+    tmsize_t line_size = jpeg ? (tmsize_t) width * spp : TIFFScanlineSize(tif);
+    tmsize_t strip_size = jpeg ? line_size * jpeg->band_rows() : TIFFStripSize(tif);
+    size_t png_row_size = ((size_t) width * spp * png_bps + 7) / 8;
+    uint32_t rows_per_strip = 0;
+    uint16_t planar = PLANARCONFIG_CONTIG;
+
+    TIFFGetFieldDefaulted(tif, TIFFTAG_ROWSPERSTRIP, &rows_per_strip);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_PLANARCONFIG, &planar);
+
+    bool banded = jpeg || (!TIFFIsTiled(tif) && planar == PLANARCONFIG_CONTIG &&
+                           strip_size > 0 && strip_size <= opts.max_band_size);
+    uint32_t band_rows = jpeg ? jpeg->band_rows() : banded ? std::min(rows_per_strip, height) : 1;
+
+    // Uncompressed strips are used straight from a mapping of the file.
+    // 8-bit rows, and 16-bit rows already in big-endian order, then reach
+    // the encoder without being copied.
+    uint16_t fill_order = FILLORDER_MSB2LSB;
+    std::unique_ptr<MappedFile> mapping;
+    bool in_place = false;
+
+    TIFFGetFieldDefaulted(tif, TIFFTAG_FILLORDER, &fill_order);
+
+    if (banded && !jpeg)
+        mapping = MappedFile::map(TIFFFileno(tif));
+
+    if (mapping && compression == COMPRESSION_NONE && fill_order == FILLORDER_MSB2LSB &&
+        (bps <= 8 || bps == 16))
+        in_place = strips_in_mapping(tif, *mapping, height, rows_per_strip, line_size, bps);
+
+    // Compressed strips are decoded by our own codecs where they can be
+    std::unique_ptr<StripDecoder> decoder;
+    AlignedBuffer reference;
+
+    if (banded && !in_place && !jpeg && opts.codecs != Codecs::Libtiff)
+        decoder = StripDecoder::create(tif, mapping.get());
+
+    //libtiff can only check JPEG strips decoded at full size
+    bool verify_jpeg = jpeg && opts.scale == 1 && !TIFFIsTiled(tif) && compression == COMPRESSION_JPEG;
+
+    bool verify = (decoder || verify_jpeg) && opts.codecs == Codecs::Verify;
+
+    // What the conversion should need at most, so that it only starts once
+    // the memory budget has room. libtiff's strip or tile buffer can't be
+    // seen, so it is charged at its decoded size while libtiff reads.
+    tmsize_t libtiff_buffer = 0;
+
+    if (verify || (!in_place && !jpeg && !decoder))
+        libtiff_buffer = TIFFIsTiled(tif) ? TIFFTileSize(tif) : TIFFStripSize(tif);
+
+    size_t encoder_buffers = opts.encoder == Encoder::Custom
+        ? (opts.idat_size ? opts.idat_size : PngEncoder::DEFAULT_IDAT_SIZE) +
+          (opts.zbuf_size ? opts.zbuf_size : PngEncoder::DEFAULT_ZBUF_SIZE)
+        : std::max<size_t>(std::max(opts.idat_size, opts.zbuf_size), PNG_ZBUF_SIZE);
+
+    uint64_t estimate = (uint64_t) (banded && !in_place ? strip_size : line_size) +
+                        (uint64_t) png_row_size * (band_rows + 3) +
+                        (verify ? (uint64_t) strip_size : 0) + libtiff_buffer +
+                        encoder_buffers + ZLIB_STATE_SIZE;
+
+    MemoryCharge libtiff_charge((size_t) libtiff_buffer);
+    result.memory_estimate = estimate;
+
+    if (MemoryAccount *account = current_account())
+        account->reserve(estimate);
+
+    if (verify)
+        reference.resize(strip_size);
+
+    // The horizontal predictor on 8-bit samples stores each byte as the
+    // difference from the byte one pixel to the left, which is exactly PNG's
+    // Sub filter. Rows the pipeline would pass through unchanged can then go
+    // to the encoder as decoded, skipping both the predictor and the filter
+    // search. Strips libtiff has to decode still go the usual way.
+    bool reuse_predictor = opts.reuse_predictor && opts.encoder == Encoder::Custom &&
+                           opts.codecs == Codecs::Fast && decoder && decoder->predicted() &&
+                           bps == 8 && !lut && (size_t) line_size == png_row_size;
+
+    // The pipeline does the color conversion, depth reduction and byte
+    // swapping (PNG is big-endian), so the encoder gets rows it can use as-is
+    PipelineConfig config;
+    config.width = width;
+    config.bps = bps;
+    config.spp = spp;
+    config.photometric = photometric;
+    config.lut = lut.get();
+    config.reduce_depth = reduce_depth;
+    config.dither = opts.dither;
+    config.swapped = in_place && bps == 16 && TIFFIsByteSwapped(tif);
+
+    std::unique_ptr<RowPipeline> pipeline = make_row_pipeline(config);
+
+    AlignedBuffer band;
+    AlignedBuffer out_band(png_row_size * band_rows);
+    std::vector<const uint8_t *> rows(band_rows);
+
+    if (!banded) {
+        // Dynamic Buffer: Allocate exactly what a single scanline needs
+        res.row = _TIFFmalloc(line_size);
+
+        if (!res.row)
+            throw std::runtime_error("Failed to allocate row buffer");
+    } else if (!in_place) {
+        band.resize(strip_size);
+    }
+
     res.fp = fopen(png_filename, "wb");
     if (!res.fp)
-        throw std::runtime_error("Failed to open output PNG file");
+        throw ConversionError(Failure::Output, "Failed to open output PNG file");
+
+    std::unique_ptr<PngEncoder> encoder;
 
-    res.png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if (!res.png_ptr)
-        throw std::runtime_error("png_create_write_struct failed");
+    if (opts.encoder == Encoder::Custom) {
+        PngHeader header;
+        header.width = width;
+        header.height = height;
+        header.bit_depth = png_bps;
+        header.color_type = png_color_type;
 
-    res.info_ptr = png_create_info_struct(res.png_ptr);
-    if (!res.info_ptr)
-        throw std::runtime_error("png_create_info_struct failed");
+        encoder = std::make_unique<PngEncoder>(res.fp, header,
+            opts.idat_size ? opts.idat_size : PngEncoder::DEFAULT_IDAT_SIZE,
+            opts.zbuf_size ? opts.zbuf_size : PngEncoder::DEFAULT_ZBUF_SIZE);
+
+        if (lut)
+            encoder->write_srgb(PNG_sRGB_INTENT_PERCEPTUAL);
+        else if (embed_icc)
+            encoder->write_iccp("ICC profile", (const uint8_t *) icc_profile, icc_size);
+    } else {
+        // Initialize libpng structures
+        res.png_ptr = create_png_writer(result.diagnostics, current_account());
+        if (!res.png_ptr)
+            throw ConversionError(Failure::Libpng, "png_create_write_struct failed");
+
+        res.info_ptr = png_create_info_struct(res.png_ptr);
+        if (!res.info_ptr)
+            throw ConversionError(Failure::Libpng, "png_create_info_struct failed");
+
+        if (setjmp(png_jmpbuf(res.png_ptr))) {
+            const std::vector<std::string> &errors = result.diagnostics.errors;
+
+            throw ConversionError(Failure::Libpng, errors.empty() ? "libpng internal processing error" : errors.back());
+        }
 
-    if (setjmp(png_jmpbuf(res.png_ptr)))
-        throw std::runtime_error("libpng internal processing error");
+        png_init_io(res.png_ptr, res.fp);
 
-    png_init_io(res.png_ptr, res.fp);
+        // libpng writes an IDAT chunk each time its zlib output buffer
+        // fills up, so there the chunk size and buffer size are one setting
+        size_t buffer_size = std::max(opts.idat_size, opts.zbuf_size);
 
-    // We will write RGBA 8-bit
-    png_set_IHDR(res.png_ptr, res.info_ptr, width, height,
-                 bps, png_color_type, PNG_INTERLACE_NONE,
-                 PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+        if (buffer_size)
+            png_set_compression_buffer_size(res.png_ptr, buffer_size);
 
-    png_write_info(res.png_ptr, res.info_ptr);
+        png_set_IHDR(res.png_ptr, res.info_ptr, width, height,
+                     png_bps, png_color_type, PNG_INTERLACE_NONE,
+                     PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
 
-    // If it's a 16-bit TIFF, ensure we handle endianness (PNG is big-endian)
-    if (bps == 16) {
-        #if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-            //This will cause png_write_row to swap bytes from little-endian to big-endian
-            png_set_swap(res.png_ptr);
-        #endif
+        if (lut) {
+            png_set_sRGB(res.png_ptr, res.info_ptr, PNG_sRGB_INTENT_PERCEPTUAL);
+        } else if (embed_icc) {
+            //A profile that libpng rejects is dropped with a warning instead of failing the file
+            png_set_benign_errors(res.png_ptr, 1);
+            png_set_iCCP(res.png_ptr, res.info_ptr, "ICC profile", PNG_COMPRESSION_TYPE_BASE,
+                         (png_const_bytep) icc_profile, icc_size);
+        }
+
+        png_write_info(res.png_ptr, res.info_ptr);
     }
 
-    // Dynamic Buffer: Allocate exactly what a single scanline needs
-    tmsize_t line_size = TIFFScanlineSize(tif);
-    res.row = _TIFFmalloc(line_size);
+    auto write_rows = [&](uint32_t count) {
+        if (encoder)
+            encoder->write_rows(rows.data(), count);
+        else
+            png_write_rows(res.png_ptr, (png_bytepp) rows.data(), count);
+    };
+
+    StageTimes &times = result.times;
+    times.start();
+
+    if (jpeg) {
+        for (uint32_t first = 0, strip = 0; first < height; strip++) {
+            uint32_t count = 0;
+
+            try {
+                count = jpeg->read_band(band.data());
+            }
+            catch (const std::runtime_error &e) {
+                throw ConversionError(Failure::Decode, e.what());
+            }
+
+            if (reference.data()) {
+                if (TIFFReadEncodedStrip(tif, strip, reference.data(), (tmsize_t) count * line_size) < 0)
+                    throw ConversionError(Failure::Decode, "Failed to read TIFF strip");
+
+                if (memcmp(reference.data(), band.data(), (size_t) count * line_size) != 0)
+                    throw ConversionError(Failure::Decode, "Strip " + std::to_string(strip) + " decodes differently from libtiff");
+            }
+
+            times.lap(Stage::Decode);
+
+            for (uint32_t i = 0; i < count; i++)
+                rows[i] = pipeline->process(band.data() + i * line_size,
+                                            out_band.data() + i * png_row_size, first + i);
+
+            times.lap(Stage::Process);
+            write_rows(count);
+            times.lap(Stage::Encode);
+            first += count;
+        }
+    } else if (banded) {
+        for (uint32_t first = 0; first < height; first += band_rows) {
+            uint32_t count = std::min(band_rows, height - first);
+            uint32_t strip = TIFFComputeStrip(tif, first, 0);
+            const uint8_t *data = band.data();
+
+            tmsize_t size = (tmsize_t) count * line_size;
 
-    if (!res.row)
-        throw std::runtime_error("Failed to allocate row buffer");
+            bool filtered = false;
 
-    // Read and Write row by row
-    for (uint32_t row = 0; row < height; row++) {
-        //This will give us the pixel values in machine's endinaness
-        TIFFReadScanline(tif, res.row, row, 0);
-        //We supply the pixel values in machine's endinaness.
-        //png_write_row will convert the values to big endian if necessary
-        png_write_row(res.png_ptr, (png_bytep) res.row);
+            if (in_place)
+                data = mapping->data() + TIFFGetStrileOffset(tif, strip);
+            else if (decoder && decoder->decode(strip, band.data(), count, reuse_predictor))
+                filtered = reuse_predictor;
+            else if (TIFFReadEncodedStrip(tif, strip, band.data(), size) < 0)
+                throw ConversionError(Failure::Decode, "Failed to read TIFF strip");
+
+            if (reference.data()) {
+                if (TIFFReadEncodedStrip(tif, strip, reference.data(), size) < 0)
+                    throw ConversionError(Failure::Decode, "Failed to read TIFF strip");
+
+                if (memcmp(reference.data(), band.data(), size) != 0)
+                    throw ConversionError(Failure::Decode, "Strip " + std::to_string(strip) + " decodes differently from libtiff");
+            }
+
+            times.lap(Stage::Decode);
+
+            if (filtered) {
+                for (uint32_t i = 0; i < count; i++)
+                    rows[i] = data + i * line_size;
+
+                encoder->write_filtered_rows(PNG_FILTER_VALUE_SUB, rows.data(), count);
+                times.lap(Stage::Encode);
+
+                continue;
+            }
+
+            for (uint32_t i = 0; i < count; i++)
+                rows[i] = pipeline->process(data + i * line_size,
+                                            out_band.data() + i * png_row_size, first + i);
+
+            times.lap(Stage::Process);
+            write_rows(count);
+            times.lap(Stage::Encode);
+        }
+    } else {
+        // Read and Write row by row
+        for (uint32_t row = 0; row < height; row++) {
+            //This will give us the pixel values in machine's endinaness
+            if (TIFFReadScanline(tif, res.row, row, 0) < 0)
+                throw ConversionError(Failure::Decode, "Failed to read TIFF row " + std::to_string(row));
+            times.lap(Stage::Decode);
+
+            rows[0] = pipeline->process((const uint8_t *) res.row, out_band.data(), row);
+            times.lap(Stage::Process);
+            write_rows(1);
+            times.lap(Stage::Encode);
+        }
     }
 
-    png_write_end(res.png_ptr, res.info_ptr);
+    if (encoder)
+        encoder->finish();
+    else
+        png_write_end(res.png_ptr, res.info_ptr);
+
+    times.lap(Stage::Encode);
 }
 
-bool convert_file(const char *tiff_file)
+//Size of a file, or 0 if it can't be found
+static uint64_t file_size(const char *file)
 {
-    TIFF *tif = TIFFOpen(tiff_file, "r");
+    struct stat info;
 
-    if (!tif)
-    {
-        std::cout << "Error: Could not open TIFF file" << std::endl;
+    return stat(file, &info) == 0 ? (uint64_t) info.st_size : 0;
+}
 
-        return false;
-    }
+//Keeps the messages of files converted at once from interleaving
+static std::mutex output_mutex;
+
+// Counts a file in the metrics and writes its record to the log
+static void report(FileResult &result, uint64_t start, ResultLog *log)
+{
+    if (!metrics_enabled() && !log)
+        return;
+
+    result.nanoseconds = metrics_clock() - start;
+    result.bytes_read = file_size(result.file.c_str());
+
+    if (result.converted)
+        result.bytes_written = file_size(result.output.c_str());
+
+    count_stages(result.times);
+    count_memory(result.memory_peak);
+
+    if (result.converted)
+        count_converted(result.bytes_read, result.bytes_written, result.nanoseconds);
+    else
+        count_failure(result.failure, result.nanoseconds);
+
+    if (log)
+        log->write(result);
+}
+
+bool convert_file(const char *tiff_file, const Options &opts, ResultLog *log, MemoryBudget *budget)
+{
+    bool timed = metrics_enabled() || log;
+    uint64_t start = timed ? metrics_clock() : 0;
+    count_started();
+
+    FileResult result;
+    result.file = tiff_file;
+    result.times = StageTimes(timed, opts.perf_counters ? PerfCounters::for_thread() : nullptr);
+
+    //Everything the conversion allocates on this thread is charged to it
+    MemoryAccount memory(budget);
+    AccountScope scope(memory);
 
     // Replace the extension of the TIFF file name with .png for output
     std::string output_file = std::string(tiff_file);
@@ -125,39 +568,792 @@ bool convert_file(const char *tiff_file)
     else
         output_file += ".png";
 
-    bool result = false;
+    result.output = output_file;
+
+    TIFF *tif = open_tiff(tiff_file, result.diagnostics);
+
+    if (!tif)
+    {
+        result.failure = Failure::Open;
+        result.message = "Could not open TIFF file";
+    }
+    else
+    {
+        try {
+            save_tiff_as_png(tif, output_file.c_str(), opts, result);
+
+            result.converted = true;
+        }
+        catch (const std::exception &e)
+        {
+            if (const ConversionError *error = dynamic_cast<const ConversionError *>(&e))
+                result.failure = error->reason;
+            else if (dynamic_cast<const std::invalid_argument *>(&e))
+                result.failure = Failure::Unsupported;
+
+            result.message = e.what();
+        }
+
+        TIFFClose(tif);
+    }
+
+    result.memory_peak = memory.peak();
+
+    // A file's library messages and its outcome are printed in one go, and
+    // without flushing, so workers hold the lock only briefly
+    if (!result.diagnostics.empty() || !result.converted)
+    {
+        std::lock_guard<std::mutex> lock(output_mutex);
+
+        if (!result.diagnostics.empty())
+            std::cerr << tiff_file << ":\n" << result.diagnostics.text();
+
+        if (!tif)
+            std::cout << "Error: Could not open TIFF file\n";
+        else if (!result.converted)
+            std::cout << "Failed to convert TIFF to PNG: " << result.message << "\n";
+    }
+
+    report(result, start, log);
+
+    return result.converted;
+}
+
+static void print_usage(const char *program)
+{
+    std::cout << "Usage: " << program << " [OPTIONS] TIFF_FILE1 TIFF_FILE2 ..." << std::endl
+              << std::endl
+              << "Options:" << std::endl
+              << "  --depth 8        Write 8-bit PNGs from 16-bit TIFFs" << std::endl
+              << "  --dither MODE    How to reduce 16-bit samples: truncate, round (default)," << std::endl
+              << "                   ordered or diffuse" << std::endl
+              << "  --icc MODE       Embedded ICC profiles: convert to sRGB (default), embed" << std::endl
+              << "                   as an iCCP chunk, or ignore" << std::endl
+              << "  --encoder NAME   PNG writer: libpng (default) or custom" << std::endl
+              << "  --idat-size N    Size of the IDAT chunks, in bytes or with a K or M suffix" << std::endl
+              << "  --zbuf-size N    Size of the zlib buffer. With libpng, the larger of the two" << std::endl
+              << "                   sizes is used for both." << std::endl
+              << "  --codecs NAME    Strip decoders: fast (default) for our own LZW, PackBits and" << std::endl
+              << "                   Deflate and libjpeg for JPEG, libtiff, or verify to check" << std::endl
+              << "                   one against the other" << std::endl
+              << "  --scale N        Scale JPEG-compressed TIFFs down by 2, 4 or 8 while decoding" << std::endl
+              << "  --band-size N    Largest strip read in one piece (default 16M). Larger" << std::endl
+              << "                   strips are read row by row." << std::endl
+              << "  --reuse-predictor" << std::endl
+              << "                   With --encoder custom, write 8-bit rows stored with the" << std::endl
+              << "                   TIFF horizontal predictor as PNG Sub filtered rows" << std::endl
+              << "  --jobs N         Convert N files at once. The default, 0, runs one per CPU" << std::endl
+              << "                   the process may use, within its cgroup CPU quota. Workers" << std::endl
+              << "                   are spread over the NUMA nodes and kept on their node." << std::endl
+              << "  --hugepages MODE Back strip and encoder buffers of 2M or more with huge" << std::endl
+              << "                   pages: off (default), transparent or explicit (hugetlbfs)" << std::endl
+              << "  --background     Run at idle CPU and I/O priority, and convert fewer files" << std::endl
+              << "                   at once while the host's load or pressure is high" << std::endl
+              << "  --memory-limit N Memory the conversion may use, with a K, M or G suffix." << std::endl
+              << "                   Defaults to the cgroup's memory limit, if any." << std::endl
+              << "  --log-json FILE  Append a JSON record of each file to FILE, with its status," << std::endl
+              << "                   image properties, sizes and stage timings" << std::endl
+              << "  --metrics FILE   Write conversion metrics to FILE: JSON if it ends in .json," << std::endl
+              << "                   otherwise the Prometheus text format" << std::endl
+              << "  --metrics-interval N" << std::endl
+              << "                   Seconds between metrics updates (default 15)" << std::endl
+              << "  --perf-counters  Count cycles, instructions, cache misses and branch misses" << std::endl
+              << "                   of each stage with perf_event_open, and print a summary" << std::endl
+              << "  --cpu NAME       SIMD kernels to use: auto (default), sse2, avx2 or avx512" << std::endl
+              << "  --calibrate      Time a short synthetic workload with different settings," << std::endl
+              << "                   write the fastest to the profile, then exit" << std::endl
+              << "  --profile FILE   Settings to load, as written by --calibrate (default" << std::endl
+              << "                   ~/.config/tiff-png/profile), or none. Options on the" << std::endl
+              << "                   command line override them." << std::endl
+              << "  --self-test      Check that all SIMD kernels the CPU supports give identical" << std::endl
+              << "                   results, then exit" << std::endl;
+}
+
+// Parse a buffer size such as 65536, 64K or 4M
+static bool parse_size(const char *value, size_t &size)
+{
+    char *end = nullptr;
+    unsigned long long n = strtoull(value, &end, 10);
+
+    if (end == value)
+        return false;
+
+    if (*end == 'K' || *end == 'k') {
+        n <<= 10;
+        end++;
+    } else if (*end == 'M' || *end == 'm') {
+        n <<= 20;
+        end++;
+    }
+
+    //Between the smallest buffer worth having and the largest chunk we allow
+    if (*end != '\0' || n < 64 || n > (64u << 20))
+        return false;
+
+    size = (size_t) n;
+
+    return true;
+}
+
+// Parse the options in argv. The remaining arguments are collected in files.
+static bool parse_options(int argc, char *argv[], Options &opts, std::vector<const char *> &files)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        const char *arg = argv[i];
+
+        if (strncmp(arg, "--", 2) != 0)
+        {
+            files.push_back(arg);
+
+            continue;
+        }
+
+        // Options without a value
+        if (strcmp(arg, "--self-test") == 0)
+        {
+            opts.self_test = true;
+
+            continue;
+        }
+
+        if (strcmp(arg, "--reuse-predictor") == 0)
+        {
+            opts.reuse_predictor = true;
+
+            continue;
+        }
+
+        if (strcmp(arg, "--background") == 0)
+        {
+            opts.background = true;
+
+            continue;
+        }
+
+        if (strcmp(arg, "--perf-counters") == 0)
+        {
+            opts.perf_counters = true;
+
+            continue;
+        }
+
+        if (strcmp(arg, "--calibrate") == 0)
+        {
+            opts.calibrate = true;
+
+            continue;
+        }
+
+        if (i + 1 >= argc)
+        {
+            std::cout << "Missing value for option: " << arg << std::endl;
+
+            return false;
+        }
+
+        const char *value = argv[++i];
+
+        if (strcmp(arg, "--depth") == 0)
+        {
+            if (strcmp(value, "8") != 0)
+            {
+                std::cout << "Unsupported depth: " << value << std::endl;
+
+                return false;
+            }
+
+            opts.depth = 8;
+        }
+        else if (strcmp(arg, "--dither") == 0)
+        {
+            if (strcmp(value, "truncate") == 0)
+                opts.dither = Dither::Truncate;
+            else if (strcmp(value, "round") == 0)
+                opts.dither = Dither::Round;
+            else if (strcmp(value, "ordered") == 0)
+                opts.dither = Dither::Ordered;
+            else if (strcmp(value, "diffuse") == 0)
+                opts.dither = Dither::Diffuse;
+            else
+            {
+                std::cout << "Unknown dither mode: " << value << std::endl;
+
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--icc") == 0)
+        {
+            if (strcmp(value, "convert") == 0)
+                opts.icc = IccMode::Convert;
+            else if (strcmp(value, "embed") == 0)
+                opts.icc = IccMode::Embed;
+            else if (strcmp(value, "ignore") == 0)
+                opts.icc = IccMode::Ignore;
+            else
+            {
+                std::cout << "Unknown ICC mode: " << value << std::endl;
+
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--encoder") == 0)
+        {
+            if (strcmp(value, "libpng") == 0)
+                opts.encoder = Encoder::Libpng;
+            else if (strcmp(value, "custom") == 0)
+                opts.encoder = Encoder::Custom;
+            else
+            {
+                std::cout << "Unknown encoder: " << value << std::endl;
+
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--scale") == 0)
+        {
+            if (strcmp(value, "1") == 0 || strcmp(value, "2") == 0 ||
+                strcmp(value, "4") == 0 || strcmp(value, "8") == 0)
+                opts.scale = (uint32_t) atoi(value);
+            else
+            {
+                std::cout << "Unsupported scale: " << value << std::endl;
+
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--codecs") == 0)
+        {
+            if (strcmp(value, "fast") == 0)
+                opts.codecs = Codecs::Fast;
+            else if (strcmp(value, "libtiff") == 0)
+                opts.codecs = Codecs::Libtiff;
+            else if (strcmp(value, "verify") == 0)
+                opts.codecs = Codecs::Verify;
+            else
+            {
+                std::cout << "Unknown codecs: " << value << std::endl;
+
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--idat-size") == 0 || strcmp(arg, "--zbuf-size") == 0)
+        {
+            size_t &size = (arg[2] == 'i') ? opts.idat_size : opts.zbuf_size;
+
+            if (!parse_size(value, size))
+            {
+                std::cout << "Invalid size for " << arg << ": " << value
+                          << " (64 bytes to 64M)" << std::endl;
+
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--band-size") == 0)
+        {
+            size_t size = 0;
+
+            if (!parse_size(value, size) || size < (size_t) MIN_BAND_SIZE)
+            {
+                std::cout << "Invalid band size: " << value << " (256K to 64M)" << std::endl;
+
+                return false;
+            }
+
+            opts.max_band_size = (tmsize_t) size;
+        }
+        else if (strcmp(arg, "--hugepages") == 0)
+        {
+            if (strcmp(value, "off") == 0)
+                opts.huge_pages = HugePages::Off;
+            else if (strcmp(value, "transparent") == 0)
+                opts.huge_pages = HugePages::Transparent;
+            else if (strcmp(value, "explicit") == 0)
+                opts.huge_pages = HugePages::Explicit;
+            else
+            {
+                std::cout << "Unknown huge pages mode: " << value << std::endl;
+
+                return false;
+            }
+        }
+        else if (strcmp(arg, "--jobs") == 0)
+        {
+            char *end = nullptr;
+            unsigned long jobs = strtoul(value, &end, 10);
+
+            if (end == value || *end != '\0' || jobs > 1024)
+            {
+                std::cout << "Invalid number of jobs: " << value << std::endl;
+
+                return false;
+            }
+
+            opts.jobs = (unsigned) jobs;
+        }
+        else if (strcmp(arg, "--memory-limit") == 0)
+        {
+            char *end = nullptr;
+            unsigned long long limit = strtoull(value, &end, 10);
+            int shift = 0;
+
+            if (end != value && (*end == 'K' || *end == 'k'))
+                shift = 10;
+            else if (end != value && (*end == 'M' || *end == 'm'))
+                shift = 20;
+            else if (end != value && (*end == 'G' || *end == 'g'))
+                shift = 30;
+
+            if (shift)
+                end++;
+
+            if (end == value || *end != '\0' || limit == 0 || limit > (1ull << 50 >> shift))
+            {
+                std::cout << "Invalid memory limit: " << value << std::endl;
+
+                return false;
+            }
+
+            opts.memory_limit = (uint64_t) limit << shift;
+        }
+        else if (strcmp(arg, "--profile") == 0)
+        {
+            opts.profile = value;
+        }
+        else if (strcmp(arg, "--log-json") == 0)
+        {
+            opts.log_json = value;
+        }
+        else if (strcmp(arg, "--metrics") == 0)
+        {
+            opts.metrics = value;
+        }
+        else if (strcmp(arg, "--metrics-interval") == 0)
+        {
+            char *end = nullptr;
+            unsigned long seconds = strtoul(value, &end, 10);
+
+            if (end == value || *end != '\0' || seconds == 0 || seconds > 86400)
+            {
+                std::cout << "Invalid metrics interval: " << value << std::endl;
+
+                return false;
+            }
+
+            opts.metrics_interval = (unsigned) seconds;
+        }
+        else if (strcmp(arg, "--cpu") == 0)
+        {
+            if (!select_kernels(value))
+            {
+                std::cout << "Unsupported CPU variant: " << value << ". This CPU supports:";
+
+                for (const KernelTable *table : supported_kernels())
+                    std::cout << " " << table->name;
+
+                std::cout << std::endl;
+
+                return false;
+            }
+        }
+        else
+        {
+            std::cout << "Unknown option: " << arg << std::endl;
+
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Sizes the strip buffers, and the number of workers if it is automatic, to
+// a memory limit. Half the limit is left to the libraries, the heap and the
+// page cache of the files. The rest is shared between the workers, each
+// holding up to three strips: decoded, converted and, when verifying,
+// libtiff's copy.
+static void fit_memory(uint64_t memory, bool auto_jobs, Options &opts)
+{
+    uint64_t budget = memory / 2;
+
+    if (auto_jobs)
+        opts.jobs = (unsigned) std::clamp<uint64_t>(budget / (3 * MIN_BAND_SIZE), 1, opts.jobs);
+
+    uint64_t band = budget / opts.jobs / 3;
+
+    opts.max_band_size = (tmsize_t) std::clamp<uint64_t>(band, MIN_BAND_SIZE, opts.max_band_size);
+}
+
+// Converts each file, on a pool of opts.jobs workers unless it is 1, and
+// returns which ones were converted
+static std::vector<char> convert_files(const std::vector<const char *> &files, const Options &opts,
+                                       ResultLog *log, MemoryBudget *budget)
+{
+    std::vector<char> converted(files.size(), 0);
+
+    if (opts.jobs == 1)
+    {
+        for (size_t i = 0; i < files.size(); i++)
+            converted[i] = convert_file(files[i], opts, log, budget);
+    }
+    else
+    {
+        WorkerPool pool(opts.jobs);
+        std::unique_ptr<LoadMonitor> monitor;
+
+        if (opts.background)
+            monitor.reset(new LoadMonitor(pool));
+
+        pool.run(files.size(), [&](size_t i) { converted[i] = convert_file(files[i], opts, log, budget); });
+    }
+
+    return converted;
+}
+
+//Times each setting is tried; the fastest run counts
+static const int CALIBRATION_RUNS = 2;
+//How much faster a setting has to be to replace the one chosen so far
+static const double CALIBRATION_MARGIN = 0.05;
+
+// Seconds to convert files with opts, the best of CALIBRATION_RUNS, or a
+// negative number if a file failed
+static double time_conversion(const std::vector<const char *> &files, const Options &opts)
+{
+    double best = 0;
+
+    for (int run = 0; run < CALIBRATION_RUNS; run++)
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        std::vector<char> converted = convert_files(files, opts, nullptr, nullptr);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        if (std::find(converted.begin(), converted.end(), 0) != converted.end())
+            return -1;
+
+        if (run == 0 || seconds < best)
+            best = seconds;
+    }
+
+    return best;
+}
+
+// Times a synthetic workload with different settings, and writes the
+// fastest to the profile for later runs to load. The settings are tuned one
+// after the other, each with the best of those before: the SIMD kernels,
+// the encoder, its buffer sizes, the band size and finally the number of
+// workers. The other options, such as --depth, are used as given. A
+// setting only changes from its default if that is clearly faster, so
+// noise doesn't end up in the profile.
+static int calibrate(Options opts, const std::string &profile)
+{
+    if (profile.empty())
+    {
+        std::cout << "Nowhere to write the profile: set HOME or use --profile" << std::endl;
+
+        return 1;
+    }
+
+    set_huge_pages(opts.huge_pages);
+
+    unsigned cpus = available_cpus();
+    opts.jobs = cpus;
+
+    std::error_code error;
+    std::filesystem::path directory = std::filesystem::temp_directory_path(error) /
+                                      ("tiff-png-calibrate-" + std::to_string(getpid()));
+    std::filesystem::create_directories(directory, error);
+
+    //Enough files to keep every worker busy for a while
+    std::vector<std::string> paths =
+        write_calibration_corpus(directory.string(), std::clamp<size_t>(2 * cpus, 8, 64));
+    std::vector<const char *> files;
+
+    for (const std::string &path : paths)
+        files.push_back(path.c_str());
+
+    if (files.empty())
+    {
+        std::cout << "Could not write the calibration images to " << directory.string() << std::endl;
+        std::filesystem::remove_all(directory, error);
+
+        return 1;
+    }
+
+    std::vector<std::string> chosen;
+    bool failed = false;
+
+    // Tries each value of one setting, the current one first, and keeps the
+    // fastest. apply sets value i in the options given.
+    auto tune = [&](const char *option, const std::vector<std::string> &values,
+                    const std::function<void(Options &, size_t)> &apply)
+    {
+        size_t best = 0;
+        double best_seconds = 0;
+
+        for (size_t i = 0; i < values.size() && !failed; i++)
+        {
+            Options trial = opts;
+            apply(trial, i);
+
+            double seconds = time_conversion(files, trial);
+            failed = seconds < 0;
+
+            char line[96];
+            snprintf(line, sizeof(line), "  %s %s: %.3f s", option, values[i].c_str(), seconds);
+            std::cout << line << std::endl;
+
+            if (i == 0 || seconds < best_seconds * (1 - CALIBRATION_MARGIN))
+            {
+                best = i;
+                best_seconds = seconds;
+            }
+        }
+
+        apply(opts, best);
+
+        if (best != 0)
+            chosen.push_back(std::string(option) + " " + values[best]);
+    };
+
+    std::cout << "Calibrating with " << files.size() << " images" << std::endl;
+
+    std::vector<const KernelTable *> tables = supported_kernels();
+    std::vector<std::string> variants;
+
+    //The default, the best the CPU supports, first
+    for (auto table = tables.rbegin(); table != tables.rend(); ++table)
+        variants.push_back((*table)->name);
+
+    tune("--cpu", variants, [&](Options &, size_t i) { select_kernels(variants[i].c_str()); });
+
+    tune("--encoder", {"libpng", "custom"}, [](Options &o, size_t i) {
+        o.encoder = i ? Encoder::Custom : Encoder::Libpng;
+    });
+
+    //Value 0 keeps the default, which the first label stands for
+    std::vector<std::string> sizes = {"default", "256K", "1M"};
+
+    auto set_size = [&](size_t Options::*size) {
+        return [&sizes, size](Options &o, size_t i) {
+            o.*size = 0;
+
+            if (i)
+                parse_size(sizes[i].c_str(), o.*size);
+        };
+    };
+
+    tune("--zbuf-size", sizes, set_size(&Options::zbuf_size));
+
+    if (opts.encoder == Encoder::Custom)
+        tune("--idat-size", sizes, set_size(&Options::idat_size));
+
+    std::vector<std::string> bands = {"16M", "1M", "256K"};
+
+    tune("--band-size", bands, [&](Options &o, size_t i) {
+        size_t size = 0;
+        parse_size(bands[i].c_str(), size);
+        o.max_band_size = (tmsize_t) size;
+    });
+
+    // All the CPUs, the default, then fewer workers by halves. Fewer than an
+    // eighth of them is hardly ever faster.
+    std::vector<std::string> jobs = {"0"};
+    unsigned fewer = 1;
+
+    while (fewer * 2 < cpus)
+        fewer *= 2;
+
+    for (; fewer >= 1 && fewer < cpus && fewer * 8 >= cpus; fewer /= 2)
+        jobs.push_back(std::to_string(fewer));
+
+    tune("--jobs", jobs, [&](Options &o, size_t i) {
+        o.jobs = i ? (unsigned) std::stoul(jobs[i]) : cpus;
+    });
+
+    std::filesystem::remove_all(directory, error);
+
+    if (failed)
+    {
+        std::cout << "A calibration image failed to convert" << std::endl;
+
+        return 1;
+    }
+
+    std::string comment = "Written by tiff-png --calibrate for " + std::to_string(cpus) +
+                          " CPUs. Settings that aren't listed were\n" +
+                          "fastest at their defaults. Options on the command line override these.";
+
+    if (!write_profile(profile, comment, chosen))
+    {
+        std::cout << "Could not write the profile: " << profile << std::endl;
+
+        return 1;
+    }
+
+    std::cout << "Wrote " << profile << ":";
+
+    for (const std::string &setting : chosen)
+        std::cout << " " << setting;
+
+    std::cout << (chosen.empty() ? " the defaults are fastest" : "") << std::endl;
+
+    return 0;
+}
+
+// Applies the settings in a profile, then the command line again, so that
+// the options given there win. A profile that is missing is only an error if
+// required; one with invalid settings, such as a --cpu variant this CPU
+// lacks, is ignored with a warning.
+static bool apply_profile(const std::string &path, bool required, int argc, char *argv[],
+                          Options &opts, std::vector<const char *> &files)
+{
+    std::vector<std::string> args;
 
-    try {
-        save_tiff_as_png(tif, output_file.c_str());
+    if (!read_profile(path, args))
+    {
+        if (required)
+            std::cout << "Could not read profile: " << path << std::endl;
 
-        result = true;
+        return !required;
     }
-    catch (const std::exception &e)
+
+    std::vector<char *> profile_argv = {argv[0]};
+
+    for (std::string &arg : args)
+        profile_argv.push_back(&arg[0]);
+
+    Options profiled;
+    std::vector<const char *> stray;
+
+    if (!parse_options((int) profile_argv.size(), profile_argv.data(), profiled, stray) || !stray.empty())
     {
-        std::cout << "Failed to convert TIFF to PNG: " << e.what() << std::endl;
+        std::cerr << "Ignoring invalid profile: " << path << std::endl;
+
+        profiled = Options();
+        select_kernels("auto");
     }
 
-    TIFFClose(tif);
+    //The command line was parsed once already, so it can't fail now
+    files.clear();
+    parse_options(argc, argv, profiled, files);
+    opts = profiled;
 
-    return result;
+    return true;
 }
 
 int main(int argc, char *argv[])
 {
-    if (argc < 2)
+    Options opts;
+    std::vector<const char *> files;
+
+    if (!parse_options(argc, argv, opts, files))
     {
-        std::cout << "Usage: " << argv[0] << " TIFF_FILE1 TIFF_FILE2 ..." << std::endl;
+        print_usage(argv[0]);
 
         return 1;
     }
 
+    if (opts.self_test)
+        return kernel_self_test(std::cout) ? 0 : 1;
+
+    std::string profile = opts.profile.empty() ? default_profile_path() : opts.profile;
+
+    if (profile == "none")
+        profile.clear();
+
+    if (opts.calibrate)
+        return calibrate(opts, profile);
+
+    //A profile that was asked for has to be there
+    if (!profile.empty() && !apply_profile(profile, !opts.profile.empty(), argc, argv, opts, files))
+        return 1;
+
+    if (files.empty())
+    {
+        print_usage(argv[0]);
+
+        return 1;
+    }
+
+    //Picked before any worker can race to do it
+    kernels();
+    set_huge_pages(opts.huge_pages);
+
+    //Before any worker starts, so that they all inherit the priorities
+    if (opts.background && !enter_background())
+        std::cerr << "Could not lower the CPU priority" << std::endl;
+
+    // In a container, the CPU quota and memory limit of the cgroup size the
+    // work rather than the host's CPUs and memory
+    bool auto_jobs = opts.jobs == 0;
+
+    if (auto_jobs)
+        opts.jobs = std::min<size_t>(available_cpus(), files.size());
+
+    uint64_t memory = opts.memory_limit ? opts.memory_limit : cgroup_limits().memory;
+    std::unique_ptr<MemoryBudget> budget;
+
+    if (memory)
+    {
+        fit_memory(memory, auto_jobs, opts);
+
+        //The same half of the limit fit_memory shares between the workers
+        budget.reset(new MemoryBudget(memory / 2));
+    }
+
+    // Without a PMU, as in many VMs, or with perf_event_paranoid above 2,
+    // the conversion goes ahead uncounted
+    if (opts.perf_counters)
+    {
+        if (PerfCounters::for_thread())
+            enable_metrics();
+        else
+        {
+            std::cerr << "Hardware counters are unavailable, continuing without them: "
+                      << PerfCounters::error() << std::endl;
+
+            opts.perf_counters = false;
+        }
+    }
+
+    std::unique_ptr<MetricsWriter> metrics;
+    std::unique_ptr<ResultLog> log;
+
+    if (!opts.log_json.empty())
+    {
+        log = ResultLog::open(opts.log_json);
+
+        if (!log)
+        {
+            std::cerr << "Could not open log file: " << opts.log_json << std::endl;
+
+            return 1;
+        }
+    }
+
+    if (!opts.metrics.empty())
+    {
+        enable_metrics();
+        count_queued(files.size());
+        metrics.reset(new MetricsWriter(opts.metrics, std::chrono::seconds(opts.metrics_interval)));
+    }
+
+    std::vector<char> converted = convert_files(files, opts, log.get(), budget.get());
+
+    //The final numbers and records are written before the failures are reported
+    metrics.reset();
+    log.reset();
+
+    if (opts.perf_counters)
+        write_perf_summary(std::cout);
+
     int exit_code = 0;
 
-    for (int i = 1; i < argc; ++i)
+    for (size_t i = 0; i < files.size(); i++)
     {
-        if (!convert_file(argv[i]))
+        if (!converted[i])
         {
-            std::cerr << "Failed to convert: " << argv[i] << std::endl;
+            std::cerr << "Failed to convert: " << files[i] << std::endl;
 
             exit_code = 1;
         }
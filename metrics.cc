@@ -0,0 +1,483 @@
+#include "metrics.h"
+
+#include <time.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <sstream>
+#include <vector>
+
+#include "accounting.h"
+
+static const size_t FAILURES = (size_t) Failure::Other + 1;
+static const size_t STAGES = (size_t) Stage::Encode + 1;
+
+static const char *const FAILURE_NAMES[FAILURES] = {
+    "open", "unsupported", "decode", "libpng", "output", "other"
+};
+
+static const char *const STAGE_NAMES[STAGES] = { "decode", "process", "encode" };
+
+//Upper bounds of the latency histogram buckets, in seconds. Beyond the last
+//one is the +Inf bucket.
+static const double BUCKET_BOUNDS[] = { 0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1, 5, 10, 60 };
+static const size_t BUCKETS = sizeof(BUCKET_BOUNDS) / sizeof(BUCKET_BOUNDS[0]) + 1;
+
+//Only the owning thread writes a counter, so it is bumped with a plain load
+//and store rather than a locked read-modify-write. The atomics keep the
+//writer's reads well defined.
+typedef std::atomic<uint64_t> Counter;
+
+static void add(Counter &counter, uint64_t n)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+struct Histogram
+{
+    Counter buckets[BUCKETS] = {};
+    Counter nanoseconds{0};
+
+    void observe(uint64_t ns)
+    {
+        double seconds = ns * 1e-9;
+        size_t bucket = 0;
+
+        while (bucket < BUCKETS - 1 && seconds > BUCKET_BOUNDS[bucket])
+            bucket++;
+
+        add(buckets[bucket], 1);
+        add(nanoseconds, ns);
+    }
+};
+
+// The counters of one thread
+struct ThreadMetrics
+{
+    Counter started{0};
+    Counter converted{0};
+    Counter failures[FAILURES] = {};
+    Counter bytes_read{0};
+    Counter bytes_written{0};
+    Counter memory_peak{0};
+    Counter events[STAGES][PERF_EVENTS] = {};
+    Histogram stages[STAGES];
+    Histogram files;
+};
+
+// Every thread's block. Blocks outlive their threads so that the totals
+// keep what finished workers counted.
+static std::mutex registry_mutex;
+static std::vector<std::unique_ptr<ThreadMetrics>> registry;
+
+static bool enabled = false;
+static std::atomic<uint64_t> queued{0};
+
+static ThreadMetrics &local()
+{
+    thread_local ThreadMetrics *metrics = nullptr;
+
+    if (!metrics) {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        registry.push_back(std::make_unique<ThreadMetrics>());
+        metrics = registry.back().get();
+    }
+
+    return *metrics;
+}
+
+void enable_metrics()
+{
+    enabled = true;
+}
+
+bool metrics_enabled()
+{
+    return enabled;
+}
+
+uint64_t metrics_clock()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void count_queued(size_t files)
+{
+    if (enabled)
+        queued.fetch_add(files, std::memory_order_relaxed);
+}
+
+void count_started()
+{
+    if (enabled)
+        add(local().started, 1);
+}
+
+void count_converted(uint64_t bytes_read, uint64_t bytes_written, uint64_t nanoseconds)
+{
+    if (!enabled)
+        return;
+
+    ThreadMetrics &metrics = local();
+
+    add(metrics.converted, 1);
+    add(metrics.bytes_read, bytes_read);
+    add(metrics.bytes_written, bytes_written);
+    metrics.files.observe(nanoseconds);
+}
+
+void count_failure(Failure reason, uint64_t nanoseconds)
+{
+    if (!enabled)
+        return;
+
+    ThreadMetrics &metrics = local();
+
+    add(metrics.failures[(size_t) reason], 1);
+    metrics.files.observe(nanoseconds);
+}
+
+void count_memory(uint64_t peak)
+{
+    if (!enabled)
+        return;
+
+    Counter &highest = local().memory_peak;
+
+    if (peak > highest.load(std::memory_order_relaxed))
+        highest.store(peak, std::memory_order_relaxed);
+}
+
+void count_stages(const StageTimes &times)
+{
+    if (!enabled)
+        return;
+
+    ThreadMetrics &metrics = local();
+
+    for (size_t stage = 0; stage < STAGES; stage++)
+        if (uint64_t ns = times.nanoseconds((Stage) stage))
+            metrics.stages[stage].observe(ns);
+
+    if (!times.counts_events())
+        return;
+
+    for (size_t stage = 0; stage < STAGES; stage++)
+        for (size_t event = 0; event < PERF_EVENTS; event++)
+            add(metrics.events[stage][event], times.count((Stage) stage, (PerfEvent) event));
+}
+
+void StageTimes::count_events(Stage stage)
+{
+    uint64_t now[PERF_EVENTS];
+    counters->read(now);
+
+    for (size_t i = 0; i < PERF_EVENTS; i++) {
+        //Scaled counts from multiplexed counters can step back a little
+        if (now[i] > last_events[i])
+            events[(size_t) stage][i] += now[i] - last_events[i];
+
+        last_events[i] = now[i];
+    }
+}
+
+const char *failure_name(Failure reason)
+{
+    return FAILURE_NAMES[(size_t) reason];
+}
+
+const char *stage_name(Stage stage)
+{
+    return STAGE_NAMES[(size_t) stage];
+}
+
+// A sum over all threads' blocks
+struct Totals
+{
+    uint64_t started = 0;
+    uint64_t converted = 0;
+    uint64_t failures[FAILURES] = {};
+    uint64_t failed = 0;
+    uint64_t bytes_read = 0;
+    uint64_t bytes_written = 0;
+    uint64_t memory_peak = 0;
+    uint64_t events[STAGES][PERF_EVENTS] = {};
+    //Whether any hardware events were counted
+    bool counted = false;
+
+    struct Latency
+    {
+        //Cumulative, as Prometheus has them
+        uint64_t buckets[BUCKETS] = {};
+        uint64_t nanoseconds = 0;
+    } stages[STAGES], files;
+};
+
+static void sum(Totals::Latency &total, const Histogram &histogram)
+{
+    for (size_t i = 0; i < BUCKETS; i++)
+        total.buckets[i] += histogram.buckets[i].load(std::memory_order_relaxed);
+
+    total.nanoseconds += histogram.nanoseconds.load(std::memory_order_relaxed);
+}
+
+static Totals totals()
+{
+    Totals totals;
+    std::lock_guard<std::mutex> lock(registry_mutex);
+
+    for (const std::unique_ptr<ThreadMetrics> &metrics : registry) {
+        totals.started += metrics->started.load(std::memory_order_relaxed);
+        totals.converted += metrics->converted.load(std::memory_order_relaxed);
+        totals.bytes_read += metrics->bytes_read.load(std::memory_order_relaxed);
+        totals.bytes_written += metrics->bytes_written.load(std::memory_order_relaxed);
+        totals.memory_peak = std::max(totals.memory_peak, metrics->memory_peak.load(std::memory_order_relaxed));
+
+        for (size_t i = 0; i < FAILURES; i++)
+            totals.failures[i] += metrics->failures[i].load(std::memory_order_relaxed);
+
+        for (size_t i = 0; i < STAGES; i++)
+            sum(totals.stages[i], metrics->stages[i]);
+
+        for (size_t i = 0; i < STAGES; i++)
+            for (size_t j = 0; j < PERF_EVENTS; j++)
+                totals.events[i][j] += metrics->events[i][j].load(std::memory_order_relaxed);
+
+        sum(totals.files, metrics->files);
+    }
+
+    for (size_t i = 0; i < FAILURES; i++)
+        totals.failed += totals.failures[i];
+
+    for (size_t i = 0; i < STAGES; i++)
+        for (size_t j = 0; j < PERF_EVENTS; j++)
+            totals.counted |= totals.events[i][j] != 0;
+
+    for (Totals::Latency *latency = totals.stages; latency <= &totals.files; latency++)
+        for (size_t i = 1; i < BUCKETS; i++)
+            latency->buckets[i] += latency->buckets[i - 1];
+
+    return totals;
+}
+
+static void write_histogram(std::ostream &out, const char *name, const std::string &labels,
+                            const Totals::Latency &latency)
+{
+    std::string separator = labels.empty() ? "" : ",";
+
+    for (size_t i = 0; i < BUCKETS; i++) {
+        out << name << "_bucket{" << labels << separator << "le=\"";
+
+        if (i < BUCKETS - 1)
+            out << BUCKET_BOUNDS[i];
+        else
+            out << "+Inf";
+
+        out << "\"} " << latency.buckets[i] << "\n";
+    }
+
+    std::string braces = labels.empty() ? "" : "{" + labels + "}";
+
+    out << name << "_sum" << braces << " " << latency.nanoseconds * 1e-9 << "\n"
+        << name << "_count" << braces << " " << latency.buckets[BUCKETS - 1] << "\n";
+}
+
+static void write_prometheus(std::ostream &out, const Totals &totals, uint64_t depth)
+{
+    out << "# HELP tiff_png_files_converted_total Files converted to PNG.\n"
+        << "# TYPE tiff_png_files_converted_total counter\n"
+        << "tiff_png_files_converted_total " << totals.converted << "\n"
+        << "# HELP tiff_png_failures_total Files that failed to convert, by reason.\n"
+        << "# TYPE tiff_png_failures_total counter\n";
+
+    for (size_t i = 0; i < FAILURES; i++)
+        out << "tiff_png_failures_total{reason=\"" << FAILURE_NAMES[i] << "\"} " << totals.failures[i] << "\n";
+
+    out << "# HELP tiff_png_read_bytes_total Size of the TIFF files converted.\n"
+        << "# TYPE tiff_png_read_bytes_total counter\n"
+        << "tiff_png_read_bytes_total " << totals.bytes_read << "\n"
+        << "# HELP tiff_png_written_bytes_total Size of the PNG files written.\n"
+        << "# TYPE tiff_png_written_bytes_total counter\n"
+        << "tiff_png_written_bytes_total " << totals.bytes_written << "\n"
+        << "# HELP tiff_png_queue_depth Files waiting for a worker.\n"
+        << "# TYPE tiff_png_queue_depth gauge\n"
+        << "tiff_png_queue_depth " << depth << "\n"
+        << "# HELP tiff_png_files_in_progress Files being converted.\n"
+        << "# TYPE tiff_png_files_in_progress gauge\n"
+        << "tiff_png_files_in_progress " << totals.started - totals.converted - totals.failed << "\n"
+        << "# HELP tiff_png_file_memory_peak_bytes Most memory one file has had allocated at once.\n"
+        << "# TYPE tiff_png_file_memory_peak_bytes gauge\n"
+        << "tiff_png_file_memory_peak_bytes " << totals.memory_peak << "\n"
+        << "# HELP tiff_png_peak_rss_bytes Peak resident set size of the process.\n"
+        << "# TYPE tiff_png_peak_rss_bytes gauge\n"
+        << "tiff_png_peak_rss_bytes " << peak_rss() << "\n"
+        << "# HELP tiff_png_stage_seconds Time spent on each stage of a file.\n"
+        << "# TYPE tiff_png_stage_seconds histogram\n";
+
+    for (size_t i = 0; i < STAGES; i++)
+        write_histogram(out, "tiff_png_stage_seconds", std::string("stage=\"") + STAGE_NAMES[i] + "\"",
+                        totals.stages[i]);
+
+    if (totals.counted) {
+        out << "# HELP tiff_png_stage_events_total Hardware events counted in user space during each stage.\n"
+            << "# TYPE tiff_png_stage_events_total counter\n";
+
+        for (size_t i = 0; i < STAGES; i++)
+            for (size_t j = 0; j < PERF_EVENTS; j++)
+                out << "tiff_png_stage_events_total{stage=\"" << STAGE_NAMES[i] << "\",event=\""
+                    << perf_event_name((PerfEvent) j) << "\"} " << totals.events[i][j] << "\n";
+    }
+
+    out << "# HELP tiff_png_file_seconds Time from opening a file to finishing or failing it.\n"
+        << "# TYPE tiff_png_file_seconds histogram\n";
+
+    write_histogram(out, "tiff_png_file_seconds", "", totals.files);
+}
+
+static void write_json_histogram(std::ostream &out, const Totals::Latency &latency)
+{
+    out << "{\"count\":" << latency.buckets[BUCKETS - 1]
+        << ",\"sum\":" << latency.nanoseconds * 1e-9 << ",\"buckets\":{";
+
+    for (size_t i = 0; i < BUCKETS; i++) {
+        out << (i ? "," : "") << "\"";
+
+        if (i < BUCKETS - 1)
+            out << BUCKET_BOUNDS[i];
+        else
+            out << "+Inf";
+
+        out << "\":" << latency.buckets[i];
+    }
+
+    out << "}}";
+}
+
+static void write_json(std::ostream &out, const Totals &totals, uint64_t depth)
+{
+    out << "{\"files_converted\":" << totals.converted << ",\"failures\":{";
+
+    for (size_t i = 0; i < FAILURES; i++)
+        out << (i ? "," : "") << "\"" << FAILURE_NAMES[i] << "\":" << totals.failures[i];
+
+    out << "},\"bytes_read\":" << totals.bytes_read
+        << ",\"bytes_written\":" << totals.bytes_written
+        << ",\"queue_depth\":" << depth
+        << ",\"files_in_progress\":" << totals.started - totals.converted - totals.failed
+        << ",\"file_memory_peak_bytes\":" << totals.memory_peak
+        << ",\"peak_rss_bytes\":" << peak_rss()
+        << ",\"stage_seconds\":{";
+
+    for (size_t i = 0; i < STAGES; i++) {
+        out << (i ? "," : "") << "\"" << STAGE_NAMES[i] << "\":";
+        write_json_histogram(out, totals.stages[i]);
+    }
+
+    out << "}";
+
+    if (totals.counted) {
+        out << ",\"stage_events\":{";
+
+        for (size_t i = 0; i < STAGES; i++) {
+            out << (i ? "," : "") << "\"" << STAGE_NAMES[i] << "\":{";
+
+            for (size_t j = 0; j < PERF_EVENTS; j++)
+                out << (j ? "," : "") << "\"" << perf_event_name((PerfEvent) j) << "\":" << totals.events[i][j];
+
+            out << "}";
+        }
+
+        out << "}";
+    }
+
+    out << ",\"file_seconds\":";
+    write_json_histogram(out, totals.files);
+    out << "}\n";
+}
+
+MetricsWriter::MetricsWriter(const std::string &path, std::chrono::seconds interval)
+    : path(path), interval(interval),
+      json(path.size() >= 5 && path.compare(path.size() - 5, 5, ".json") == 0),
+      thread(&MetricsWriter::watch, this)
+{
+}
+
+MetricsWriter::~MetricsWriter()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+
+    stop_requested.notify_all();
+    thread.join();
+
+    write();
+}
+
+void MetricsWriter::watch()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+
+    while (!stop_requested.wait_for(lock, interval, [this] { return stopping; }))
+        write();
+}
+
+void MetricsWriter::write() const
+{
+    Totals sums = totals();
+    uint64_t waiting = queued.load(std::memory_order_relaxed);
+    uint64_t depth = waiting > sums.started ? waiting - sums.started : 0;
+
+    std::ostringstream out;
+
+    if (json)
+        write_json(out, sums, depth);
+    else
+        write_prometheus(out, sums, depth);
+
+    std::string text = out.str();
+    std::string temporary = path + ".tmp";
+    FILE *file = fopen(temporary.c_str(), "w");
+
+    //Metrics are best effort and never fail the conversion
+    if (!file)
+        return;
+
+    bool written = fwrite(text.data(), 1, text.size(), file) == text.size();
+
+    if (fclose(file) == 0 && written)
+        rename(temporary.c_str(), path.c_str());
+    else
+        remove(temporary.c_str());
+}
+
+void write_perf_summary(std::ostream &out)
+{
+    Totals sums = totals();
+    char line[256];
+
+    out << "Hardware counters per stage (user space):\n";
+
+    for (size_t i = 0; i < STAGES; i++) {
+        const uint64_t *events = sums.events[i];
+        double cycles = (double) events[(size_t) PerfEvent::Cycles];
+        double instructions = (double) events[(size_t) PerfEvent::Instructions];
+        double per_kilo = instructions > 0 ? 1000 / instructions : 0;
+
+        // Few instructions per cycle with many cache misses per instruction
+        // points to memory-bound work, a high IPC to compute-bound work
+        snprintf(line, sizeof(line),
+                 "  %-8s %14.0f cycles %14.0f instructions  IPC %.2f  "
+                 "%.2f cache misses and %.2f branch misses per 1000 instructions\n",
+                 STAGE_NAMES[i], cycles, instructions, cycles > 0 ? instructions / cycles : 0,
+                 events[(size_t) PerfEvent::CacheMisses] * per_kilo,
+                 events[(size_t) PerfEvent::BranchMisses] * per_kilo);
+
+        out << line;
+    }
+}
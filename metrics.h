@@ -0,0 +1,140 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+
+#include "perf_counters.h"
+
+// Why a file failed to convert
+enum class Failure
+{
+    Open,
+    Unsupported,
+    Decode,
+    Libpng,
+    Output,
+    Other
+};
+
+// The stages each file goes through, timed per file
+enum class Stage
+{
+    Decode,
+    Process,
+    Encode
+};
+
+// Conversion metrics. Each thread counts into its own block, so recording
+// is a few uncontended stores. The blocks are only summed up when the
+// metrics are written. Recording does nothing until enable_metrics() is
+// called, which must happen before any worker starts.
+void enable_metrics();
+bool metrics_enabled();
+
+// Monotonic nanoseconds, for timing stages
+uint64_t metrics_clock();
+
+// Files handed to the workers, and files a worker has started on. Their
+// difference is the queue depth.
+void count_queued(size_t files);
+void count_started();
+
+void count_converted(uint64_t bytes_read, uint64_t bytes_written, uint64_t nanoseconds);
+void count_failure(Failure reason, uint64_t nanoseconds);
+
+// The most memory a file had allocated at once, from its MemoryAccount
+void count_memory(uint64_t peak);
+
+// Splits the time spent on a file into stages. Each call to lap() charges
+// the time since the previous one to a stage, and with hardware counters
+// the events since then too. A disabled timer never reads the clock.
+class StageTimes
+{
+public:
+    explicit StageTimes(bool enabled = false, const PerfCounters *counters = nullptr)
+        : enabled(enabled), counters(enabled ? counters : nullptr)
+    {
+        start();
+    }
+
+    // Starts timing afresh, from now
+    void start()
+    {
+        if (enabled)
+            last = metrics_clock();
+
+        if (counters)
+            counters->read(last_events);
+    }
+
+    void lap(Stage stage)
+    {
+        if (!enabled)
+            return;
+
+        uint64_t now = metrics_clock();
+        times[(size_t) stage] += now - last;
+        last = now;
+
+        if (counters)
+            count_events(stage);
+    }
+
+    uint64_t nanoseconds(Stage stage) const { return times[(size_t) stage]; }
+
+    bool counts_events() const { return counters != nullptr; }
+    uint64_t count(Stage stage, PerfEvent event) const { return events[(size_t) stage][(size_t) event]; }
+
+private:
+    void count_events(Stage stage);
+
+    bool enabled;
+    const PerfCounters *counters;
+    uint64_t last = 0;
+    uint64_t times[(size_t) Stage::Encode + 1] = {};
+    uint64_t last_events[PERF_EVENTS] = {};
+    uint64_t events[(size_t) Stage::Encode + 1][PERF_EVENTS] = {};
+};
+
+// Adds the stage times of a file to the stage histograms
+void count_stages(const StageTimes &times);
+
+const char *failure_name(Failure reason);
+const char *stage_name(Stage stage);
+
+// Prints the hardware events counted for each stage, summed over all
+// files, with the ratios that tell compute-bound from memory-bound work
+void write_perf_summary(std::ostream &out);
+
+// Writes the metrics to a file every interval, and once more when it is
+// destroyed. A name ending in .json gives a JSON object, anything else the
+// Prometheus text format for node_exporter's textfile collector. The file
+// is replaced with a rename, so readers never see half of it.
+class MetricsWriter
+{
+public:
+    MetricsWriter(const std::string &path, std::chrono::seconds interval);
+    ~MetricsWriter();
+
+    MetricsWriter(const MetricsWriter &) = delete;
+    MetricsWriter &operator=(const MetricsWriter &) = delete;
+
+private:
+    void watch();
+    void write() const;
+
+    std::string path;
+    std::chrono::seconds interval;
+    bool json;
+
+    std::mutex mutex;
+    std::condition_variable stop_requested;
+    bool stopping = false;
+    std::thread thread;
+};
@@ -0,0 +1,117 @@
+#include "perf_counters.h"
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+
+static const char *const EVENT_NAMES[PERF_EVENTS] = {
+    "cycles", "instructions", "cache_misses", "branch_misses"
+};
+
+static const uint64_t EVENT_CONFIGS[PERF_EVENTS] = {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES,
+    PERF_COUNT_HW_BRANCH_MISSES
+};
+
+static std::mutex error_mutex;
+static std::string first_error;
+
+const char *perf_event_name(PerfEvent event)
+{
+    return EVENT_NAMES[(size_t) event];
+}
+
+static void set_error(const std::string &message)
+{
+    std::lock_guard<std::mutex> lock(error_mutex);
+
+    if (first_error.empty())
+        first_error = message;
+}
+
+std::string PerfCounters::error()
+{
+    std::lock_guard<std::mutex> lock(error_mutex);
+
+    return first_error;
+}
+
+PerfCounters *PerfCounters::for_thread()
+{
+    thread_local std::unique_ptr<PerfCounters> counters;
+    thread_local bool tried = false;
+
+    if (tried)
+        return counters.get();
+
+    tried = true;
+
+    std::unique_ptr<PerfCounters> group(new PerfCounters);
+
+    for (size_t i = 0; i < PERF_EVENTS; i++) {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = EVENT_CONFIGS[i];
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                           PERF_FORMAT_TOTAL_TIME_RUNNING;
+        //The leader starts the whole group
+        attr.disabled = i == 0;
+
+        int fd = (int) syscall(SYS_perf_event_open, &attr, 0, -1, i == 0 ? -1 : group->fds[0], 0);
+
+        if (fd < 0) {
+            set_error(std::string("perf_event_open for ") + EVENT_NAMES[i] + ": " + strerror(errno));
+
+            return nullptr;
+        }
+
+        group->fds[i] = fd;
+    }
+
+    ioctl(group->fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    counters = std::move(group);
+
+    return counters.get();
+}
+
+PerfCounters::~PerfCounters()
+{
+    for (int fd : fds)
+        if (fd >= 0)
+            close(fd);
+}
+
+void PerfCounters::read(uint64_t counts[PERF_EVENTS]) const
+{
+    // PERF_FORMAT_GROUP: the number of events, the enabled and running
+    // times, then a value per event
+    uint64_t data[3 + PERF_EVENTS];
+
+    if (::read(fds[0], data, sizeof(data)) != (ssize_t) sizeof(data) || data[0] != PERF_EVENTS) {
+        memset(counts, 0, PERF_EVENTS * sizeof(uint64_t));
+
+        return;
+    }
+
+    uint64_t enabled = data[1];
+    uint64_t running = data[2];
+
+    for (size_t i = 0; i < PERF_EVENTS; i++) {
+        uint64_t value = data[3 + i];
+
+        if (running > 0 && running < enabled)
+            value = (uint64_t) ((double) value * enabled / running);
+
+        counts[i] = value;
+    }
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+// The hardware events counted per stage
+enum class PerfEvent
+{
+    Cycles,
+    Instructions,
+    CacheMisses,
+    BranchMisses
+};
+
+static const size_t PERF_EVENTS = (size_t) PerfEvent::BranchMisses + 1;
+
+const char *perf_event_name(PerfEvent event);
+
+// A group of hardware counters for the calling thread, read with one
+// system call. Only user-space events are counted, which perf allows
+// unprivileged at the default perf_event_paranoid setting of 2.
+class PerfCounters
+{
+public:
+    // The counters of the calling thread, opened on first use, or nullptr
+    // if perf_event_open isn't available. The first failure is kept in
+    // error().
+    static PerfCounters *for_thread();
+
+    static std::string error();
+
+    ~PerfCounters();
+
+    PerfCounters(const PerfCounters &) = delete;
+    PerfCounters &operator=(const PerfCounters &) = delete;
+
+    // Counts since the group was opened. If the kernel had to share the
+    // counters with other groups, the counts are scaled up to the time the
+    // group was enabled.
+    void read(uint64_t counts[PERF_EVENTS]) const;
+
+private:
+    PerfCounters() = default;
+
+    int fds[PERF_EVENTS] = {-1, -1, -1, -1};
+};
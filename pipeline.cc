@@ -0,0 +1,187 @@
+#include "pipeline.h"
+
+#include <cstring>
+#include <vector>
+
+#include "kernel_bodies.h"
+
+// Whether a pipeline's pixels are gray or RGB, or Any for only known at
+// runtime. Only RGB pipelines have a color conversion stage.
+enum class Color
+{
+    Any,
+    Gray,
+    Rgb
+};
+
+// The buffers and stages shared by every pipeline. The specialized ones
+// are made in each instruction set from run().
+class RowStages : public RowPipeline
+{
+public:
+    explicit RowStages(const PipelineConfig &config)
+        : config(config),
+          samples((size_t) config.width * config.spp)
+    {
+        bool wide = config.bps == 16;
+
+        if (config.lut && wide)
+            color_row.resize(samples * sizeof(uint16_t));
+
+        if (config.swapped && wide && (config.lut || config.reduce_depth))
+            native_row.resize(samples * sizeof(uint16_t));
+
+        if (wide && config.reduce_depth && config.dither == Dither::Diffuse)
+            diffuser = std::make_unique<ErrorDiffuser>(config.width, config.spp);
+    }
+
+protected:
+    // The stages for BPS bits per sample, SPP samples per pixel and COLOR,
+    // with the kernels for N samples per iteration inlined. A 0 for BPS or
+    // SPP means it is only known at runtime.
+    template <size_t N, uint32_t BPS, uint32_t SPP, Color COLOR>
+    inline __attribute__((always_inline))
+    const uint8_t *run(const uint8_t *in, uint8_t *out, uint32_t row)
+    {
+        const uint32_t bps = BPS ? BPS : config.bps;
+        const uint32_t spp = SPP ? SPP : config.spp;
+        bool swapped = config.swapped && bps == 16;
+
+        //The color and depth conversions work on machine order samples
+        if (swapped && !native_row.empty()) {
+            swap16<N>((const uint16_t *) in, (uint16_t *) native_row.data(), samples);
+            in = native_row.data();
+            swapped = false;
+        }
+
+        //The LUT only takes RGB, with or without alpha
+        if constexpr (COLOR != Color::Gray && (SPP == 0 || SPP >= 3)) {
+            if (config.lut) {
+                if (bps != 16) {
+                    config.lut->apply<SPP>(in, out, config.width, spp);
+
+                    return out;
+                }
+
+                config.lut->apply<SPP>((const uint16_t *) in, (uint16_t *) color_row.data(), config.width, spp);
+                in = color_row.data();
+            }
+        }
+
+        if (bps != 16)
+            return in;
+
+        const uint16_t *in16 = (const uint16_t *) in;
+
+        if (config.reduce_depth) {
+            switch (config.dither) {
+            case Dither::Truncate:
+                depth16to8_truncate<N>(in16, out, samples);
+                break;
+            case Dither::Round:
+                depth16to8_round<N>(in16, out, samples);
+                break;
+            case Dither::Ordered:
+                depth16to8_ordered<N, SPP>(in16, out, config.width, spp, row);
+                break;
+            case Dither::Diffuse:
+                diffuser->process(in16, out);
+                break;
+            }
+
+            return out;
+        }
+
+        // PNG stores 16-bit samples in big-endian order
+        if ((__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__) != swapped)
+            return in;
+
+        swap16<N>(in16, (uint16_t *) out, samples);
+
+        return out;
+    }
+
+private:
+    PipelineConfig config;
+    size_t samples;
+    std::vector<uint8_t> color_row;
+    std::vector<uint8_t> native_row;
+    std::unique_ptr<ErrorDiffuser> diffuser;
+};
+
+typedef std::unique_ptr<RowPipeline> (*PipelineFactory)(const PipelineConfig &);
+
+// The pipelines of one instruction set
+struct PipelineVariant
+{
+    //The name of the matching KernelTable
+    const char *name;
+    //Specialized pipelines, indexed by [rgb][bps == 16][spp - 1]
+    PipelineFactory specialized[2][2][4];
+    PipelineFactory generic;
+};
+
+// Defines the pipelines of one variant, as DEFINE_VARIANT in kernels.cc
+// does for the kernels
+#define DEFINE_VARIANT(NAME, TARGET, N)                                                     \
+    namespace NAME                                                                          \
+    {                                                                                       \
+    template <uint32_t BPS, uint32_t SPP, Color COLOR>                                      \
+    class Pipeline final : public RowStages                                                 \
+    {                                                                                       \
+    public:                                                                                 \
+        using RowStages::RowStages;                                                         \
+                                                                                            \
+        TARGET const uint8_t *process(const uint8_t *in, uint8_t *out, uint32_t row) override \
+        {                                                                                   \
+            return run<N, BPS, SPP, COLOR>(in, out, row);                                   \
+        }                                                                                   \
+    };                                                                                      \
+    template <uint32_t BPS, uint32_t SPP, Color COLOR>                                      \
+    static std::unique_ptr<RowPipeline> create(const PipelineConfig &config)                \
+    {                                                                                       \
+        return std::make_unique<Pipeline<BPS, SPP, COLOR>>(config);                         \
+    }                                                                                       \
+    static const PipelineVariant variant = {                                                \
+        #NAME,                                                                              \
+        {{{create<8, 1, Color::Gray>, create<8, 2, Color::Gray>,                            \
+           create<8, 3, Color::Gray>, create<8, 4, Color::Gray>},                           \
+          {create<16, 1, Color::Gray>, create<16, 2, Color::Gray>,                          \
+           create<16, 3, Color::Gray>, create<16, 4, Color::Gray>}},                        \
+         {{create<8, 1, Color::Rgb>, create<8, 2, Color::Rgb>,                              \
+           create<8, 3, Color::Rgb>, create<8, 4, Color::Rgb>},                             \
+          {create<16, 1, Color::Rgb>, create<16, 2, Color::Rgb>,                            \
+           create<16, 3, Color::Rgb>, create<16, 4, Color::Rgb>}}},                         \
+        create<0, 0, Color::Any>                                                            \
+    };                                                                                      \
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+DEFINE_VARIANT(sse2, , 16)
+DEFINE_VARIANT(avx2, __attribute__((target("avx2"))), 32)
+DEFINE_VARIANT(avx512, __attribute__((target("avx512f,avx512bw"))), 64)
+
+static const PipelineVariant *const VARIANTS[] = {&sse2::variant, &avx2::variant, &avx512::variant};
+#else
+DEFINE_VARIANT(generic, , 16)
+
+static const PipelineVariant *const VARIANTS[] = {&generic::variant};
+#endif
+
+std::unique_ptr<RowPipeline> make_row_pipeline(const PipelineConfig &config)
+{
+    //kernels() has already checked that the CPU supports the variant
+    const PipelineVariant *variant = VARIANTS[0];
+
+    for (const PipelineVariant *candidate : VARIANTS)
+        if (strcmp(candidate->name, kernels().name) == 0)
+            variant = candidate;
+
+    bool gray = config.photometric == PHOTOMETRIC_MINISBLACK;
+    bool rgb = config.photometric == PHOTOMETRIC_RGB;
+
+    if ((gray || rgb) && (config.bps == 8 || config.bps == 16) && config.spp >= 1 && config.spp <= 4)
+        return variant->specialized[rgb][config.bps == 16][config.spp - 1](config);
+
+    return variant->generic(config);
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <tiff.h>
+#include <cstdint>
+#include <memory>
+
+#include "icc.h"
+#include "kernels.h"
+
+// What a row pipeline has to do for one image
+struct PipelineConfig
+{
+    uint32_t width = 0;
+    uint32_t bps = 0;
+    uint32_t spp = 0;
+    //PHOTOMETRIC_MINISBLACK or PHOTOMETRIC_RGB, YCbCr having been decoded
+    //to RGB
+    uint32_t photometric = PHOTOMETRIC_MINISBLACK;
+    //Conversion to sRGB, or nullptr
+    const ColorLut *lut = nullptr;
+    //Reduce 16-bit samples to 8 bits
+    bool reduce_depth = false;
+    Dither dither = Dither::Round;
+    //16-bit samples are in the opposite of machine byte order, as when
+    //they come straight from a TIFF file of the other endianness
+    bool swapped = false;
+};
+
+// Turns rows as read from the TIFF (samples in machine byte order unless
+// swapped is set) into rows ready for libpng (16-bit samples in big-endian
+// order).
+class RowPipeline
+{
+public:
+    virtual ~RowPipeline() = default;
+
+    // Returns the PNG row, written to out, which must have room for it.
+    // When nothing had to change the row is not copied and in is returned.
+    // Rows must be supplied in order.
+    virtual const uint8_t *process(const uint8_t *in, uint8_t *out, uint32_t row) = 0;
+};
+
+// Picks the pipeline compiled for the image's bit depth, samples per pixel
+// and photometric interpretation, or a generic one for other layouts. It
+// uses the same instruction set as kernels().
+std::unique_ptr<RowPipeline> make_row_pipeline(const PipelineConfig &config);
@@ -0,0 +1,265 @@
+#include "png_encoder.h"
+
+#include <png.h>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include "accounting.h"
+#include "checksum.h"
+
+static void put_u32(uint8_t *p, uint32_t v)
+{
+    p[0] = (uint8_t) (v >> 24);
+    p[1] = (uint8_t) (v >> 16);
+    p[2] = (uint8_t) (v >> 8);
+    p[3] = (uint8_t) v;
+}
+
+// zlib allocator hooks that charge the conversion's memory account
+static voidpf zlib_alloc(voidpf opaque, uInt items, uInt size)
+{
+    return account_malloc((MemoryAccount *) opaque, (size_t) items * size);
+}
+
+static void zlib_free(voidpf opaque, voidpf ptr)
+{
+    account_free((MemoryAccount *) opaque, ptr);
+}
+
+PngEncoder::PngEncoder(FILE *fp, const PngHeader &header, size_t idat_size, size_t zbuf_size)
+    : fp(fp), kernel(kernels())
+{
+    uint32_t channels;
+
+    switch (header.color_type) {
+    case PNG_COLOR_TYPE_GRAY:
+        channels = 1;
+        break;
+    case PNG_COLOR_TYPE_GRAY_ALPHA:
+        channels = 2;
+        break;
+    case PNG_COLOR_TYPE_RGB:
+        channels = 3;
+        break;
+    case PNG_COLOR_TYPE_RGB_ALPHA:
+        channels = 4;
+        break;
+    default:
+        throw std::invalid_argument("Unsupported PNG color type");
+    }
+
+    uint64_t bits = (uint64_t) header.width * channels * header.bit_depth;
+    row_size = (size_t) ((bits + 7) / 8);
+    bpp = (channels * header.bit_depth + 7) / 8;
+
+    // Like libpng, rows with samples below 8 bits are not filtered
+    filter_rows = header.bit_depth >= 8;
+
+    prev.assign(row_size, 0);
+    best.resize(row_size + 1);
+    candidate.resize(row_size + 1);
+    //The zlib header and trailer need a few bytes of room
+    idat.resize(std::max<size_t>(idat_size, 16));
+    input.resize(std::max<size_t>(zbuf_size, 16));
+
+    if (MemoryAccount *account = current_account()) {
+        stream.zalloc = zlib_alloc;
+        stream.zfree = zlib_free;
+        stream.opaque = account;
+    }
+
+    // Raw deflate, so that the zlib framing and Adler-32 are ours
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+                     filter_rows ? Z_FILTERED : Z_DEFAULT_STRATEGY) != Z_OK)
+        throw std::runtime_error("deflateInit2 failed");
+
+    stream_ready = true;
+
+    static const uint8_t SIGNATURE[8] = {137, 'P', 'N', 'G', '\r', '\n', 26, '\n'};
+
+    if (fwrite(SIGNATURE, 1, sizeof(SIGNATURE), fp) != sizeof(SIGNATURE))
+        throw std::runtime_error("Failed to write PNG file");
+
+    uint8_t ihdr[13];
+    put_u32(ihdr, header.width);
+    put_u32(ihdr + 4, header.height);
+    ihdr[8] = (uint8_t) header.bit_depth;
+    ihdr[9] = (uint8_t) header.color_type;
+    ihdr[10] = 0; //Deflate
+    ihdr[11] = 0; //Adaptive filtering
+    ihdr[12] = 0; //No interlace
+
+    write_chunk("IHDR", ihdr, sizeof(ihdr));
+
+    // zlib header: 32K window, default compression level
+    idat.data()[0] = 0x78;
+    idat.data()[1] = 0x9c;
+    idat_fill = 2;
+}
+
+PngEncoder::~PngEncoder()
+{
+    if (stream_ready)
+        deflateEnd(&stream);
+}
+
+void PngEncoder::write_chunk(const char *type, const uint8_t *data, size_t size)
+{
+    uint8_t head[8];
+    uint8_t tail[4];
+
+    put_u32(head, (uint32_t) size);
+    memcpy(head + 4, type, 4);
+
+    uint32_t crc = checksum::crc32(0, head + 4, 4);
+    crc = checksum::crc32(crc, data, size);
+    put_u32(tail, crc);
+
+    if (fwrite(head, 1, sizeof(head), fp) != sizeof(head) ||
+        (size > 0 && fwrite(data, 1, size, fp) != size) ||
+        fwrite(tail, 1, sizeof(tail), fp) != sizeof(tail))
+        throw std::runtime_error("Failed to write PNG file");
+}
+
+void PngEncoder::write_srgb(int intent)
+{
+    uint8_t data = (uint8_t) intent;
+
+    write_chunk("sRGB", &data, 1);
+}
+
+void PngEncoder::write_iccp(const char *name, const uint8_t *profile, size_t size)
+{
+    // Keyword, null separator and compression method, then the zlib stream
+    size_t name_size = strnlen(name, 79);
+    uLongf compressed_size = compressBound((uLong) size);
+    std::vector<uint8_t> data(name_size + 2 + compressed_size);
+
+    memcpy(data.data(), name, name_size);
+    data[name_size] = 0;
+    data[name_size + 1] = 0;
+
+    if (compress2(data.data() + name_size + 2, &compressed_size, profile, (uLong) size,
+                  Z_DEFAULT_COMPRESSION) != Z_OK)
+        throw std::runtime_error("Failed to compress ICC profile");
+
+    write_chunk("iCCP", data.data(), name_size + 2 + compressed_size);
+}
+
+void PngEncoder::flush_idat()
+{
+    write_chunk("IDAT", idat.data(), idat_fill);
+    idat_fill = 0;
+}
+
+void PngEncoder::compress(const uint8_t *data, size_t size, int flush)
+{
+    stream.next_in = (Bytef *) data;
+    stream.avail_in = (uInt) size;
+
+    for (;;) {
+        stream.next_out = idat.data() + idat_fill;
+        stream.avail_out = (uInt) (idat.size() - idat_fill);
+
+        int status = deflate(&stream, flush);
+
+        if (status == Z_STREAM_ERROR)
+            throw std::runtime_error("deflate failed");
+
+        idat_fill = idat.size() - stream.avail_out;
+
+        if (idat_fill == idat.size())
+            flush_idat();
+        else if (flush == Z_FINISH ? status == Z_STREAM_END : stream.avail_in == 0)
+            break;
+    }
+}
+
+void PngEncoder::write_row(const uint8_t *row)
+{
+    // Try each filter and keep the one with the lowest cost, the same
+    // heuristic libpng uses
+    best[0] = 0;
+    memcpy(best.data() + 1, row, row_size);
+
+    if (filter_rows) {
+        uint32_t best_cost = kernel.filter_cost(best.data() + 1, row_size);
+        //Up, Average and Paeth need the row before
+        int last_type = prev_known ? 4 : 1;
+
+        for (int type = 1; type <= last_type; type++) {
+            candidate[0] = (uint8_t) type;
+            kernel.png_filter(type, row, prev.data(), candidate.data() + 1, row_size, bpp);
+
+            uint32_t cost = kernel.filter_cost(candidate.data() + 1, row_size);
+
+            if (cost < best_cost) {
+                best_cost = cost;
+                best.swap(candidate);
+            }
+        }
+
+        memcpy(prev.data(), row, row_size);
+        prev_known = true;
+    }
+
+    stage(best.data(), best.size());
+}
+
+void PngEncoder::write_rows(const uint8_t *const *rows, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++)
+        write_row(rows[i]);
+}
+
+void PngEncoder::write_filtered_rows(int type, const uint8_t *const *rows, uint32_t count)
+{
+    uint8_t type_byte = (uint8_t) type;
+
+    for (uint32_t i = 0; i < count; i++) {
+        stage(&type_byte, 1);
+        stage(rows[i], row_size);
+    }
+
+    if (count > 0)
+        prev_known = false;
+}
+
+// Stages filtered data, handing full buffers to deflate
+void PngEncoder::stage(const uint8_t *data, size_t size)
+{
+    while (size > 0) {
+        size_t n = std::min(size, input.size() - input_fill);
+
+        memcpy(input.data() + input_fill, data, n);
+        input_fill += n;
+        data += n;
+        size -= n;
+
+        if (input_fill == input.size())
+            flush_input(Z_NO_FLUSH);
+    }
+}
+
+void PngEncoder::flush_input(int flush)
+{
+    adler = checksum::adler32(adler, input.data(), input_fill);
+    compress(input.data(), input_fill, flush);
+    input_fill = 0;
+}
+
+void PngEncoder::finish()
+{
+    flush_input(Z_FINISH);
+
+    // zlib trailer
+    if (idat.size() - idat_fill < 4)
+        flush_idat();
+
+    put_u32(idat.data() + idat_fill, adler);
+    idat_fill += 4;
+
+    flush_idat();
+    write_chunk("IEND", nullptr, 0);
+}
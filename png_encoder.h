@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+#include <zlib.h>
+
+#include "buffer.h"
+#include "kernels.h"
+
+// Image header fields of a PNG
+struct PngHeader
+{
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t bit_depth = 8;
+    //One of the PNG_COLOR_TYPE_* values
+    int color_type = 0;
+};
+
+// A PNG writer that filters rows, computes checksums and frames the
+// chunks itself, with the SIMD kernels. zlib is only used for raw deflate.
+// Images are written without interlacing.
+class PngEncoder
+{
+public:
+    //Default chunk and buffer sizes, the same as libpng's
+    static constexpr size_t DEFAULT_IDAT_SIZE = 8192;
+    static constexpr size_t DEFAULT_ZBUF_SIZE = 8192;
+
+    // Writes the PNG signature and the IHDR chunk. idat_size is the size
+    // of the IDAT chunks. Filtered rows are collected in a buffer of
+    // zbuf_size bytes before each call to deflate.
+    PngEncoder(FILE *fp, const PngHeader &header,
+               size_t idat_size = DEFAULT_IDAT_SIZE, size_t zbuf_size = DEFAULT_ZBUF_SIZE);
+    ~PngEncoder();
+
+    PngEncoder(const PngEncoder &) = delete;
+    PngEncoder &operator=(const PngEncoder &) = delete;
+
+    // Ancillary chunks have to be written before the first row
+    void write_srgb(int intent);
+    void write_iccp(const char *name, const uint8_t *profile, size_t size);
+
+    // Rows are in PNG layout: packed samples, 16-bit samples big-endian
+    void write_row(const uint8_t *row);
+    void write_rows(const uint8_t *const *rows, uint32_t count);
+
+    // Writes rows that are already filtered with the given filter type,
+    // skipping the filter search. The rows after them can't be filtered
+    // against an unknown previous row, so the next row written with
+    // write_row only tries the filters that don't use it.
+    void write_filtered_rows(int type, const uint8_t *const *rows, uint32_t count);
+
+    // Writes the rest of the image data and the IEND chunk
+    void finish();
+
+private:
+    void write_chunk(const char *type, const uint8_t *data, size_t size);
+    void stage(const uint8_t *data, size_t size);
+    void compress(const uint8_t *data, size_t size, int flush);
+    void flush_input(int flush);
+    void flush_idat();
+
+    FILE *fp;
+    const KernelTable &kernel;
+    size_t row_size;
+    size_t bpp;
+    bool filter_rows;
+
+    z_stream stream{};
+    bool stream_ready = false;
+    //Adler-32 of the uncompressed stream, written after the deflate data
+    uint32_t adler = 1;
+
+    //Previous unfiltered row, zeros before the first row
+    std::vector<uint8_t> prev;
+    //Whether prev holds the row before, which it doesn't after filtered rows
+    bool prev_known = true;
+    //Filter type byte followed by the filtered row
+    std::vector<uint8_t> best;
+    std::vector<uint8_t> candidate;
+
+    //Filtered rows waiting for deflate. This and the IDAT buffer can be
+    //megabytes, so they may be backed by huge pages.
+    AlignedBuffer input;
+    size_t input_fill = 0;
+
+    //Pending IDAT data
+    AlignedBuffer idat;
+    size_t idat_fill = 0;
+};
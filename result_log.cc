@@ -0,0 +1,245 @@
+#include "result_log.h"
+
+#include <chrono>
+
+//How often the writer looks for new records
+static const std::chrono::milliseconds FLUSH_INTERVAL(200);
+
+// Length of the well-formed UTF-8 sequence at the start of s, or 0 if
+// there isn't one. Overlong forms, surrogates and code points past
+// U+10FFFF are not well-formed.
+static size_t utf8_length(const unsigned char *s, size_t size)
+{
+    unsigned char c = s[0];
+    //Range of the second byte
+    unsigned char low = 0x80, high = 0xbf;
+    size_t length;
+
+    if (c < 0x80)
+        return 1;
+
+    if (c >= 0xc2 && c <= 0xdf) {
+        length = 2;
+    } else if (c >= 0xe0 && c <= 0xef) {
+        length = 3;
+        low = c == 0xe0 ? 0xa0 : 0x80;
+        high = c == 0xed ? 0x9f : 0xbf;
+    } else if (c >= 0xf0 && c <= 0xf4) {
+        length = 4;
+        low = c == 0xf0 ? 0x90 : 0x80;
+        high = c == 0xf4 ? 0x8f : 0xbf;
+    } else {
+        return 0;
+    }
+
+    if (size < length || s[1] < low || s[1] > high)
+        return 0;
+
+    for (size_t i = 2; i < length; i++) {
+        if ((s[i] & 0xc0) != 0x80)
+            return 0;
+    }
+
+    return length;
+}
+
+// Quotes a string for JSON. File names can hold any byte but NUL, and JSON
+// has to be UTF-8, so control characters are escaped, each byte that isn't
+// part of a well-formed UTF-8 sequence becomes U+FFFD, and everything else
+// is passed through.
+static void append_string(std::string &out, const std::string &value)
+{
+    const unsigned char *s = (const unsigned char *) value.data();
+    size_t size = value.size();
+
+    out += '"';
+
+    for (size_t i = 0; i < size;) {
+        unsigned char c = s[i];
+        size_t length = utf8_length(s + i, size - i);
+
+        if (length == 0) {
+            out += "\\ufffd";
+            i++;
+
+            continue;
+        }
+
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += (char) c;
+        } else if (c == '\n') {
+            out += "\\n";
+        } else if (c < 0x20) {
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\u%04x", c);
+            out += escape;
+        } else {
+            out.append(value, i, length);
+        }
+
+        i += length;
+    }
+
+    out += '"';
+}
+
+static void append_field(std::string &out, const char *name, uint64_t value)
+{
+    out += ",\"";
+    out += name;
+    out += "\":";
+    out += std::to_string(value);
+}
+
+static void append_strings(std::string &out, const char *name, const std::vector<std::string> &values)
+{
+    out += ",\"";
+    out += name;
+    out += "\":[";
+
+    for (size_t i = 0; i < values.size(); i++) {
+        if (i)
+            out += ',';
+
+        append_string(out, values[i]);
+    }
+
+    out += ']';
+}
+
+static std::string format(const FileResult &result)
+{
+    std::string line = "{\"file\":";
+    append_string(line, result.file);
+    line += ",\"output\":";
+    append_string(line, result.output);
+    line += result.converted ? ",\"status\":\"converted\"" : ",\"status\":\"failed\"";
+
+    if (!result.converted) {
+        line += ",\"error\":\"";
+        line += failure_name(result.failure);
+        line += "\",\"message\":";
+        append_string(line, result.message);
+    }
+
+    append_field(line, "width", result.width);
+    append_field(line, "height", result.height);
+    append_field(line, "bps", result.bps);
+    append_field(line, "spp", result.spp);
+    append_field(line, "compression", result.compression);
+    append_field(line, "input_bytes", result.bytes_read);
+    append_field(line, "output_bytes", result.bytes_written);
+    append_field(line, "decode_us", result.times.nanoseconds(Stage::Decode) / 1000);
+    append_field(line, "process_us", result.times.nanoseconds(Stage::Process) / 1000);
+    append_field(line, "encode_us", result.times.nanoseconds(Stage::Encode) / 1000);
+    append_field(line, "total_us", result.nanoseconds / 1000);
+    append_field(line, "memory_estimate_bytes", result.memory_estimate);
+    append_field(line, "memory_peak_bytes", result.memory_peak);
+
+    if (result.times.counts_events()) {
+        line += ",\"events\":{";
+
+        for (size_t stage = 0; stage <= (size_t) Stage::Encode; stage++) {
+            line += stage ? ",\"" : "\"";
+            line += stage_name((Stage) stage);
+            line += "\":{";
+
+            for (size_t event = 0; event < PERF_EVENTS; event++) {
+                line += event ? ",\"" : "\"";
+                line += perf_event_name((PerfEvent) event);
+                line += "\":";
+                line += std::to_string(result.times.count((Stage) stage, (PerfEvent) event));
+            }
+
+            line += '}';
+        }
+
+        line += '}';
+    }
+
+    append_strings(line, "warnings", result.diagnostics.warnings);
+    append_strings(line, "errors", result.diagnostics.errors);
+
+    if (result.diagnostics.dropped)
+        append_field(line, "dropped_messages", result.diagnostics.dropped);
+
+    line += "}\n";
+
+    return line;
+}
+
+std::unique_ptr<ResultLog> ResultLog::open(const std::string &path)
+{
+    FILE *file = fopen(path.c_str(), "a");
+
+    if (!file)
+        return nullptr;
+
+    return std::unique_ptr<ResultLog>(new ResultLog(file));
+}
+
+ResultLog::ResultLog(FILE *file)
+    : file(file), thread(&ResultLog::watch, this)
+{
+}
+
+ResultLog::~ResultLog()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+
+    stop_requested.notify_all();
+    thread.join();
+
+    flush();
+    fclose(file);
+}
+
+void ResultLog::write(const FileResult &result)
+{
+    Record *record = new Record;
+    record->line = format(result);
+    record->next = pending.load(std::memory_order_relaxed);
+
+    while (!pending.compare_exchange_weak(record->next, record, std::memory_order_release,
+                                          std::memory_order_relaxed))
+        ;
+}
+
+void ResultLog::watch()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+
+    while (!stop_requested.wait_for(lock, FLUSH_INTERVAL, [this] { return stopping; }))
+        flush();
+}
+
+void ResultLog::flush()
+{
+    // The writer takes the whole list at once, so pushes never race with
+    // removals. The list is newest first.
+    Record *records = pending.exchange(nullptr, std::memory_order_acquire);
+    Record *oldest = nullptr;
+
+    while (records) {
+        Record *next = records->next;
+        records->next = oldest;
+        oldest = records;
+        records = next;
+    }
+
+    if (!oldest)
+        return;
+
+    while (oldest) {
+        Record *next = oldest->next;
+        fwrite(oldest->line.data(), 1, oldest->line.size(), file);
+        delete oldest;
+        oldest = next;
+    }
+
+    fflush(file);
+}
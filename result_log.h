@@ -0,0 +1,82 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "diagnostics.h"
+#include "metrics.h"
+
+// What happened to one input file
+struct FileResult
+{
+    std::string file;
+    std::string output;
+    bool converted = false;
+    //Why it failed, and the message that was printed
+    Failure failure = Failure::Other;
+    std::string message;
+    Diagnostics diagnostics;
+
+    //As stored in the TIFF, 0 when they couldn't be read
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t bps = 0;
+    uint32_t spp = 0;
+    uint16_t compression = 0;
+
+    uint64_t bytes_read = 0;
+    uint64_t bytes_written = 0;
+
+    StageTimes times;
+    uint64_t nanoseconds = 0;
+
+    //Memory the conversion was expected to need, and the most it had
+    //allocated at once
+    uint64_t memory_estimate = 0;
+    uint64_t memory_peak = 0;
+};
+
+// Appends one JSON object per file to a log (JSON Lines). Workers format
+// their record and push it onto a lock-free list, so they never wait for
+// each other or for the disk. A writer thread takes the whole list a few
+// times a second and writes it out in the order it was pushed.
+class ResultLog
+{
+public:
+    // nullptr if the file can't be opened
+    static std::unique_ptr<ResultLog> open(const std::string &path);
+
+    ~ResultLog();
+
+    ResultLog(const ResultLog &) = delete;
+    ResultLog &operator=(const ResultLog &) = delete;
+
+    // Can be called from any thread
+    void write(const FileResult &result);
+
+private:
+    struct Record
+    {
+        std::string line;
+        Record *next = nullptr;
+    };
+
+    explicit ResultLog(FILE *file);
+
+    void watch();
+    void flush();
+
+    FILE *file;
+    std::atomic<Record *> pending{nullptr};
+
+    std::mutex mutex;
+    std::condition_variable stop_requested;
+    bool stopping = false;
+    std::thread thread;
+};
@@ -0,0 +1,147 @@
+#include "synthetic.h"
+
+#include <algorithm>
+#include <cstring>
+#include <random>
+
+std::vector<uint8_t> gradient_pixels(const SyntheticImage &image, uint32_t seed)
+{
+    std::mt19937 random(seed);
+    size_t samples = (size_t) image.width * image.spp;
+    std::vector<uint8_t> pixels(image.row_size() * image.height, 0);
+
+    for (uint32_t y = 0; y < image.height; y++) {
+        uint8_t *row = &pixels[y * image.row_size()];
+
+        for (size_t i = 0; i < samples; i++) {
+            uint32_t x = (uint32_t) (i / image.spp);
+            uint32_t c = (uint32_t) (i % image.spp);
+
+            // A gradient in 16-bit units, different for each channel
+            uint32_t v = (x * 65535u / image.width * (c + 1) + y * 65535u / image.height * (3 - c % 3)) / 4;
+            v = (v + (random() & 0x3ff)) & 0xffff;
+
+            if (image.bps == 16) {
+                row[i * 2] = (uint8_t) (v >> 8);
+                row[i * 2 + 1] = (uint8_t) v;
+            } else {
+                size_t bit = i * image.bps;
+                row[bit / 8] |= (uint8_t) (v >> (16 - image.bps) << (8 - image.bps - bit % 8));
+            }
+        }
+    }
+
+    return pixels;
+}
+
+// Copies bytes of big-endian 16-bit samples, or of any other depth, into
+// out in the machine's byte order, which is what libtiff takes
+static void to_native(const uint8_t *in, uint8_t *out, size_t size, uint16_t bps)
+{
+    if (bps != 16) {
+        memcpy(out, in, size);
+
+        return;
+    }
+
+    for (size_t i = 0; i + 1 < size; i += 2) {
+        uint16_t v = (uint16_t) (in[i] << 8 | in[i + 1]);
+        memcpy(out + i, &v, 2);
+    }
+}
+
+static bool write_strips(TIFF *tif, const SyntheticImage &image, const std::vector<uint8_t> &pixels)
+{
+    std::vector<uint8_t> row(image.row_size());
+
+    for (uint32_t y = 0; y < image.height; y++) {
+        to_native(&pixels[y * row.size()], row.data(), row.size(), image.bps);
+
+        if (TIFFWriteScanline(tif, row.data(), y, 0) < 0)
+            return false;
+    }
+
+    return true;
+}
+
+// Tiles past the right and bottom edges are padded by repeating the last
+// column and row, as encoders usually do
+static bool write_tiles(TIFF *tif, const SyntheticImage &image, const std::vector<uint8_t> &pixels)
+{
+    size_t pixel_size = (size_t) image.spp * image.bps / 8;
+    size_t tile_row = image.tile_width * pixel_size;
+    std::vector<uint8_t> tile(tile_row * image.tile_length);
+
+    for (uint32_t ty = 0; ty < image.height; ty += image.tile_length) {
+        for (uint32_t tx = 0; tx < image.width; tx += image.tile_width) {
+            for (uint32_t y = 0; y < image.tile_length; y++) {
+                uint32_t source_y = std::min(ty + y, image.height - 1);
+
+                for (uint32_t x = 0; x < image.tile_width; x++) {
+                    uint32_t source_x = std::min(tx + x, image.width - 1);
+
+                    to_native(&pixels[source_y * image.row_size() + source_x * pixel_size],
+                              &tile[y * tile_row + x * pixel_size], pixel_size, image.bps);
+                }
+            }
+
+            if (TIFFWriteTile(tif, tile.data(), tx, ty, 0, 0) < 0)
+                return false;
+        }
+    }
+
+    return true;
+}
+
+bool write_synthetic_tiff(const SyntheticImage &image, const std::vector<uint8_t> &pixels,
+                          const std::string &path)
+{
+    TIFF *tif = TIFFOpen(path.c_str(), image.big_endian ? "wb" : "wl");
+
+    if (!tif)
+        return false;
+
+    bool jpeg = image.compression == COMPRESSION_JPEG;
+    uint16_t photometric = image.spp < 3 ? PHOTOMETRIC_MINISBLACK
+                         : jpeg && image.spp == 3 ? PHOTOMETRIC_YCBCR : PHOTOMETRIC_RGB;
+
+    TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, image.width);
+    TIFFSetField(tif, TIFFTAG_IMAGELENGTH, image.height);
+    TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, image.bps);
+    TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, image.spp);
+    TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, photometric);
+    TIFFSetField(tif, TIFFTAG_COMPRESSION, image.compression);
+    TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+
+    if (image.tile_width) {
+        TIFFSetField(tif, TIFFTAG_TILEWIDTH, image.tile_width);
+        TIFFSetField(tif, TIFFTAG_TILELENGTH, image.tile_length);
+    } else {
+        TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, image.rows_per_strip ? image.rows_per_strip : image.height);
+    }
+
+    if (image.predictor != PREDICTOR_NONE)
+        TIFFSetField(tif, TIFFTAG_PREDICTOR, image.predictor);
+
+    if (jpeg) {
+        TIFFSetField(tif, TIFFTAG_JPEGQUALITY, 90);
+
+        //libtiff converts the RGB rows to YCbCr
+        if (photometric == PHOTOMETRIC_YCBCR)
+            TIFFSetField(tif, TIFFTAG_JPEGCOLORMODE, JPEGCOLORMODE_RGB);
+    }
+
+    if (image.spp == 2 || image.spp == 4) {
+        uint16_t extra = 2; //Unassociated alpha
+        TIFFSetField(tif, TIFFTAG_EXTRASAMPLES, 1, &extra);
+    }
+
+    if (!image.icc_profile.empty())
+        TIFFSetField(tif, TIFFTAG_ICCPROFILE, (uint32_t) image.icc_profile.size(), image.icc_profile.data());
+
+    bool ok = image.tile_width ? write_tiles(tif, image, pixels) : write_strips(tif, image, pixels);
+
+    TIFFClose(tif);
+
+    return ok;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <tiffio.h>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+// The layout of a synthetic TIFF, as written by the benchmark corpus,
+// --calibrate and the tests. Images with 3 or more samples are RGB, with
+// the 4th as alpha, and the others gray, with the 2nd as alpha. JPEG
+// images with 3 samples are stored as YCbCr.
+struct SyntheticImage
+{
+    SyntheticImage() = default;
+
+    // The fields in order, the trailing ones defaulting as below
+    SyntheticImage(uint32_t width, uint32_t height, uint16_t bps, uint16_t spp,
+                   uint16_t compression, uint16_t predictor, uint32_t rows_per_strip = 0,
+                   bool big_endian = false, uint32_t tile_width = 0, uint32_t tile_length = 0,
+                   std::vector<uint8_t> icc_profile = {})
+        : width(width), height(height), bps(bps), spp(spp), compression(compression),
+          predictor(predictor), rows_per_strip(rows_per_strip), big_endian(big_endian),
+          tile_width(tile_width), tile_length(tile_length), icc_profile(std::move(icc_profile))
+    {
+    }
+
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint16_t bps = 8;
+    uint16_t spp = 1;
+    uint16_t compression = COMPRESSION_NONE;
+    uint16_t predictor = PREDICTOR_NONE;
+    //0 for the whole image in one strip
+    uint32_t rows_per_strip = 0;
+    bool big_endian = false;
+    //Tiles of this size instead of strips, if not 0. Needs 8 or 16 bits.
+    uint32_t tile_width = 0;
+    uint32_t tile_length = 0;
+    //Written as the ICC profile tag if not empty
+    std::vector<uint8_t> icc_profile;
+
+    //Bytes in a row of pixels, packed from the high bit below 8 bits
+    size_t row_size() const { return ((size_t) width * spp * bps + 7) / 8; }
+};
+
+// Smooth gradients with a little noise, different for each channel, which
+// compress roughly like photographs. The samples are laid out as PNG
+// stores them: rows packed from the high bit below 8 bits, and 16-bit
+// samples big-endian.
+std::vector<uint8_t> gradient_pixels(const SyntheticImage &image, uint32_t seed);
+
+// Writes pixels, laid out as gradient_pixels() returns them, as a TIFF.
+// False if libtiff fails.
+bool write_synthetic_tiff(const SyntheticImage &image, const std::vector<uint8_t> &pixels,
+                          const std::string &path);
@@ -0,0 +1,822 @@
+// Converts a matrix of synthetic TIFFs with the reference path and with
+// every fast path of tiff-png, and checks that all of them give the same
+// pixels.
+//
+// The reference is libtiff's decoders, libpng's writer and the first SIMD
+// variant, one file at a time. The fast paths are our own strip decoders,
+// the custom encoder with and without predictor reuse, tiny IDAT and zlib
+// buffers, parallel workers, row-by-row conversion of strips too large for
+// a band, and every SIMD variant the CPU supports. Each is run with every
+// output depth and dither mode, and the PNGs are decoded with libpng and
+// compared byte for byte. The reference itself is checked against the
+// pixels that were written to the TIFFs, where they can be predicted.
+//
+// The TIFFs cover each bit depth and sample layout the converter supports,
+// each compression with and without the horizontal predictor, both byte
+// orders, and awkward sizes: width 1, odd widths and one-row strips. Cases
+// with random sizes and layouts are added on top.
+//
+// JPEG strips and tiles, gray and YCbCr, check our libjpeg reader at full
+// size. Strips are compared with libtiff's decoding through the reference
+// path. The reference reads tiles a row at a time, which libtiff can't do,
+// so tiles are compared with whole tiles decoded by libtiff in this test,
+// and every conversion through --codecs libtiff must fail on them.
+// RGB cases with an embedded matrix/TRC profile check the conversion to
+// sRGB against the profile's transform worked out for each pixel, within
+// the error the lookup table's interpolation allows.
+
+#include <png.h>
+#include <sys/wait.h>
+#include <tiffio.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "../icc.h"
+#include "../kernels.h"
+#include "../synthetic.h"
+
+namespace fs = std::filesystem;
+
+//Failures printed in full; the rest are only counted
+static const int MAX_REPORTED = 20;
+
+// Steps of the output depth by which ICC cases may miss the profile's
+// transform, beyond how much it changes across the pixel's grid cell
+static const double ICC_TOLERANCE = 1;
+
+struct Layout
+{
+    uint16_t bps;
+    uint16_t spp;
+};
+
+static const Layout LAYOUTS[] = {
+    {1, 1}, {2, 1}, {4, 1}, {8, 1}, {8, 2}, {8, 3}, {8, 4}, {16, 1}, {16, 2}, {16, 3}, {16, 4}
+};
+
+struct Compression
+{
+    uint16_t compression;
+    uint16_t predictor;
+};
+
+static const Compression COMPRESSIONS[] = {
+    {COMPRESSION_NONE, PREDICTOR_NONE},
+    {COMPRESSION_PACKBITS, PREDICTOR_NONE},
+    {COMPRESSION_LZW, PREDICTOR_NONE},
+    {COMPRESSION_LZW, PREDICTOR_HORIZONTAL},
+    {COMPRESSION_ADOBE_DEFLATE, PREDICTOR_NONE},
+    {COMPRESSION_ADOBE_DEFLATE, PREDICTOR_HORIZONTAL},
+};
+
+// Width, height and rows per strip, cycled through the matrix so that each
+// layout meets several of them
+static const uint32_t SIZES[][3] = {
+    {1, 1, 1}, {1, 37, 1}, {3, 5, 2}, {7, 16, 16}, {17, 9, 4},
+    {63, 33, 7}, {64, 64, 64}, {65, 20, 1}, {255, 13, 5}, {1001, 7, 3},
+};
+
+// Options that change the output. Each fast path is compared with the
+// reference run with the same ones.
+static const char *const OUTPUT_OPTIONS[] = {
+    "",
+    "--depth 8 --dither truncate",
+    "--depth 8 --dither round",
+    "--depth 8 --dither ordered",
+    "--depth 8 --dither diffuse",
+};
+
+static const char *const FAST_PATHS[] = {
+    "",
+    "--encoder custom",
+    "--encoder custom --reuse-predictor",
+    "--encoder custom --idat-size 64 --zbuf-size 64",
+    "--encoder libpng --zbuf-size 64",
+    "--codecs verify --encoder custom",
+    "--codecs libtiff --encoder custom",
+    "--jobs 8 --encoder custom",
+    //Bands of 256K, so the larger strips go row by row
+    "--memory-limit 1M",
+    "--hugepages transparent --encoder custom",
+};
+
+struct Image
+{
+    uint32_t width = 0;
+    uint32_t height = 0;
+    int bit_depth = 0;
+    int color_type = 0;
+    std::vector<uint8_t> pixels;
+};
+
+struct Case
+{
+    std::string name;
+    SyntheticImage image;
+    //The samples as PNG stores them: packed from the high bit, 16-bit big-endian
+    std::vector<uint8_t> pixels;
+    //libtiff's decoding of JPEG cases, which don't keep the pixels written
+    Image decoded;
+};
+
+static std::string describe(const Case &test_case)
+{
+    static const char *const SPP_NAMES[5] = {"", "gray", "gray+alpha", "rgb", "rgba"};
+    const SyntheticImage &c = test_case.image;
+
+    std::string name = SPP_NAMES[c.spp] + std::to_string(c.bps) + " ";
+
+    switch (c.compression) {
+    case COMPRESSION_NONE: name += "none"; break;
+    case COMPRESSION_PACKBITS: name += "packbits"; break;
+    case COMPRESSION_LZW: name += "lzw"; break;
+    case COMPRESSION_JPEG: name += "jpeg"; break;
+    default: name += "deflate"; break;
+    }
+
+    if (c.predictor == PREDICTOR_HORIZONTAL)
+        name += "+predictor";
+
+    if (!c.icc_profile.empty())
+        name += "+icc";
+
+    name += (c.big_endian ? " big-endian " : " little-endian ") + std::to_string(c.width) + "x" +
+            std::to_string(c.height) + ", ";
+
+    if (c.tile_width)
+        return name + std::to_string(c.tile_width) + "x" + std::to_string(c.tile_length) + " tiles";
+
+    return name + std::to_string(c.rows_per_strip) + " rows per strip";
+}
+
+// Rows of several kinds, so that every filter and the run-length coders
+// all get something to do: smooth gradients with noise, constant rows,
+// noise and long runs
+static std::vector<uint8_t> fill(const SyntheticImage &c, std::mt19937 &random)
+{
+    size_t samples = (size_t) c.width * c.spp;
+    uint32_t max = (1u << c.bps) - 1;
+    std::vector<uint8_t> pixels(c.row_size() * c.height, 0);
+
+    for (uint32_t y = 0; y < c.height; y++) {
+        uint8_t *row = &pixels[y * c.row_size()];
+        uint32_t kind = random() % 4;
+        uint32_t constant = random() & max;
+
+        for (size_t i = 0; i < samples; i++) {
+            uint32_t v;
+
+            if (kind == 0)
+                v = (uint32_t) ((i * 65535 / samples + y * 257 + (random() & 0xff)) >> (16 - c.bps));
+            else if (kind == 1)
+                v = constant;
+            else if (kind == 2)
+                v = random();
+            else
+                v = (uint32_t) (i / 13) * 7919 + constant;
+
+            v &= max;
+
+            if (c.bps == 16) {
+                row[i * 2] = (uint8_t) (v >> 8);
+                row[i * 2 + 1] = (uint8_t) v;
+            } else {
+                size_t bit = i * c.bps;
+                row[bit / 8] |= (uint8_t) (v << (8 - c.bps - bit % 8));
+            }
+        }
+    }
+
+    return pixels;
+}
+
+// Primaries and gamma of the profile embedded in the ICC cases, as the
+// profile stores them: s15.16 and 8.8 fixed point
+static const int32_t ICC_PRIMARIES[3][3] = {
+    {39958, 20388, 1278}, {13455, 41006, 3991}, {9778, 4142, 48798}
+};
+static const uint16_t ICC_GAMMA = 563;
+
+static void put_u32(std::vector<uint8_t> &out, size_t at, uint32_t v)
+{
+    out[at] = (uint8_t) (v >> 24);
+    out[at + 1] = (uint8_t) (v >> 16);
+    out[at + 2] = (uint8_t) (v >> 8);
+    out[at + 3] = (uint8_t) v;
+}
+
+// A matrix/TRC profile with Adobe RGB-like primaries and gamma 2.2 curves
+static std::vector<uint8_t> icc_profile()
+{
+    static const char *const TAGS[6] = {"rXYZ", "gXYZ", "bXYZ", "rTRC", "gTRC", "bTRC"};
+
+    std::vector<uint8_t> profile(132 + 6 * 12 + 3 * 20 + 3 * 14, 0);
+    size_t offset = 132 + 6 * 12;
+
+    memcpy(&profile[16], "RGB ", 4);
+    memcpy(&profile[20], "XYZ ", 4);
+    put_u32(profile, 128, 6);
+
+    for (int t = 0; t < 6; t++) {
+        size_t size = t < 3 ? 20 : 14;
+        size_t entry = 132 + t * 12;
+
+        memcpy(&profile[entry], TAGS[t], 4);
+        put_u32(profile, entry + 4, (uint32_t) offset);
+        put_u32(profile, entry + 8, (uint32_t) size);
+
+        if (t < 3) {
+            memcpy(&profile[offset], "XYZ ", 4);
+
+            for (int i = 0; i < 3; i++)
+                put_u32(profile, offset + 8 + i * 4, (uint32_t) ICC_PRIMARIES[t][i]);
+        } else {
+            memcpy(&profile[offset], "curv", 4);
+            put_u32(profile, offset + 8, 1);
+            profile[offset + 12] = (uint8_t) (ICC_GAMMA >> 8);
+            profile[offset + 13] = (uint8_t) ICC_GAMMA;
+        }
+
+        offset += size;
+    }
+
+    return profile;
+}
+
+// The profile's transform, in two halves: a device value from 0 to 1
+// through the gamma curve to linear light, and linear light through the
+// profile's matrix, the Bradford-adapted matrix from the D50 connection
+// space to linear sRGB, and the sRGB curve
+static double device_to_linear(double v)
+{
+    return std::pow(v, ICC_GAMMA / 256.0);
+}
+
+static double linear_to_srgb(const double m[3][3], int channel, const double linear[3])
+{
+    const double *row = m[channel];
+    double v = std::clamp(row[0] * linear[0] + row[1] * linear[1] + row[2] * linear[2], 0.0, 1.0);
+
+    return v <= 0.0031308 ? v * 12.92 : 1.055 * std::pow(v, 1 / 2.4) - 0.055;
+}
+
+// Checks the output of an ICC case against the profile's transform, worked
+// out for each pixel without a lookup table. The converter interpolates
+// between the nodes of a ColorLut grid, so a sample may be off by as much
+// as the transform changes across the grid cell around the pixel, plus
+// ICC_TOLERANCE. That is under a step in most of the gamut, and up to
+// about 20 8-bit steps next to its edge, where the transform clips and the
+// sRGB curve is steep.
+static std::string compare_with_transform(const Case &test_case, const Image &actual)
+{
+    static const double XYZ_TO_SRGB[3][3] = {
+        { 3.1338561, -1.6168667, -0.4906146},
+        {-0.9787684,  1.9161415,  0.0334540},
+        { 0.0719453, -0.2289914,  1.4052427}
+    };
+
+    const SyntheticImage &c = test_case.image;
+
+    if (actual.pixels.size() != test_case.pixels.size() || actual.bit_depth != c.bps)
+        return "bit depth " + std::to_string(actual.bit_depth) + " or size differs";
+
+    double m[3][3];
+
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            m[i][j] = 0;
+
+            for (int k = 0; k < 3; k++)
+                m[i][j] += XYZ_TO_SRGB[i][k] * ICC_PRIMARIES[j][k] / 65536.0;
+        }
+    }
+
+    const uint32_t cells = ColorLut::GRID - 1;
+    double max = (1u << c.bps) - 1;
+    size_t sample_size = c.bps / 8;
+    size_t pixel_size = c.spp * sample_size;
+
+    auto sample = [&](const std::vector<uint8_t> &pixels, size_t i) {
+        return sample_size == 2 ? (uint32_t) (pixels[i] << 8 | pixels[i + 1]) : pixels[i];
+    };
+
+    for (size_t i = 0; i < test_case.pixels.size(); i += pixel_size) {
+        double linear[3], corners[3][2];
+
+        for (int k = 0; k < 3; k++) {
+            uint32_t v16 = sample(test_case.pixels, i + k * sample_size) * (sample_size == 2 ? 1 : 257);
+            uint32_t cell = std::min(v16 * cells / 65535, cells - 1);
+
+            linear[k] = device_to_linear(v16 / 65535.0);
+            corners[k][0] = device_to_linear((double) cell / cells);
+            corners[k][1] = device_to_linear((double) (cell + 1) / cells);
+        }
+
+        for (int k = 0; k < 3; k++) {
+            double low = max, high = 0;
+
+            for (int corner = 0; corner < 8; corner++) {
+                const double at[3] = {corners[0][corner & 1], corners[1][corner >> 1 & 1], corners[2][corner >> 2]};
+                double v = linear_to_srgb(m, k, at) * max;
+
+                low = std::min(low, v);
+                high = std::max(high, v);
+            }
+
+            double expected = linear_to_srgb(m, k, linear) * max;
+            uint32_t value = sample(actual.pixels, i + k * sample_size);
+
+            if (std::abs(value - expected) > high - low + ICC_TOLERANCE) {
+                char message[128];
+                snprintf(message, sizeof(message), "pixel %zu channel %d is %u, expected %.1f within %.1f",
+                         i / pixel_size, k, value, expected, high - low + ICC_TOLERANCE);
+
+                return message;
+            }
+        }
+
+        for (size_t a = 3 * sample_size; a < pixel_size; a++) {
+            if (actual.pixels[i + a] != test_case.pixels[i + a])
+                return "alpha of pixel " + std::to_string(i / pixel_size) + " changed";
+        }
+    }
+
+    return "";
+}
+
+// Decodes a JPEG case with libtiff, whole strips or tiles at a time, into
+// RGB or gray rows
+static bool decode_with_libtiff(const Case &c, const std::string &path, Image &image)
+{
+    TIFF *tif = TIFFOpen(path.c_str(), "r");
+
+    if (!tif)
+        return false;
+
+    if (c.image.spp == 3)
+        TIFFSetField(tif, TIFFTAG_JPEGCOLORMODE, JPEGCOLORMODE_RGB);
+
+    size_t row_size = c.image.row_size();
+    bool ok = true;
+
+    image.width = c.image.width;
+    image.height = c.image.height;
+    image.bit_depth = 8;
+    image.color_type = c.image.spp == 3 ? PNG_COLOR_TYPE_RGB : PNG_COLOR_TYPE_GRAY;
+    image.pixels.assign(row_size * c.image.height, 0);
+
+    if (c.image.tile_width) {
+        size_t tile_row = (size_t) c.image.tile_width * c.image.spp;
+        std::vector<uint8_t> tile(TIFFTileSize(tif));
+
+        for (uint32_t ty = 0; ty < c.image.height && ok; ty += c.image.tile_length) {
+            for (uint32_t tx = 0; tx < c.image.width && ok; tx += c.image.tile_width) {
+                ok = TIFFReadTile(tif, tile.data(), tx, ty, 0, 0) >= 0;
+
+                uint32_t rows = std::min(c.image.tile_length, c.image.height - ty);
+                size_t columns = std::min(c.image.tile_width, c.image.width - tx) * (size_t) c.image.spp;
+
+                for (uint32_t y = 0; y < rows && ok; y++)
+                    memcpy(&image.pixels[(ty + y) * row_size + tx * c.image.spp], &tile[y * tile_row], columns);
+            }
+        }
+    } else {
+        for (uint32_t strip = 0; strip < TIFFNumberOfStrips(tif) && ok; strip++)
+            ok = TIFFReadEncodedStrip(tif, strip, &image.pixels[strip * c.image.rows_per_strip * row_size],
+                                      (tmsize_t) -1) >= 0;
+    }
+
+    TIFFClose(tif);
+
+    return ok;
+}
+
+static bool read_png(const std::string &path, Image &image, std::string &error)
+{
+    FILE *file = fopen(path.c_str(), "rb");
+
+    if (!file) {
+        error = "no output";
+
+        return false;
+    }
+
+    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+    png_infop info = png ? png_create_info_struct(png) : nullptr;
+
+    if (!info || setjmp(png_jmpbuf(png))) {
+        png_destroy_read_struct(&png, &info, nullptr);
+        fclose(file);
+        error = "libpng could not decode the output";
+
+        return false;
+    }
+
+    png_init_io(png, file);
+    png_read_info(png, info);
+
+    image.width = png_get_image_width(png, info);
+    image.height = png_get_image_height(png, info);
+    image.bit_depth = png_get_bit_depth(png, info);
+    image.color_type = png_get_color_type(png, info);
+
+    size_t row_size = png_get_rowbytes(png, info);
+    image.pixels.assign(row_size * image.height, 0);
+
+    for (uint32_t y = 0; y < image.height; y++)
+        png_read_row(png, &image.pixels[y * row_size], nullptr);
+
+    //Checks the CRCs and Adler-32 to the end of the stream
+    png_read_end(png, nullptr);
+    png_destroy_read_struct(&png, &info, nullptr);
+    fclose(file);
+
+    return true;
+}
+
+// What the reference should have written, where it can be worked out
+// without repeating the converter's arithmetic
+static bool expected_pixels(const Case &test_case, const std::string &output_options, Image &image)
+{
+    const SyntheticImage &c = test_case.image;
+
+    //8-bit samples, which the output options leave alone
+    if (c.compression == COMPRESSION_JPEG) {
+        image = test_case.decoded;
+
+        return true;
+    }
+
+    if (!c.icc_profile.empty())
+        return false;
+
+    bool truncate = output_options.find("truncate") != std::string::npos;
+
+    if (c.bps == 16 && !output_options.empty() && !truncate)
+        return false;
+
+    bool reduce = c.bps == 16 && truncate;
+    static const int COLOR_TYPES[5] = {0, PNG_COLOR_TYPE_GRAY, PNG_COLOR_TYPE_GRAY_ALPHA,
+                                       PNG_COLOR_TYPE_RGB, PNG_COLOR_TYPE_RGBA};
+
+    image.width = c.width;
+    image.height = c.height;
+    image.bit_depth = reduce ? 8 : c.bps;
+    image.color_type = COLOR_TYPES[c.spp];
+    image.pixels.clear();
+
+    if (!reduce) {
+        image.pixels = test_case.pixels;
+
+        return true;
+    }
+
+    //Truncation keeps the high byte of each big-endian sample
+    for (size_t i = 0; i < test_case.pixels.size(); i += 2)
+        image.pixels.push_back(test_case.pixels[i]);
+
+    return true;
+}
+
+// Where two images first differ, or an empty string if they are the same
+static std::string compare(const Image &expected, const Image &actual)
+{
+    if (expected.width != actual.width || expected.height != actual.height)
+        return "size is " + std::to_string(actual.width) + "x" + std::to_string(actual.height) +
+               ", expected " + std::to_string(expected.width) + "x" + std::to_string(expected.height);
+
+    if (expected.bit_depth != actual.bit_depth || expected.color_type != actual.color_type)
+        return "bit depth " + std::to_string(actual.bit_depth) + " and color type " +
+               std::to_string(actual.color_type) + ", expected " + std::to_string(expected.bit_depth) +
+               " and " + std::to_string(expected.color_type);
+
+    size_t row_size = expected.height ? expected.pixels.size() / expected.height : 0;
+
+    for (size_t i = 0; i < expected.pixels.size(); i++) {
+        if (expected.pixels[i] != actual.pixels[i]) {
+            char message[96];
+            snprintf(message, sizeof(message), "row %zu byte %zu is 0x%02x, expected 0x%02x",
+                     i / row_size, i % row_size, actual.pixels[i], expected.pixels[i]);
+
+            return message;
+        }
+    }
+
+    return "";
+}
+
+// --codecs libtiff reads whatever we don't decode ourselves a row at a
+// time, which libtiff can't do for tiles. The file has to fail with a
+// decode error rather than be written with whatever was in the row buffer.
+static bool must_fail(const Case &c, const std::string &options)
+{
+    return c.image.tile_width && options.find("--codecs libtiff") != std::string::npos;
+}
+
+static std::string quote(const std::string &s)
+{
+    std::string quoted = "'";
+
+    for (char c : s) {
+        if (c == '\'')
+            quoted += "'\\''";
+        else
+            quoted += c;
+    }
+
+    return quoted + "'";
+}
+
+class Harness
+{
+public:
+    Harness(const std::string &tiff_png, const fs::path &dir) : tiff_png(tiff_png), dir(dir) {}
+
+    // JPEG cases get smooth pixels, which is what the format is for
+    void add(SyntheticImage image, std::mt19937 &random)
+    {
+        bool jpeg = image.compression == COMPRESSION_JPEG;
+        image.rows_per_strip = std::max<uint32_t>(std::min(image.rows_per_strip, image.height), 1);
+
+        Case c{"case-" + std::to_string(cases.size()), image,
+               jpeg ? gradient_pixels(image, random()) : fill(image, random), Image()};
+        std::string path = (dir / (c.name + ".tif")).string();
+
+        if (!write_synthetic_tiff(c.image, c.pixels, path) || (jpeg && !decode_with_libtiff(c, path, c.decoded))) {
+            std::cerr << "Could not write " << c.name << ": " << describe(c) << std::endl;
+
+            exit(1);
+        }
+
+        cases.push_back(std::move(c));
+    }
+
+    // Converts every case with options, and decodes the PNGs into images.
+    // Cases that must fail are checked to, and get an empty image. False if
+    // the converter failed as a whole.
+    bool convert(const std::string &options, std::vector<Image> &images)
+    {
+        //A profile from --calibrate would change the settings under test
+        std::string command = quote(tiff_png) + " --profile none " + options;
+        fs::path log = dir / "output.txt";
+
+        for (const Case &c : cases) {
+            fs::remove(dir / (c.name + ".png"));
+            command += " " + quote((dir / (c.name + ".tif")).string());
+        }
+
+        command += " > " + quote(log.string()) + " 2>&1";
+
+        int status = system(command.c_str());
+        runs++;
+
+        //1 means that some files failed, which they list at the end
+        if (status == -1 || !WIFEXITED(status) || WEXITSTATUS(status) > 1) {
+            std::cerr << "tiff-png " << options << " failed:" << std::endl
+                      << std::ifstream(log).rdbuf() << std::endl;
+
+            return false;
+        }
+
+        static const std::string FAILED = "Failed to convert: ";
+        std::set<std::string> failed;
+        std::ifstream output(log);
+        std::string line;
+
+        while (std::getline(output, line)) {
+            if (line.compare(0, FAILED.size(), FAILED) == 0)
+                failed.insert(line.substr(FAILED.size()));
+        }
+
+        images.assign(cases.size(), Image());
+
+        for (size_t i = 0; i < cases.size(); i++) {
+            bool expected = must_fail(cases[i], options);
+            std::string error;
+
+            if (failed.count((dir / (cases[i].name + ".tif")).string()) != (size_t) expected)
+                fail(cases[i], options, expected ? "converted, but libtiff can't read it this way" : "failed");
+            else if (!expected && !read_png((dir / (cases[i].name + ".png")).string(), images[i], error))
+                fail(cases[i], options, error);
+        }
+
+        return true;
+    }
+
+    void fail(const Case &c, const std::string &options, const std::string &message)
+    {
+        if (++failures <= MAX_REPORTED)
+            std::cerr << "FAIL " << c.name << " (" << describe(c) << ") with '" << options
+                      << "': " << message << std::endl;
+    }
+
+    std::vector<Case> cases;
+    int failures = 0;
+    int runs = 0;
+
+private:
+    std::string tiff_png;
+    fs::path dir;
+};
+
+static void print_usage(const char *program)
+{
+    std::cout << "Usage: " << program << " TIFF_PNG [--seed N] [--random N] [--keep]" << std::endl
+              << std::endl
+              << "  --seed N    Seed for the pixels and the random cases (default 1)" << std::endl
+              << "  --random N  Cases with random sizes and layouts to add (default 40)" << std::endl
+              << "  --keep      Keep the work directory with the TIFFs and PNGs" << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2 || strncmp(argv[1], "--", 2) == 0)
+    {
+        print_usage(argv[0]);
+
+        return 1;
+    }
+
+    std::string tiff_png = fs::absolute(argv[1]).string();
+    unsigned seed = 1;
+    unsigned random_cases = 40;
+    bool keep = false;
+
+    for (int i = 2; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--keep") == 0)
+            keep = true;
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+            seed = (unsigned) strtoul(argv[++i], nullptr, 10);
+        else if (strcmp(argv[i], "--random") == 0 && i + 1 < argc)
+            random_cases = (unsigned) strtoul(argv[++i], nullptr, 10);
+        else
+        {
+            print_usage(argv[0]);
+
+            return 1;
+        }
+    }
+
+    char dir_template[] = "/tmp/tiff-png-differential-XXXXXX";
+
+    if (!mkdtemp(dir_template))
+    {
+        std::cerr << "Could not create a work directory" << std::endl;
+
+        return 1;
+    }
+
+    fs::path dir = dir_template;
+    Harness harness(tiff_png, dir);
+    std::mt19937 random(seed);
+    size_t next_size = 0;
+
+    // Every layout with every compression it allows, in both byte orders.
+    // libtiff only applies the horizontal predictor to 8 and 16-bit samples.
+    for (const Layout &layout : LAYOUTS)
+    {
+        for (const Compression &compression : COMPRESSIONS)
+        {
+            if (compression.predictor != PREDICTOR_NONE && layout.bps < 8)
+                continue;
+
+            for (bool big_endian : {false, true})
+            {
+                const uint32_t *size = SIZES[next_size++ % (sizeof(SIZES) / sizeof(SIZES[0]))];
+
+                harness.add({size[0], size[1], layout.bps, layout.spp, compression.compression,
+                             compression.predictor, size[2], big_endian}, random);
+            }
+        }
+    }
+
+    // Single strips larger than the 256K bands of --memory-limit 1M
+    harness.add({700, 200, 16, 3, COMPRESSION_NONE, PREDICTOR_NONE, 200, false}, random);
+    harness.add({1200, 300, 8, 3, COMPRESSION_LZW, PREDICTOR_HORIZONTAL, 300, true}, random);
+
+    // JPEG strips and tiles, with partial ones at the edges. libtiff needs
+    // multiples of 16 rows for the YCbCr strips and of 16 pixels for tiles.
+    harness.add({75, 41, 8, 1, COMPRESSION_JPEG, PREDICTOR_NONE, 16, false}, random);
+    harness.add({203, 50, 8, 3, COMPRESSION_JPEG, PREDICTOR_NONE, 16, true}, random);
+    harness.add({640, 200, 8, 3, COMPRESSION_JPEG, PREDICTOR_NONE, 200, false}, random);
+    harness.add({50, 33, 8, 1, COMPRESSION_JPEG, PREDICTOR_NONE, 0, true, 16, 16}, random);
+    harness.add({100, 70, 8, 3, COMPRESSION_JPEG, PREDICTOR_NONE, 0, false, 32, 16}, random);
+
+    // Embedded ICC profiles, converted to sRGB
+    harness.add({255, 40, 8, 3, COMPRESSION_NONE, PREDICTOR_NONE, 40, false, 0, 0, icc_profile()}, random);
+    harness.add({97, 23, 16, 4, COMPRESSION_LZW, PREDICTOR_HORIZONTAL, 5, true, 0, 0, icc_profile()}, random);
+
+    for (unsigned i = 0; i < random_cases; i++)
+    {
+        const Layout &layout = LAYOUTS[random() % (sizeof(LAYOUTS) / sizeof(LAYOUTS[0]))];
+        const Compression &compression = COMPRESSIONS[random() % (sizeof(COMPRESSIONS) / sizeof(COMPRESSIONS[0]))];
+        uint32_t width = random() % 3 == 0 ? (uint32_t) (random() % 8 + 1) : (uint32_t) (random() % 600 + 1);
+        uint32_t height = (uint32_t) (random() % 80 + 1);
+        uint32_t rows_per_strip = random() % 3 == 0 ? 1 : (uint32_t) (random() % height + 1);
+
+        harness.add({width, height, layout.bps, layout.spp, compression.compression,
+                     layout.bps < 8 ? (uint16_t) PREDICTOR_NONE : compression.predictor,
+                     rows_per_strip, random() % 2 == 0}, random);
+    }
+
+    std::vector<std::string> fast_paths(std::begin(FAST_PATHS), std::end(FAST_PATHS));
+
+    for (const KernelTable *table : supported_kernels())
+    {
+        fast_paths.push_back(std::string("--cpu ") + table->name);
+        fast_paths.push_back(std::string("--cpu ") + table->name + " --encoder custom");
+    }
+
+    std::string reference_path = std::string("--codecs libtiff --encoder libpng --jobs 1 --cpu ") +
+                                 supported_kernels().front()->name;
+    bool ran = true;
+
+    for (const char *output_options : OUTPUT_OPTIONS)
+    {
+        std::vector<Image> reference, images;
+        std::string options = std::string(output_options) + " " + reference_path;
+
+        if (!harness.convert(options, reference))
+        {
+            ran = false;
+
+            break;
+        }
+
+        for (size_t i = 0; i < harness.cases.size(); i++)
+        {
+            const Case &c = harness.cases[i];
+            Image expected;
+
+            if (c.image.tile_width)
+            {
+                reference[i] = c.decoded;
+
+                continue;
+            }
+
+            if (reference[i].height && expected_pixels(c, output_options, expected))
+            {
+                std::string difference = compare(expected, reference[i]);
+
+                if (!difference.empty())
+                    harness.fail(c, options, "reference: " + difference);
+            }
+
+            if (reference[i].height && !c.image.icc_profile.empty() && !*output_options)
+            {
+                std::string difference = compare_with_transform(c, reference[i]);
+
+                if (!difference.empty())
+                    harness.fail(c, options, "reference against the ICC transform: " + difference);
+            }
+        }
+
+        for (const std::string &fast_path : fast_paths)
+        {
+            options = std::string(output_options) + " " + fast_path;
+
+            if (!harness.convert(options, images))
+            {
+                ran = false;
+
+                continue;
+            }
+
+            for (size_t i = 0; i < harness.cases.size(); i++)
+            {
+                if (!reference[i].height || !images[i].height)
+                    continue;
+
+                std::string difference = compare(reference[i], images[i]);
+
+                if (!difference.empty())
+                    harness.fail(harness.cases[i], options, difference);
+            }
+        }
+    }
+
+    if (keep)
+        std::cout << "Work directory: " << dir.string() << std::endl;
+    else
+        fs::remove_all(dir);
+
+    if (harness.failures > MAX_REPORTED)
+        std::cerr << "... and " << harness.failures - MAX_REPORTED << " more" << std::endl;
+
+    std::cout << harness.cases.size() << " files, " << harness.runs << " conversions of each, "
+              << harness.failures << " failures" << std::endl;
+
+    return ran && harness.failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,534 @@
+// Converts TIFFs with awkward file names using --log-json, and checks that
+// every record is valid UTF-8 and valid JSON, and that the file names come
+// back as they were given.
+//
+// File names are bytes, not text. Names that are valid UTF-8, or that hold
+// quotes, backslashes or control characters, must come back unchanged.
+// Bytes outside well-formed UTF-8 sequences (stray continuation bytes,
+// overlong forms, surrogates, truncated sequences and bytes that never
+// appear in UTF-8) must each come back as U+FFFD.
+
+#include <sys/wait.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "../synthetic.h"
+
+namespace fs = std::filesystem;
+
+struct Name
+{
+    //As written to the disk
+    std::string file;
+    //As the log should give it back
+    std::string logged;
+};
+
+//U+FFFD, the replacement character, in UTF-8
+#define REPLACEMENT "\xef\xbf\xbd"
+
+static const Name NAMES[] = {
+    {"plain.tif", "plain.tif"},
+    {"caf\xc3\xa9 \xe2\x82\xac \xf0\x9f\x93\xb7.tif", "caf\xc3\xa9 \xe2\x82\xac \xf0\x9f\x93\xb7.tif"},
+    {"quote\" backslash\\ tab\t newline\n.tif", "quote\" backslash\\ tab\t newline\n.tif"},
+    {"latin1-caf\xe9.tif", "latin1-caf" REPLACEMENT ".tif"},
+    {"bytes-\xff\xfe.tif", "bytes-" REPLACEMENT REPLACEMENT ".tif"},
+    {"continuation-\x80\xbf.tif", "continuation-" REPLACEMENT REPLACEMENT ".tif"},
+    {"overlong-\xc0\xaf.tif", "overlong-" REPLACEMENT REPLACEMENT ".tif"},
+    {"surrogate-\xed\xa0\x80.tif", "surrogate-" REPLACEMENT REPLACEMENT REPLACEMENT ".tif"},
+    {"past-max-\xf4\x90\x80\x80.tif", "past-max-" REPLACEMENT REPLACEMENT REPLACEMENT REPLACEMENT ".tif"},
+    {"truncated-\xe2\x82.tif", "truncated-" REPLACEMENT REPLACEMENT ".tif"},
+};
+
+// True if s is well-formed UTF-8
+static bool valid_utf8(const std::string &s)
+{
+    const unsigned char *p = (const unsigned char *) s.data();
+    size_t size = s.size();
+
+    for (size_t i = 0; i < size;) {
+        unsigned char c = p[i];
+        uint32_t code = 0;
+        size_t length;
+
+        if (c < 0x80) {
+            i++;
+
+            continue;
+        }
+
+        if ((c & 0xe0) == 0xc0) {
+            length = 2;
+            code = c & 0x1f;
+        } else if ((c & 0xf0) == 0xe0) {
+            length = 3;
+            code = c & 0x0f;
+        } else if ((c & 0xf8) == 0xf0) {
+            length = 4;
+            code = c & 0x07;
+        } else {
+            return false;
+        }
+
+        if (size - i < length)
+            return false;
+
+        for (size_t k = 1; k < length; k++) {
+            if ((p[i + k] & 0xc0) != 0x80)
+                return false;
+
+            code = code << 6 | (p[i + k] & 0x3f);
+        }
+
+        static const uint32_t MIN_CODE[5] = {0, 0, 0x80, 0x800, 0x10000};
+
+        if (code < MIN_CODE[length] || code > 0x10ffff || (code >= 0xd800 && code <= 0xdfff))
+            return false;
+
+        i += length;
+    }
+
+    return true;
+}
+
+static void append_utf8(std::string &out, uint32_t code)
+{
+    if (code < 0x80) {
+        out += (char) code;
+    } else if (code < 0x800) {
+        out += (char) (0xc0 | code >> 6);
+        out += (char) (0x80 | (code & 0x3f));
+    } else if (code < 0x10000) {
+        out += (char) (0xe0 | code >> 12);
+        out += (char) (0x80 | (code >> 6 & 0x3f));
+        out += (char) (0x80 | (code & 0x3f));
+    } else {
+        out += (char) (0xf0 | code >> 18);
+        out += (char) (0x80 | (code >> 12 & 0x3f));
+        out += (char) (0x80 | (code >> 6 & 0x3f));
+        out += (char) (0x80 | (code & 0x3f));
+    }
+}
+
+// A strict JSON parser that keeps only the top-level string members of an
+// object, which is all the records need checking for
+class JsonParser
+{
+public:
+    explicit JsonParser(const std::string &text) : text(text) {}
+
+    // False with error set if the text isn't one JSON object
+    bool parse_record(std::vector<std::pair<std::string, std::string>> &strings)
+    {
+        skip_space();
+
+        if (!peek('{'))
+            return failed("expected an object");
+
+        pos++;
+        skip_space();
+
+        if (peek('}'))
+            pos++;
+        else {
+            while (true) {
+                std::string key, value;
+                skip_space();
+
+                if (!parse_string(key))
+                    return false;
+
+                skip_space();
+
+                if (!peek(':'))
+                    return failed("expected ':'");
+
+                pos++;
+                skip_space();
+
+                if (peek('"')) {
+                    if (!parse_string(value))
+                        return false;
+
+                    strings.emplace_back(key, value);
+                } else if (!parse_value()) {
+                    return false;
+                }
+
+                skip_space();
+
+                if (peek(',')) {
+                    pos++;
+                } else if (peek('}')) {
+                    pos++;
+
+                    break;
+                } else {
+                    return failed("expected ',' or '}'");
+                }
+            }
+        }
+
+        skip_space();
+
+        return pos == text.size() || failed("text after the object");
+    }
+
+    std::string error;
+
+private:
+    bool peek(char c) const { return pos < text.size() && text[pos] == c; }
+
+    bool failed(const std::string &message)
+    {
+        error = message + " at byte " + std::to_string(pos);
+
+        return false;
+    }
+
+    void skip_space()
+    {
+        while (pos < text.size() && text[pos] && strchr(" \t\r\n", text[pos]))
+            pos++;
+    }
+
+    bool parse_value()
+    {
+        std::string ignored;
+
+        if (peek('"'))
+            return parse_string(ignored);
+
+        if (peek('{') || peek('[')) {
+            char close = text[pos] == '{' ? '}' : ']';
+            bool object = close == '}';
+            pos++;
+            skip_space();
+
+            if (peek(close)) {
+                pos++;
+
+                return true;
+            }
+
+            while (true) {
+                skip_space();
+
+                if (object) {
+                    if (!parse_string(ignored))
+                        return false;
+
+                    skip_space();
+
+                    if (!peek(':'))
+                        return failed("expected ':'");
+
+                    pos++;
+                    skip_space();
+                }
+
+                if (!parse_value())
+                    return false;
+
+                skip_space();
+
+                if (peek(',')) {
+                    pos++;
+                } else if (peek(close)) {
+                    pos++;
+
+                    return true;
+                } else {
+                    return failed("expected ',' or the end of a container");
+                }
+            }
+        }
+
+        for (const char *word : {"true", "false", "null"}) {
+            if (text.compare(pos, strlen(word), word) == 0) {
+                pos += strlen(word);
+
+                return true;
+            }
+        }
+
+        return parse_number();
+    }
+
+    bool parse_number()
+    {
+        size_t start = pos;
+
+        if (peek('-'))
+            pos++;
+
+        if (peek('0'))
+            pos++;
+        else if (!skip_digits())
+            return failed("expected a value");
+
+        if (peek('.')) {
+            pos++;
+
+            if (!skip_digits())
+                return failed("expected digits after '.'");
+        }
+
+        if (peek('e') || peek('E')) {
+            pos++;
+
+            if (peek('+') || peek('-'))
+                pos++;
+
+            if (!skip_digits())
+                return failed("expected an exponent");
+        }
+
+        return pos > start;
+    }
+
+    bool skip_digits()
+    {
+        size_t start = pos;
+
+        while (pos < text.size() && text[pos] >= '0' && text[pos] <= '9')
+            pos++;
+
+        return pos > start;
+    }
+
+    bool parse_hex4(uint32_t &code)
+    {
+        if (text.size() - pos < 4)
+            return failed("truncated \\u escape");
+
+        code = 0;
+
+        for (int i = 0; i < 4; i++) {
+            char c = text[pos++];
+            const char *digits = "0123456789abcdef";
+            const char *digit = c ? strchr(digits, c | 0x20) : nullptr;
+
+            if (!digit)
+                return failed("bad \\u escape");
+
+            code = code << 4 | (uint32_t) (digit - digits);
+        }
+
+        return true;
+    }
+
+    bool parse_string(std::string &out)
+    {
+        if (!peek('"'))
+            return failed("expected a string");
+
+        pos++;
+
+        while (pos < text.size() && text[pos] != '"') {
+            unsigned char c = (unsigned char) text[pos];
+
+            if (c < 0x20)
+                return failed("unescaped control character");
+
+            if (c != '\\') {
+                out += (char) c;
+                pos++;
+
+                continue;
+            }
+
+            if (++pos == text.size())
+                return failed("truncated escape");
+
+            static const char ESCAPES[] = "\"\\/bfnrt";
+            static const char ESCAPED[] = "\"\\/\b\f\n\r\t";
+            char escape = text[pos++];
+            const char *simple = escape ? strchr(ESCAPES, escape) : nullptr;
+
+            if (simple) {
+                out += ESCAPED[simple - ESCAPES];
+
+                continue;
+            }
+
+            uint32_t code = 0, low = 0;
+
+            if (escape != 'u' || !parse_hex4(code))
+                return error.empty() ? failed("bad escape") : false;
+
+            if (code >= 0xd800 && code <= 0xdbff) {
+                if (text.compare(pos, 2, "\\u") != 0)
+                    return failed("unpaired surrogate");
+
+                pos += 2;
+
+                if (!parse_hex4(low))
+                    return false;
+
+                if (low < 0xdc00 || low > 0xdfff)
+                    return failed("unpaired surrogate");
+
+                code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+            } else if (code >= 0xdc00 && code <= 0xdfff) {
+                return failed("unpaired surrogate");
+            }
+
+            append_utf8(out, code);
+        }
+
+        if (!peek('"'))
+            return failed("unterminated string");
+
+        pos++;
+
+        return true;
+    }
+
+    const std::string &text;
+    size_t pos = 0;
+};
+
+static std::string quote(const std::string &s)
+{
+    std::string quoted = "'";
+
+    for (char c : s) {
+        if (c == '\'')
+            quoted += "'\\''";
+        else
+            quoted += c;
+    }
+
+    return quoted + "'";
+}
+
+// The name with control characters and bytes past ASCII shown as \xNN
+static std::string printable(const std::string &s)
+{
+    std::string out;
+
+    for (unsigned char c : s) {
+        if (c < 0x20 || c >= 0x7f) {
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\x%02x", c);
+            out += escape;
+        } else {
+            out += (char) c;
+        }
+    }
+
+    return out;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2)
+    {
+        std::cout << "Usage: " << argv[0] << " TIFF_PNG" << std::endl;
+
+        return 1;
+    }
+
+    std::string tiff_png = fs::absolute(argv[1]).string();
+    char dir_template[] = "/tmp/tiff-png-log-json-XXXXXX";
+
+    if (!mkdtemp(dir_template))
+    {
+        std::cerr << "Could not create a work directory" << std::endl;
+
+        return 1;
+    }
+
+    std::string dir = dir_template;
+    std::string log = dir + "/log.jsonl";
+    SyntheticImage image;
+    image.width = 16;
+    image.height = 16;
+    std::vector<uint8_t> pixels = gradient_pixels(image, 1);
+
+    //A profile from --calibrate doesn't matter here, but isn't wanted either
+    std::string command = quote(tiff_png) + " --profile none --log-json " + quote(log);
+    std::set<std::string> expected;
+    int failures = 0;
+
+    for (const Name &name : NAMES)
+    {
+        std::string path = dir + "/" + name.file;
+
+        if (!write_synthetic_tiff(image, pixels, path))
+        {
+            std::cerr << "Could not write " << printable(path) << std::endl;
+            fs::remove_all(dir);
+
+            return 1;
+        }
+
+        command += " " + quote(path);
+        expected.insert(dir + "/" + name.logged);
+    }
+
+    command += " > " + quote(dir + "/output.txt") + " 2>&1";
+
+    int status = system(command.c_str());
+
+    if (status == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        std::cerr << "tiff-png failed:" << std::endl
+                  << std::ifstream(dir + "/output.txt").rdbuf() << std::endl;
+        fs::remove_all(dir);
+
+        return 1;
+    }
+
+    std::ifstream records(log);
+    std::string line;
+    size_t count = 0;
+
+    while (std::getline(records, line))
+    {
+        std::vector<std::pair<std::string, std::string>> strings;
+        JsonParser parser(line);
+        count++;
+
+        if (!valid_utf8(line))
+        {
+            std::cerr << "FAIL record " << count << " is not valid UTF-8: " << printable(line) << std::endl;
+            failures++;
+        }
+        else if (!parser.parse_record(strings))
+        {
+            std::cerr << "FAIL record " << count << " is not valid JSON (" << parser.error
+                      << "): " << printable(line) << std::endl;
+            failures++;
+        }
+
+        for (const auto &[key, value] : strings)
+        {
+            if (key == "file" && !expected.erase(value))
+            {
+                std::cerr << "FAIL unexpected file name " << printable(value) << std::endl;
+                failures++;
+            }
+        }
+    }
+
+    for (const std::string &name : expected)
+    {
+        std::cerr << "FAIL no record with file name " << printable(name) << std::endl;
+        failures++;
+    }
+
+    fs::remove_all(dir);
+
+    std::cout << count << " records, " << failures << " failures" << std::endl;
+
+    return failures == 0 && count == sizeof(NAMES) / sizeof(NAMES[0]) ? 0 : 1;
+}
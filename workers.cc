@@ -0,0 +1,216 @@
+#include "workers.h"
+
+#include <sched.h>
+#include <dirent.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <thread>
+
+// Parses a sysfs CPU list such as "0-7,16-23"
+static std::vector<int> parse_cpu_list(const std::string &list)
+{
+    std::vector<int> cpus;
+    const char *p = list.c_str();
+
+    while (*p) {
+        char *end = nullptr;
+        long first = strtol(p, &end, 10);
+
+        if (end == p)
+            break;
+
+        long last = first;
+        p = end;
+
+        if (*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            p = end;
+        }
+
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+            cpus.push_back((int) cpu);
+
+        if (*p == ',')
+            p++;
+        else
+            break;
+    }
+
+    return cpus;
+}
+
+std::vector<NumaNode> numa_nodes()
+{
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            CPU_SET(cpu, &allowed);
+
+    std::vector<NumaNode> nodes;
+    DIR *dir = opendir("/sys/devices/system/node");
+
+    if (dir) {
+        while (dirent *entry = readdir(dir)) {
+            int id = 0;
+            char extra;
+
+            if (sscanf(entry->d_name, "node%d%c", &id, &extra) != 1)
+                continue;
+
+            std::ifstream file(std::string("/sys/devices/system/node/") + entry->d_name + "/cpulist");
+            std::string list;
+            std::getline(file, list);
+
+            NumaNode node;
+            node.id = id;
+
+            //Nodes with memory but no CPUs we may use get no workers
+            for (int cpu : parse_cpu_list(list))
+                if (CPU_ISSET(cpu, &allowed))
+                    node.cpus.push_back(cpu);
+
+            if (!node.cpus.empty())
+                nodes.push_back(std::move(node));
+        }
+
+        closedir(dir);
+    }
+
+    if (nodes.empty()) {
+        NumaNode node;
+
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            if (CPU_ISSET(cpu, &allowed))
+                node.cpus.push_back(cpu);
+
+        nodes.push_back(std::move(node));
+    }
+
+    std::sort(nodes.begin(), nodes.end(),
+              [](const NumaNode &a, const NumaNode &b) { return a.id < b.id; });
+
+    return nodes;
+}
+
+WorkerPool::WorkerPool(unsigned workers)
+    : nodes(numa_nodes())
+{
+    size_t total = 0;
+
+    for (const NumaNode &node : nodes)
+        total += node.cpus.size();
+
+    if (workers == 0)
+        workers = (unsigned) std::max<size_t>(total, 1);
+
+    // Worker w goes to the node holding CPU number w * total / workers when
+    // the nodes' CPUs are laid end to end, which shares the workers out in
+    // proportion to the CPUs
+    for (unsigned w = 0; w < workers; w++) {
+        size_t position = (size_t) w * total / workers;
+        size_t node = 0;
+
+        while (node + 1 < nodes.size() && position >= nodes[node].cpus.size()) {
+            position -= nodes[node].cpus.size();
+            node++;
+        }
+
+        placement.push_back(node);
+    }
+
+    limit = workers;
+}
+
+void WorkerPool::limit_workers(unsigned count)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        limit = std::clamp<unsigned>(count, 1, size());
+    }
+
+    changed.notify_all();
+}
+
+unsigned WorkerPool::worker_limit() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    return limit;
+}
+
+// Restricts the calling thread to the CPUs of node. Failing only costs
+// locality, so errors are ignored.
+static void pin_to_node(const NumaNode &node)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+
+    for (int cpu : node.cpus)
+        CPU_SET(cpu, &set);
+
+    sched_setaffinity(0, sizeof(set), &set);
+}
+
+bool WorkerPool::take_job(size_t worker, size_t &job)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+
+    changed.wait(lock, [&] { return worker < limit || unclaimed == 0; });
+
+    if (unclaimed == 0)
+        return false;
+
+    for (size_t i = 0; i < queues.size(); i++) {
+        size_t node = (placement[worker] + i) % queues.size();
+
+        if (taken[node] < queues[node].size()) {
+            job = queues[node][taken[node]++];
+            running.fetch_add(1, std::memory_order_relaxed);
+
+            //Workers held back by the limit can stop waiting
+            if (--unclaimed == 0)
+                changed.notify_all();
+
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void WorkerPool::run(size_t count, const std::function<void(size_t job)> &work)
+{
+    //Jobs are dealt out like the workers, in proportion to each node's share
+    queues.assign(nodes.size(), {});
+    taken.assign(nodes.size(), 0);
+    unclaimed = count;
+
+    for (size_t job = 0; job < count; job++)
+        queues[placement[job % placement.size()]].push_back(job);
+
+    std::vector<std::thread> threads;
+
+    for (size_t w = 0; w < placement.size(); w++) {
+        threads.emplace_back([this, &work, w] {
+            //A single node leaves placement to the scheduler
+            if (nodes.size() > 1)
+                pin_to_node(nodes[placement[w]]);
+
+            size_t job;
+
+            while (take_job(w, job)) {
+                work(job);
+                running.fetch_sub(1, std::memory_order_relaxed);
+            }
+        });
+    }
+
+    for (std::thread &thread : threads)
+        thread.join();
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+// A NUMA node and those of its CPUs the process may run on
+struct NumaNode
+{
+    int id = 0;
+    std::vector<int> cpus;
+};
+
+// The NUMA nodes with CPUs available to the process, read from sysfs.
+// Without NUMA information all available CPUs are reported as node 0.
+std::vector<NumaNode> numa_nodes();
+
+// Runs jobs on a set of worker threads. Workers are spread over the NUMA
+// nodes in proportion to their CPUs, and each is pinned to the CPUs of its
+// node. Linux places memory on the node of the thread that first touches
+// it, so everything a job allocates, such as its row buffers and encoder
+// state, is local to the worker running it.
+//
+// Jobs are dealt out to the nodes up front. A worker takes the jobs queued
+// on its own node, and only then helps with those of other nodes. Each job
+// runs start to finish on one worker, so a file is decoded and encoded on
+// the same node.
+class WorkerPool
+{
+public:
+    // 0 workers means one for each available CPU
+    explicit WorkerPool(unsigned workers);
+
+    unsigned size() const { return (unsigned) placement.size(); }
+
+    // Calls work(job) for each job from 0 to count - 1 and returns once all
+    // have finished. work must not throw.
+    void run(size_t count, const std::function<void(size_t job)> &work);
+
+    // Lets only the first count workers start jobs, at least 1. The others
+    // finish the job they are on, then wait until the limit is raised. Can
+    // be called from any thread while run() is going.
+    void limit_workers(unsigned count);
+
+    unsigned worker_limit() const;
+
+    // Workers in the middle of a job, as opposed to idle or held back by
+    // the limit
+    unsigned running_workers() const { return running.load(std::memory_order_relaxed); }
+
+private:
+    // Takes the next job for worker, from its own node's queue first,
+    // waiting while the worker is over the limit. Returns false once every
+    // job has been taken.
+    bool take_job(size_t worker, size_t &job);
+
+    std::vector<NumaNode> nodes;
+    //Index into nodes of each worker
+    std::vector<size_t> placement;
+
+    //Jobs queued on each node, and how many of them have been taken
+    std::vector<std::vector<size_t>> queues;
+    std::vector<size_t> taken;
+    size_t unclaimed = 0;
+
+    mutable std::mutex mutex;
+    std::condition_variable changed;
+    unsigned limit = 0;
+    std::atomic<unsigned> running{0};
+};